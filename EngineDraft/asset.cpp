@@ -1,5 +1,6 @@
 #include "asset.h"
 #include "utils.h"
+#include "object_archive.h"
 #include <windows.h>
 //#include <wrl.h>
 //#include <process.h>
@@ -51,10 +52,11 @@ AssetId AssetManager::PathToAssetId(const std::string& path) const
 	return HashString64(path.c_str());
 }
 
-std::shared_ptr<serialization::ObjectArchive> AssetManager::GetObjectArchive(AssetId , bool)
+std::shared_ptr<serialization::ObjectArchive> AssetManager::GetObjectArchive(AssetId asset_id) const
 {
-
-	return nullptr;
+	std::lock_guard<std::mutex> lock(mutex_);
+	const auto it = assets_in_memory_.find(asset_id);
+	return (it != assets_in_memory_.end()) ? std::dynamic_pointer_cast<serialization::ObjectArchive>(it->second) : nullptr;
 }
 
 void AssetManager::SaveObjectArchive(std::shared_ptr<serialization::ObjectArchive>)
@@ -70,4 +72,158 @@ std::shared_ptr<serialization::ObjectArchive> AssetManager::CreateObjectArchive(
 void AssetManager::ScanAssets()
 {
 	fs::path content_path(GetContentPath());
+}
+
+void AssetManager::AddLoadedAsset(std::shared_ptr<Asset> asset)
+{
+	Assert(asset && (kWrongID64 != asset->asset_id_));
+	std::lock_guard<std::mutex> lock(mutex_);
+	asset->version_ = ++load_count_[asset->asset_id_];
+	merged_templates_.Invalidate(asset->asset_id_, asset->version_);
+	assets_in_memory_[asset->asset_id_] = std::move(asset);
+}
+
+void AssetManager::UnloadAsset(AssetId asset_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	assets_in_memory_.erase(asset_id);
+	merged_templates_.Invalidate(asset_id, load_count_[asset_id] + 1); // the next load gets it
+}
+
+std::shared_ptr<const serialization::DataTemplate> MergedTemplateCache::FindOrMerge(const Key& key
+	, std::span<const Dependency> dependencies, const std::function<serialization::DataTemplate()>& merge)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		const auto it = entry_by_key_.find(key);
+		if (it != entry_by_key_.end())
+		{
+			entries_.splice(entries_.begin(), entries_, it->second);
+			return it->second->merged;
+		}
+	}
+
+	// Merged outside of the lock. When another thread was faster, its result is used.
+	auto merged = std::make_shared<const serialization::DataTemplate>(merge());
+	const uint64 size = merged->tags_.size() * sizeof(serialization::Tag) + merged->data_.size() + merged->GetStrings().size();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	const auto it = entry_by_key_.find(key);
+	if (it != entry_by_key_.end())
+	{
+		entries_.splice(entries_.begin(), entries_, it->second);
+		return it->second->merged;
+	}
+	// An archive could be invalidated during the merge, its old version must not be cached after that
+	if (std::any_of(dependencies.begin(), dependencies.end(), [this](const Dependency& dep) { return IsStale(dep); }))
+		return merged;
+	entries_.push_front(Entry{ key, merged, size, std::vector<Dependency>(dependencies.begin(), dependencies.end()) });
+	entry_by_key_.emplace(key, entries_.begin());
+	used_memory_ += size;
+	EvictOverBudget();
+	return merged;
+}
+
+void MergedTemplateCache::Invalidate(const AssetId archive_id, const uint32 first_valid_version)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	uint32& first_valid = first_valid_version_[archive_id];
+	first_valid = std::max(first_valid, first_valid_version);
+	for (auto it = entries_.begin(); it != entries_.end();)
+	{
+		const auto& deps = it->dependencies;
+		const auto next = std::next(it);
+		if (std::any_of(deps.begin(), deps.end(), [&](const Dependency& dep)
+			{ return (dep.archive_id == archive_id) && (dep.archive_version < first_valid); }))
+		{
+			Remove(it);
+		}
+		it = next;
+	}
+}
+
+void MergedTemplateCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	entries_.clear();
+	entry_by_key_.clear();
+	used_memory_ = 0;
+}
+
+void MergedTemplateCache::SetBudget(const uint64 bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	budget_ = bytes;
+	EvictOverBudget();
+}
+
+uint64 MergedTemplateCache::GetUsedMemory() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return used_memory_;
+}
+
+uint32 MergedTemplateCache::GetNum() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return static_cast<uint32>(entries_.size());
+}
+
+bool MergedTemplateCache::IsStale(const Dependency& dependency) const
+{
+	const auto it = first_valid_version_.find(dependency.archive_id);
+	return (it != first_valid_version_.end()) && (dependency.archive_version < it->second);
+}
+
+void MergedTemplateCache::Remove(std::list<Entry>::iterator it)
+{
+	used_memory_ -= it->size;
+	entry_by_key_.erase(it->key);
+	entries_.erase(it);
+}
+
+// Templates still used by the callers stay alive, the cache only drops its reference
+void MergedTemplateCache::EvictOverBudget()
+{
+	while ((used_memory_ > budget_) && !entries_.empty())
+	{
+		Remove(std::prev(entries_.end()));
+	}
+}
+
+bool MappedFile::Open(const std::string& path)
+{
+	Close();
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (INVALID_HANDLE_VALUE == file)
+		return false;
+	LARGE_INTEGER size;
+	// An empty file cannot be mapped
+	HANDLE mapping = (GetFileSizeEx(file, &size) && size.QuadPart) ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+	CloseHandle(file); // the mapping keeps the file open
+	const void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!data)
+	{
+		if (mapping)
+		{
+			CloseHandle(mapping);
+		}
+		return false;
+	}
+	mapping_ = mapping;
+	data_ = static_cast<const uint8*>(data);
+	size_ = static_cast<uint64>(size.QuadPart);
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (data_)
+	{
+		UnmapViewOfFile(data_);
+		CloseHandle(mapping_);
+	}
+	mapping_ = nullptr;
+	data_ = nullptr;
+	size_ = 0;
 }
\ No newline at end of file
@@ -1,11 +1,15 @@
 #pragma once
 
+#include <span>
+#include <list>
+#include <mutex>
 #include "utils.h"
 #include "reflection.h"
 
 namespace serialization
 {
 	class ObjectArchive;
+	struct DataTemplate;
 }
 
 namespace asset
@@ -13,27 +17,116 @@ namespace asset
 	using AssetId = uint64;
 	constexpr uint64 kWrongID64 = 0xFFFFFFFFFFFFFFFF;
 
-	class Asset
+	class Asset : public std::enable_shared_from_this<Asset>
 	{
 	public:
 		AssetId asset_id_ = kWrongID64;
+		uint32 version_ = 0; // changes with every load of the asset
 
 		virtual ~Asset() = default;
 	};
 
+	// Read-only view of a whole file, the bytes stay valid until Close. See serialization::ParseDataTemplateView.
+	class MappedFile
+	{
+		void* mapping_ = nullptr;
+		const uint8* data_ = nullptr;
+		uint64 size_ = 0;
+	public:
+		MappedFile() = default;
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		~MappedFile() { Close(); }
+
+		bool Open(const std::string& path);
+		void Close();
+		bool IsOpen() const { return nullptr != data_; }
+		std::span<const uint8> GetBytes() const { return { data_, static_cast<size_t>(size_) }; }
+	};
+
+	// Merged templates of archive objects (the base object template with the diff applied), shared by all spawns
+	// of the same prefab. The least recently used entries are dropped above the memory budget.
+	class MergedTemplateCache
+	{
+	public:
+		struct Key
+		{
+			AssetId archive_id = kWrongID64;
+			uint32 archive_version = 0;	// Asset::version_ of the archive
+			uint32 object_index = 0;		// in the archive
+
+			bool operator==(const Key& other) const = default;
+		};
+
+		// An archive a merged template was built from
+		struct Dependency
+		{
+			AssetId archive_id = kWrongID64;
+			uint32 archive_version = 0;
+		};
+
+		// dependencies: the archive of the object and all its base archives, see Invalidate.
+		// A template built from an already invalidated version is returned, but not cached.
+		std::shared_ptr<const serialization::DataTemplate> FindOrMerge(const Key& key, std::span<const Dependency> dependencies
+			, const std::function<serialization::DataTemplate()>& merge);
+		// Drops the templates built from the versions of the archive older than first_valid_version, e.g. when it's reloaded
+		void Invalidate(const AssetId archive_id, const uint32 first_valid_version);
+		void Clear();
+
+		void SetBudget(const uint64 bytes);
+		uint64 GetUsedMemory() const;
+		uint32 GetNum() const;
+
+	private:
+		struct Entry
+		{
+			Key key;
+			std::shared_ptr<const serialization::DataTemplate> merged;
+			uint64 size = 0;
+			std::vector<Dependency> dependencies;
+		};
+		struct KeyHash
+		{
+			size_t operator()(const Key& key) const
+			{
+				uint64 hash = HashBytes64(&key.archive_id, sizeof(key.archive_id), key.object_index);
+				return HashBytes64(&key.archive_version, sizeof(key.archive_version), hash);
+			}
+		};
+
+		bool IsStale(const Dependency& dependency) const;
+		void Remove(std::list<Entry>::iterator it);
+		void EvictOverBudget();
+
+		mutable std::mutex mutex_;
+		std::list<Entry> entries_; // the most recently used first
+		std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> entry_by_key_;
+		std::unordered_map<AssetId, uint32> first_valid_version_; // see Invalidate
+		uint64 budget_ = 64 * 1024 * 1024;
+		uint64 used_memory_ = 0;
+	};
+
 	class AssetManager
 	{
+		mutable std::mutex mutex_; // guards the maps, assets are looked up from the loading threads
 		std::map<AssetId, std::shared_ptr<Asset>> assets_in_memory_;
 		std::map<AssetId, std::string> all_paths_;
+		std::map<AssetId, uint32> load_count_;
+		MergedTemplateCache merged_templates_;
 	public:
 		AssetManager& Get();
 
 		void ScanAssets();
 		//
 		AssetId PathToAssetId(const std::string& path) const;
-		std::shared_ptr<serialization::ObjectArchive> GetObjectArchive(AssetId asset_id, bool load_if_not_found);
+		// Only archives registered with AddLoadedAsset are found, nothing is loaded here
+		std::shared_ptr<serialization::ObjectArchive> GetObjectArchive(AssetId asset_id) const;
 		void SaveObjectArchive(std::shared_ptr<serialization::ObjectArchive> oa);
 		std::shared_ptr<serialization::ObjectArchive> CreateObjectArchive(const std::string& path);
+		// Registers a (re)loaded asset, a new version invalidates the merged templates built from the old one
+		void AddLoadedAsset(std::shared_ptr<Asset> asset);
 		void UnloadAsset(AssetId asset_in);
+
+		MergedTemplateCache& GetMergedTemplates() { return merged_templates_; }
 	};
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include "data_template.h"
+#include "tag_codec.h"
 #include <sstream>
 #include <iomanip>
+#include <cstring>
+#include <mutex>
 
 namespace
 {
@@ -23,78 +26,457 @@ namespace
 		GetRef<M>(dst, 0) = GetConstRef<M>(src, src_offset);
 	}
 
-	template<> void LoadSimpleValue<Object*>(uint8* const dst, const uint8* const src, const uint32 src_offset)
+	// The pointer stays null until the fixup is resolved
+	void LoadObjectPtr(uint8* const dst, const uint8* const src, const uint32 src_offset
+		, ObjectFixups* const fixups)
 	{
-		const StructID struct_id = GetConstRef<StructID>(src, src_offset);
-		const auto& structure = Structure::GetStructure(struct_id);
+		Object*& obj = GetRef<Object*>(dst, 0);
+		obj = nullptr;
 		const ObjectID object_id = GetConstRef<ObjectID>(src, src_offset + sizeof(StructID));
+		if (fixups && (kNullObjectID != object_id))
+		{
+			fixups->slots.push_back(ObjectFixup{ &obj, object_id });
+		}
+	}
+
+	void LoadString(uint8* const dst, const DataTemplateView& src, const Tag tag)
+	{
+		GetRef<std::string>(dst, 0) = src.GetString(tag);
+	}
+
+	// Index of the first tag after the value at tag_index and its nested tags
+	uint32 SkipValue(const DataTemplateView& src, uint32 tag_index)
+	{
+		const uint32 nest_level = src.tags_[tag_index].GetNestLevel();
+		do {
+			tag_index++;
+		} while ((tag_index < src.TagNum()) && (src.tags_[tag_index].GetNestLevel() > nest_level));
+		return tag_index;
+	}
 
-		//TODO
-		//Object* obj = structure.obj_from_id(object_id);
-		GetRef<Object*>(dst, 0) = nullptr;
+	MemberFieldType GetPackedElementType(const uint8* const data, const uint32 offset)
+	{
+		return static_cast<MemberFieldType>(GetConstRef<uint8>(data, offset + GetLengthSize(ReadLength(data, offset))));
 	}
 
-	template<> void LoadSimpleValue<std::string>(uint8* const dst, const uint8* const src, const uint32 src_offset)
+	uint32 GetPackedVectorDataSize(const uint8* const data, const uint32 offset)
 	{
-		const uint16 len = GetConstRef<uint16>(src, src_offset);
-		const char* c_str = &GetConstRef<char>(src, src_offset + sizeof(uint16));
-		GetRef<std::string>(dst, 0) = std::string(c_str, len);
+		const uint32 len = ReadLength(data, offset);
+		return GetPackedVectorHeaderSize(len) + len * GetPackedElementSize(GetPackedElementType(data, offset));
 	}
 };
 
+uint32 serialization::GetPackedElementSize(const MemberFieldType type)
+{
+	switch (type)
+	{
+	case MemberFieldType::Int8:		return sizeof(int8);
+	case MemberFieldType::Int16:	return sizeof(int16);
+	case MemberFieldType::Int32:	return sizeof(int32);
+	case MemberFieldType::Int64:	return sizeof(int64);
+	case MemberFieldType::UInt8:	return sizeof(uint8);
+	case MemberFieldType::UInt16:	return sizeof(uint16);
+	case MemberFieldType::UInt32:	return sizeof(uint32);
+	case MemberFieldType::UInt64:	return sizeof(uint64);
+	case MemberFieldType::Float:	return sizeof(float);
+	case MemberFieldType::Double:	return sizeof(double);
+	}
+	return 0;
+}
+
+void serialization::AppendVectorEdits(std::vector<uint8>& dst, const std::vector<uint32>& sources)
+{
+	std::vector<std::array<uint32, 2>> runs; // first source index, count
+	for (const uint32 source : sources)
+	{
+		const bool extends_run = !runs.empty() && ((kWrongID == source)
+			? (kWrongID == runs.back()[0]) : ((kWrongID != runs.back()[0]) && ((runs.back()[0] + runs.back()[1]) == source)));
+		if (extends_run)
+		{
+			runs.back()[1]++;
+		}
+		else
+		{
+			runs.push_back({ source, 1 });
+		}
+	}
+	AppendLength(dst, static_cast<uint32>(sources.size()));
+	AppendLength(dst, static_cast<uint32>(runs.size()));
+	const uint32 dst_offset = static_cast<uint32>(dst.size());
+	dst.resize(dst_offset + runs.size() * sizeof(runs[0]));
+	if (!runs.empty())
+	{
+		std::memcpy(dst.data() + dst_offset, runs.data(), runs.size() * sizeof(runs[0]));
+	}
+}
+
+std::vector<uint32> serialization::ReadVectorEdits(const uint8* const data, const uint32 offset)
+{
+	const uint32 len = ReadLength(data, offset);
+	const uint32 runs_offset = offset + GetLengthSize(len);
+	const uint32 runs_num = ReadLength(data, runs_offset);
+	std::vector<uint32> sources;
+	sources.reserve(len);
+	for (uint32 idx = 0; idx < runs_num; idx++)
+	{
+		std::array<uint32, 2> run;
+		std::memcpy(run.data(), data + runs_offset + GetLengthSize(runs_num) + idx * sizeof(run), sizeof(run));
+		for (uint32 element = 0; element < run[1]; element++)
+		{
+			sources.push_back((kWrongID == run[0]) ? kWrongID : (run[0] + element));
+		}
+	}
+	Assert(sources.size() == len);
+	return sources;
+}
+
 StructID serialization::DataTemplate::GetStructID() const
 {
 	return (data_.size() > sizeof(StructID)) ? GetConstRef<StructID>(data_.data(), 0) : kWrongID;
 }
 
-static_assert(sizeof(serialization::Tag) == 3 * sizeof(uint32));
+StructID serialization::DataTemplateView::GetStructID() const
+{
+	return (data_.size() > sizeof(StructID)) ? GetConstRef<StructID>(data_.data(), 0) : kWrongID;
+}
+
+std::string_view serialization::DataTemplateView::GetString(const Tag tag) const
+{
+	Assert(MemberFieldType::String == tag.GetFieldType());
+	const uint32 offset = tag.GetDataOffset();
+	if (tag.IsTableString())
+		return StringTable::Get(strings_, GetConstRef<uint32>(data_.data(), offset));
+	return std::string_view(reinterpret_cast<const char*>(data_.data() + offset + sizeof(uint16)), GetConstRef<uint16>(data_.data(), offset));
+}
+
+DataTemplate serialization::DataTemplateView::ToTemplate() const
+{
+	DataTemplate dt;
+	dt.tags_.assign(tags_.begin(), tags_.end());
+	dt.data_.assign(data_.begin(), data_.end());
+	if (!strings_.empty())
+	{
+		dt.strings_ = std::make_shared<StringTable>(std::vector<uint8>(strings_.begin(), strings_.end()));
+	}
+	dt.layout_hash_ = layout_hash_;
+	return dt;
+}
+
+bool serialization::DataTemplate::operator==(const DataTemplate& other) const
+{
+	const auto strings = GetStrings();
+	const auto other_strings = other.GetStrings();
+	return (tags_ == other.tags_) && (data_ == other.data_)
+		&& std::equal(strings.begin(), strings.end(), other_strings.begin(), other_strings.end());
+}
+
+uint32 serialization::StringTable::Add(std::string_view str)
+{
+	const std::hash<std::string_view> hasher;
+	if (offsets_by_hash_.empty())
+	{
+		for (uint32 offset = 0; offset < data_.size(); offset += sizeof(uint32) + GetConstRef<uint32>(data_.data(), offset))
+		{
+			offsets_by_hash_.emplace(hasher(Get(data_, offset)), offset);
+		}
+	}
+	const size_t hash = hasher(str);
+	const auto range = offsets_by_hash_.equal_range(hash);
+	for (auto it = range.first; it != range.second; it++)
+	{
+		if (Get(data_, it->second) == str)
+			return it->second;
+	}
+	const uint32 offset = static_cast<uint32>(data_.size());
+	const uint32 len = static_cast<uint32>(str.size());
+	data_.resize(offset + sizeof(uint32) + len);
+	GetRef<uint32>(data_.data(), offset) = len;
+	std::memcpy(data_.data() + offset + sizeof(uint32), str.data(), len);
+	offsets_by_hash_.emplace(hash, offset);
+	return offset;
+}
+
+std::string_view serialization::StringTable::Get(std::span<const uint8> table, const uint32 offset)
+{
+	if (static_cast<uint64>(offset) + sizeof(uint32) > table.size())
+		return {};
+	const uint32 len = GetConstRef<uint32>(table.data(), offset);
+	if (static_cast<uint64>(offset) + sizeof(uint32) + len > table.size())
+		return {};
+	return std::string_view(reinterpret_cast<const char*>(table.data() + offset + sizeof(uint32)), len);
+}
+
+std::vector<uint8> serialization::RemapTableStrings(const DataTemplateView& src, StringTable& strings)
+{
+	std::vector<uint8> remapped_data(src.data_.begin(), src.data_.end());
+	for (const Tag tag : src.tags_)
+	{
+		if (tag.IsTableString())
+		{
+			const uint32 offset = strings.Add(src.GetString(tag));
+			std::memcpy(remapped_data.data() + tag.GetDataOffset(), &offset, sizeof(offset));
+		}
+	}
+	return remapped_data;
+}
+
+void serialization::details::SaveString(DataTemplate& dst, std::string_view str, const bool table_string)
+{
+	const uint32 dst_offset = dst.data_.size();
+	if (table_string)
+	{
+		if (!dst.strings_)
+		{
+			dst.strings_ = std::make_shared<StringTable>();
+		}
+		dst.data_.resize(dst_offset + sizeof(uint32));
+		GetRef<uint32>(dst.data_.data(), dst_offset) = dst.strings_->Add(str);
+		return;
+	}
+	const uint32 len = static_cast<uint32>(str.size());
+	Assert(FitsInBits(len, 16));
+	dst.data_.resize(dst_offset + sizeof(uint16) + len * sizeof(char));
+	GetRef<uint16>(dst.data_.data(), dst_offset) = static_cast<uint16>(len);
+	std::memcpy(dst.data_.data() + dst_offset + sizeof(uint16), str.data(), len);
+}
+
+serialization::TagSchemaPool& serialization::TagSchemaPool::Get()
+{
+	static TagSchemaPool pool;
+	return pool;
+}
+
+void serialization::TagSchemaPool::Intern(TagList& tags)
+{
+	if (tags.empty())
+		return;
+	const uint64 hash = HashBytes64(tags.data(), tags.size() * sizeof(Tag));
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	const auto range = schemas_.equal_range(hash);
+	for (auto it = range.first; it != range.second; it++)
+	{
+		if (tags.storage_ == it->second)
+			return;
+		const auto& schema = *it->second;
+		if ((schema.size() == tags.size()) && (0 == std::memcmp(schema.data(), tags.data(), tags.size() * sizeof(Tag))))
+		{
+			tags.storage_ = it->second;
+			return;
+		}
+	}
+	// the pool keeps a reference, so from now on any write copies the storage
+	auto schema = std::make_shared<std::vector<Tag>>(tags.begin(), tags.end());
+	schema->shrink_to_fit();
+	tags.storage_ = schema;
+	schemas_.emplace(hash, std::move(schema));
+}
+
+void serialization::TagSchemaPool::RemoveUnused()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto it = schemas_.begin(); it != schemas_.end();)
+	{
+		it = (1 == it->second.use_count()) ? schemas_.erase(it) : std::next(it);
+	}
+}
+
+uint32 serialization::TagSchemaPool::GetNum() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return static_cast<uint32>(schemas_.size());
+}
+
+static_assert(sizeof(serialization::Tag) == 4 * sizeof(uint32));
+static_assert(std::has_unique_object_representations_v<serialization::Tag>); // written raw, no padding bytes
 std::istream& serialization::operator>> (std::istream& is, Tag& t)
 {
-	uint32* ptr = reinterpret_cast<uint32*>(&t);
-	is >> ptr[0] >> ptr[1] >> ptr[2];
+	ReadRaw(is, t);
 	return is;
 }
 
 std::ostream& serialization::operator<< (std::ostream& os, const Tag& t)
 {
-	const uint32* ptr = reinterpret_cast<const uint32*>(&t);
-	os << ptr[0] << ptr[1] << ptr[2];
+	WriteRaw(os, t);
 	return os;
 }
 
-std::istream& serialization::operator>> (std::istream& is, serialization::DataTemplate& dt)
+namespace
 {
-	uint32 tags_num = 0;
-	uint32 data_size = 0;
-	is >> tags_num >> data_size;
-	Assert(dt.tags_.empty());
-	dt.tags_.resize(tags_num);
-	for (uint32 i = 0; i < tags_num; i++)
+	bool IsSupportedHeader(const DataTemplateHeader& header)
 	{
-		is >> dt.tags_[i];
+		return (DataTemplateHeader::kMagic == header.magic) && (header.version >= DataTemplateHeader::kMinSupportedVersion)
+			&& (header.version <= DataTemplateHeader::kVersion);
 	}
-	Assert(dt.data_.empty());
-	dt.data_.resize(data_size);
-	for (uint32 i = 0; i < data_size; i++)
+
+	uint32 GetLayoutHashSize(const DataTemplateHeader& header)
 	{
-		is >> dt.data_[i];
+		return Flag32<EStreamFlags>(static_cast<uint32>(header.flags))[EStreamFlags::LayoutHash] ? sizeof(uint32) : 0;
+	}
+
+	void WriteLayoutHash(std::ostream& os, const DataTemplate& dt)
+	{
+		if (dt.layout_hash_)
+		{
+			WriteRaw(os, dt.layout_hash_);
+		}
+	}
+
+	// strings_block_size includes the uint32 size of the table
+	uint32 GetPaddingSize(const DataTemplateHeader& header, const uint32 strings_block_size)
+	{
+		return (0u - header.data_size - header.compact_tags_size - strings_block_size) & 3u;
 	}
-	return is;
 }
 
-std::ostream& serialization::operator<< (std::ostream& os, const serialization::DataTemplate& dt)
+void serialization::WriteDataTemplate(std::ostream& os, const DataTemplate& dt, const Flag32<EStreamFlags> flags)
+{
+	constexpr uint8 kPadding[4] = {};
+	const auto strings = dt.GetStrings();
+	Flag32<EStreamFlags> stream_flags = flags;
+	if (!strings.empty())
+	{
+		stream_flags.Add(EStreamFlags::StringTable);
+	}
+	if (dt.layout_hash_)
+	{
+		stream_flags.Add(EStreamFlags::LayoutHash);
+	}
+	DataTemplateHeader header;
+	header.flags = static_cast<uint16>(stream_flags.GetRawData());
+	header.tags_num = dt.TagNum();
+	header.data_size = static_cast<uint32>(dt.data_.size());
+	if (flags[EStreamFlags::CompactTags])
+	{
+		std::vector<uint8> compact_tags;
+		WriteCompactTags(dt, compact_tags);
+		header.compact_tags_size = static_cast<uint32>(compact_tags.size());
+		WriteRaw(os, header);
+		WriteLayoutHash(os, dt);
+		WriteRaw(os, dt.data_.data(), header.data_size);
+		WriteRaw(os, compact_tags.data(), header.compact_tags_size);
+	}
+	else
+	{
+		WriteRaw(os, header);
+		WriteLayoutHash(os, dt);
+		WriteRaw(os, dt.tags_.data(), header.tags_num);
+		WriteRaw(os, dt.data_.data(), header.data_size);
+	}
+	const uint32 strings_size = static_cast<uint32>(strings.size());
+	if (strings_size)
+	{
+		WriteRaw(os, strings_size);
+		WriteRaw(os, strings.data(), strings_size);
+	}
+	WriteRaw(os, kPadding, GetPaddingSize(header, strings_size ? (sizeof(uint32) + strings_size) : 0));
+}
+
+bool serialization::ReadDataTemplate(std::istream& is, DataTemplate& dt)
+{
+	Assert(dt.tags_.empty() && dt.data_.empty());
+	DataTemplateHeader header;
+	if (!ReadRaw(is, header) || !IsSupportedHeader(header))
+	{
+		is.setstate(std::ios::failbit);
+		return false;
+	}
+
+	const Flag32<EStreamFlags> flags(static_cast<uint32>(header.flags));
+	const std::streampos stream_end = GetStreamEnd(is);
+	const uint64 block_size = flags[EStreamFlags::CompactTags] ? (uint64(header.data_size) + header.compact_tags_size)
+		: (uint64(header.tags_num) * sizeof(Tag) + header.data_size);
+	bool ok = (!flags[EStreamFlags::LayoutHash] || ReadRaw(is, dt.layout_hash_))
+		&& FitsInStream<uint8>(is, stream_end, block_size);
+	if (ok && flags[EStreamFlags::CompactTags])
+	{
+		dt.data_.resize(header.data_size);
+		std::vector<uint8> compact_tags(header.compact_tags_size);
+		uint32 offset = 0;
+		ok = ReadRaw(is, dt.data_.data(), header.data_size)
+			&& ReadRaw(is, compact_tags.data(), header.compact_tags_size)
+			&& ReadCompactTags(compact_tags.data(), header.compact_tags_size, offset, dt)
+			&& (dt.TagNum() == header.tags_num);
+	}
+	else if (ok)
+	{
+		std::vector<Tag> tags(header.tags_num);
+		dt.data_.resize(header.data_size);
+		ok = ReadRaw(is, tags.data(), header.tags_num)
+			&& ReadRaw(is, dt.data_.data(), header.data_size);
+		dt.tags_ = TagList(std::move(tags));
+	}
+	uint32 strings_size = 0;
+	if (ok && flags[EStreamFlags::StringTable])
+	{
+		std::vector<uint8> strings;
+		ok = ReadRaw(is, strings_size) && FitsInStream<uint8>(is, stream_end, strings_size);
+		if (ok)
+		{
+			strings.resize(strings_size);
+			ok = ReadRaw(is, strings.data(), strings_size);
+			dt.strings_ = std::make_shared<StringTable>(std::move(strings));
+		}
+	}
+	uint8 padding[4];
+	ok = ok && ReadRaw(is, padding, GetPaddingSize(header, strings_size ? (sizeof(uint32) + strings_size) : 0));
+
+	if (!ok)
+	{
+		is.setstate(std::ios::failbit);
+		dt = DataTemplate();
+	}
+	return ok;
+}
+
+bool serialization::ParseDataTemplateView(std::span<const uint8> src, uint32& offset, DataTemplateView& view)
 {
-	const uint32 tags_num = dt.tags_.size();
-	const uint32 data_size = dt.data_.size();
-	os << tags_num << data_size;
-	for (const auto& tag : dt.tags_)
+	view = DataTemplateView();
+	if ((offset % alignof(Tag)) || (reinterpret_cast<uintptr_t>(src.data()) % alignof(Tag))
+		|| (src.size() < offset + sizeof(DataTemplateHeader)))
+		return false;
+	DataTemplateHeader header;
+	std::memcpy(&header, src.data() + offset, sizeof(header));
+	if (!IsSupportedHeader(header) || Flag32<EStreamFlags>(static_cast<uint32>(header.flags))[EStreamFlags::CompactTags])
+		return false;
+	const uint32 layout_hash_size = GetLayoutHashSize(header);
+	const uint64 tags_begin = offset + sizeof(header) + layout_hash_size;
+	const uint64 tags_size = static_cast<uint64>(header.tags_num) * sizeof(Tag);
+	const uint64 strings_begin = tags_begin + tags_size + header.data_size;
+	uint32 strings_size = 0;
+	const bool has_strings = Flag32<EStreamFlags>(static_cast<uint32>(header.flags))[EStreamFlags::StringTable];
+	if (has_strings)
 	{
-		os << tag;
+		if (strings_begin + sizeof(uint32) > src.size())
+			return false;
+		std::memcpy(&strings_size, src.data() + strings_begin, sizeof(uint32));
 	}
-	for (const uint8 v : dt.data_)
+	const uint32 strings_block_size = has_strings ? (sizeof(uint32) + strings_size) : 0;
+	const uint64 end = strings_begin + strings_block_size + GetPaddingSize(header, strings_block_size);
+	if (end > src.size())
+		return false;
+
+	const uint8* const tags = src.data() + tags_begin;
+	if (layout_hash_size)
 	{
-		os << v;
+		std::memcpy(&view.layout_hash_, src.data() + offset + sizeof(header), sizeof(uint32));
 	}
+	view.tags_ = std::span<const Tag>(reinterpret_cast<const Tag*>(tags), header.tags_num);
+	view.data_ = std::span<const uint8>(tags + tags_size, header.data_size);
+	view.strings_ = std::span<const uint8>(src.data() + strings_begin + sizeof(uint32), strings_size);
+	offset = static_cast<uint32>(end);
+	return true;
+}
+
+std::istream& serialization::operator>> (std::istream& is, serialization::DataTemplate& dt)
+{
+	ReadDataTemplate(is, dt);
+	return is;
+}
+
+std::ostream& serialization::operator<< (std::ostream& os, const serialization::DataTemplate& dt)
+{
+	WriteDataTemplate(os, dt, Flag32<EStreamFlags>());
 	return os;
 }
 
@@ -114,21 +496,13 @@ namespace save
 		return true;
 	}
 
-	static bool SaveString(std::vector<uint8>& dst, const uint8* const src, const Flag32<SaveFlags> flags)
+	static bool SaveString(DataTemplate& dst, const uint8* const src, const bool table_string, const Flag32<SaveFlags> flags)
 	{
 		const auto& str = GetConstRef<std::string>(src, 0);
-		const uint32 len = str.size();
-		if ((0 == len) && flags[SaveFlags::SkipNativeDefaultValues])
+		if (str.empty() && flags[SaveFlags::SkipNativeDefaultValues])
 			return false;
 
-		const uint32 dst_offset = dst.size();
-		Assert(FitsInBits(len, 16));
-		dst.resize(dst_offset + sizeof(uint16) + len * sizeof(char));
-		GetRef<uint16>(dst.data(), dst_offset) = static_cast<uint16>(len);
-		for (uint32 i = 0; i < len; i++)
-		{
-			GetRef<char>(dst.data(), dst_offset + sizeof(uint16) + i * sizeof(char)) = str[i];
-		}
+		serialization::details::SaveString(dst, str, table_string);
 		return true;
 	}
 
@@ -153,17 +527,22 @@ namespace save
 		return true;
 	}
 
-	static bool SaveLength16(std::vector<uint8>& dst, uint32 len, const Flag32<SaveFlags> flags)
+	static bool SaveLength(std::vector<uint8>& dst, uint32 len, const Flag32<SaveFlags> flags)
 	{
 		if ((0 == len) && flags[SaveFlags::SkipNativeDefaultValues])
 			return false;
 
-		const uint32 dst_offset = dst.size();
-		dst.resize(dst_offset + sizeof(uint16));
-		GetRef<uint16>(dst.data(), dst_offset) = static_cast<uint16>(len);
+		AppendLength(dst, len);
 		return true;
 	}
 
+	// Default elements can be skipped, but not so many in a row that the element index cannot be decoded
+	static Flag32<SaveFlags> GetElementFlags(const uint32 element_index, const uint32 last_saved_index, const Flag32<SaveFlags> flags)
+	{
+		return MustSaveElement(element_index, last_saved_index)
+			? Flag32<SaveFlags>::Remove(flags, SaveFlags::SkipNativeDefaultValues) : flags;
+	}
+
 	static void SaveStructId(std::vector<uint8>& dst, StructID struct_id)
 	{
 		const uint32 dst_offset = dst.size();
@@ -173,19 +552,21 @@ namespace save
 
 	bool SaveValue(const uint8* const src, DataTemplate& dst, const Structure& structure
 		, const PropertyIndex property_index, const uint32 nest_level, const Flag32<SaveFlags> flags
-		, const uint32 element_index = 0, const bool is_key = 0);
+		, const uint32 element_index = 0, const bool is_key = 0, std::span<const void* const> removed_keys = {});
+	// Only the dirty properties are saved when dirty is given
 	bool SaveStructure(const uint8* const src, DataTemplate& dst
-		, const Structure& structure, const uint32 nest_level, const Flag32<SaveFlags> flags)
+		, const Structure& structure, const uint32 nest_level, const Flag32<SaveFlags> flags
+		, const DirtyPropertySet* const dirty = nullptr)
 	{
 		const auto old_dst_size = dst.data_.size();
 		bool was_saved = false;
 		SaveStructId(dst.data_, structure.id_);
 
-		if (structure.super_id_ != kWrongID)
+		if (const Structure* super_struct = structure.TryGetSuperStructure())
 		{
 			dst.tags_.emplace_back(Tag(kSuperStructPropertyID, kSuperStructPropertyIndex, 0, MemberFieldType::Struct
 				, dst.data_.size(), nest_level, 0, 0));
-			was_saved = SaveStructure(src, dst, Structure::GetStructure(structure.super_id_), nest_level + 1, flags);
+			was_saved = SaveStructure(src, dst, *super_struct, nest_level + 1, flags, dirty);
 			if (!was_saved)
 			{
 				dst.tags_.pop_back();
@@ -197,7 +578,10 @@ namespace save
 		{
 			const auto& property = structure.GetProperty(property_index);
 			Assert(EPropertyUsage::Main == property.GetPropertyUsage());
-			was_saved |= SaveValue(src + property.GetFieldOffset(), dst, structure, property_index, nest_level, flags);
+			if (dirty && !dirty->IsDirty(structure, property_index))
+				continue;
+			const std::vector<const void*> removed_keys = dirty ? dirty->GetRemovedKeys(structure, property_index) : std::vector<const void*>();
+			was_saved |= SaveValue(src + property.GetFieldOffset(), dst, structure, property_index, nest_level, flags, 0, false, removed_keys);
 		}
 
 		if (!was_saved)
@@ -215,9 +599,15 @@ namespace save
 		const uint32 element_size = structure.GetNativeFieldSize(element_property_index);
 		const uint32 array_size = structure.GetProperty(property_index).GetArraySize();
 		bool was_saved = false;
+		uint32 last_saved_index = 0;
 		for (uint32 i = 0; i < array_size; i++)
 		{
-			was_saved |= SaveValue(src + i * element_size, dst, structure, element_property_index, nest_level, flags, i);
+			if (SaveValue(src + i * element_size, dst, structure, element_property_index, nest_level
+				, GetElementFlags(i, last_saved_index, flags), i))
+			{
+				was_saved = true;
+				last_saved_index = i;
+			}
 		}
 		return was_saved;
 	}
@@ -228,41 +618,118 @@ namespace save
 		const auto& handler = structure.GetHandlerProperty(property_index).GetVectorHandler();
 		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(property_index, ESubType::Vector_Element);
 		const uint32 num = handler.GetSize(src);
-		bool was_saved = SaveLength16(dst.data_, num, flags);
+		bool was_saved = SaveLength(dst.data_, num, flags);
+		uint32 last_saved_index = 0;
 		for (uint32 i = 0; i < num; i++)
 		{
-			was_saved |= SaveValue(handler.GetElement(src, i), dst, structure, element_property_index, nest_level, flags, i);
+			if (SaveValue(handler.GetElement(src, i), dst, structure, element_property_index, nest_level
+				, GetElementFlags(i, last_saved_index, flags), i))
+			{
+				was_saved = true;
+				last_saved_index = i;
+			}
 		}
 		return was_saved;
 	}
 
+	static bool CanPackVector(const Structure& structure, const PropertyIndex property_index, const Flag32<SaveFlags> flags)
+	{
+		if (!flags[SaveFlags::PackTrivialVectors])
+			return false;
+		const auto& handler = structure.GetHandlerProperty(property_index).GetVectorHandler();
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(property_index, ESubType::Vector_Element);
+		return handler.IsTriviallyCopyable()
+			&& (0 != GetPackedElementSize(structure.GetProperty(element_property_index).GetFieldType()));
+	}
+
+	bool SavePackedVector(const uint8* const src, std::vector<uint8>& dst, const Structure& structure
+		, const PropertyIndex property_index, const Flag32<SaveFlags> flags)
+	{
+		const auto& handler = structure.GetHandlerProperty(property_index).GetVectorHandler();
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(property_index, ESubType::Vector_Element);
+		const MemberFieldType element_type = structure.GetProperty(element_property_index).GetFieldType();
+		const uint32 num = handler.GetSize(src);
+		if (!SaveLength(dst, num, flags))
+			return false;
+
+		const uint32 bytes_num = num * GetPackedElementSize(element_type);
+		Assert(bytes_num == num * structure.GetNativeFieldSize(element_property_index));
+		const uint32 dst_offset = dst.size();
+		dst.resize(dst_offset + sizeof(uint8) + bytes_num);
+		GetRef<uint8>(dst.data(), dst_offset) = static_cast<uint8>(element_type);
+		if (bytes_num)
+		{
+			std::memcpy(dst.data() + dst_offset + sizeof(uint8), handler.GetData(src), bytes_num);
+		}
+		return true;
+	}
+
+	// The removed keys (of the native key type) go first, like in a diff (see dt_operation::ProcessMap)
 	bool SaveMap(const uint8* const src, DataTemplate& dst, const Structure& structure
-		, const PropertyIndex property_index, const uint32 nest_level, const Flag32<SaveFlags> flags)
+		, const PropertyIndex property_index, const uint32 nest_level, const Flag32<SaveFlags> flags
+		, std::span<const void* const> removed_keys)
 	{
 		const auto& handler = structure.GetHandlerProperty(property_index).GetMapHandler();
 		const PropertyIndex key_property_index = structure.GetSubPropertyIndex(property_index, ESubType::Key);
 		const PropertyIndex value_property_index = structure.GetSubPropertyIndex(property_index, ESubType::Map_Value);
-		const uint32 num = handler.GetSize(src);
-		bool was_saved = SaveLength16(dst.data_, num, flags);
+		const uint32 removed_num = static_cast<uint32>(removed_keys.size());
+		const uint32 num = removed_num + handler.GetSize(src);
+		bool was_saved = SaveLength(dst.data_, num, flags);
 		const Flag32<SaveFlags> key_flags = Flag32<SaveFlags>::Remove(flags, SaveFlags::SkipNativeDefaultValues);
-		for (uint32 i = 0; i < num; i++)
+		uint32 i = 0;
+		for (; i < removed_num; i++)
+		{
+			const uint32 key_tag_index = static_cast<uint32>(dst.tags_.size());
+			const bool key_saved = SaveValue(static_cast<const uint8*>(removed_keys[i]), dst, structure, key_property_index, nest_level, key_flags, i, true);
+			Assert(key_saved);
+			dst.tags_[key_tag_index] = dst.tags_[key_tag_index].WithFlags(dst.tags_[key_tag_index].GetFlags() | static_cast<uint32>(ETagFlags::RemovedKey));
+			was_saved = true;
+		}
+		IMapHandler::Cursor cursor;
+		for (handler.Begin(src, cursor); handler.IsValid(src, cursor); handler.Next(cursor), i++)
+		{
+			was_saved |= SaveValue(handler.GetKey(cursor), dst, structure, key_property_index, nest_level, key_flags, i, true);
+			was_saved |= SaveValue(handler.GetValue(cursor), dst, structure, value_property_index, nest_level, flags, i, false);
+		}
+		Assert(i == num);
+		return was_saved;
+	}
+
+	bool SaveSet(const uint8* const src, DataTemplate& dst, const Structure& structure
+		, const PropertyIndex property_index, const uint32 nest_level, const Flag32<SaveFlags> flags)
+	{
+		const auto& handler = structure.GetHandlerProperty(property_index).GetSetHandler();
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(property_index, ESubType::Set_Element);
+		const uint32 num = handler.GetSize(src);
+		bool was_saved = SaveLength(dst.data_, num, flags);
+		// Like map keys, the elements are saved in full
+		const Flag32<SaveFlags> element_flags = Flag32<SaveFlags>::Remove(flags, SaveFlags::SkipNativeDefaultValues);
+		ISetHandler::Cursor cursor;
+		uint32 i = 0;
+		for (handler.Begin(src, cursor); handler.IsValid(src, cursor); handler.Next(cursor), i++)
 		{
-			was_saved |= SaveValue(handler.GetKey(src, i), dst, structure, key_property_index, nest_level, key_flags, i, true);
-			was_saved |= SaveValue(handler.GetValue(src, i), dst, structure, value_property_index, nest_level, flags, i, false);
+			was_saved |= SaveValue(handler.GetElement(cursor), dst, structure, element_property_index, nest_level, element_flags, i);
 		}
+		Assert(i == num);
 		return was_saved;
 	}
 
 	bool SaveValue(const uint8* const src, DataTemplate& dst, const Structure& structure
 		, const PropertyIndex property_index, const uint32 nest_level, const Flag32<SaveFlags> flags
-		, const uint32 element_index, const bool is_key)
+		, const uint32 element_index, const bool is_key, std::span<const void* const> removed_keys)
 	{
 		const auto& property = structure.GetProperty(property_index);
 		Assert(property.GetPropertyUsage() == EPropertyUsage::Main || property.GetPropertyUsage() == EPropertyUsage::SubType);
-		const PropertyIndex main_property_idx = structure.GetMainPropertyIndex(property.GetPropertyID());
+		const PropertyIndex main_property_idx = structure.GetOwnerMainPropertyIndex(property_index);
 		Assert(main_property_idx != kWrongID);
+		const bool packed_vector = (MemberFieldType::Vector == property.GetFieldType())
+			&& CanPackVector(structure, property_index, flags);
+		const bool table_string = (MemberFieldType::String == property.GetFieldType())
+			&& serialization::details::UsesStringTable(GetConstRef<std::string>(src, 0).size(), flags);
+		const uint32 tag_flags = (packed_vector ? static_cast<uint32>(ETagFlags::PackedVector) : 0)
+			| (table_string ? static_cast<uint32>(ETagFlags::TableString) : 0);
 		dst.tags_.emplace_back(Tag(property.GetPropertyID(), property_index, (property_index - main_property_idx),
-			property.GetFieldType(), dst.data_.size(), nest_level, element_index, is_key ? 1 : 0));
+			property.GetFieldType(), dst.data_.size(), nest_level, element_index, is_key ? 1 : 0, tag_flags));
 		bool was_saved = false;
 		switch (property.GetFieldType())
 		{
@@ -276,11 +743,14 @@ namespace save
 		case MemberFieldType::UInt64:	was_saved = SaveSimpleValue<uint64	>(dst.data_, src, 0, flags);						break;
 		case MemberFieldType::Float:	was_saved = SaveSimpleValue<float	>(dst.data_, src, 0.0f, flags);						break;
 		case MemberFieldType::Double:	was_saved = SaveSimpleValue<double	>(dst.data_, src, 0.0, flags);						break;
-		case MemberFieldType::String:	was_saved = SaveString(dst.data_, src, flags);											break;
+		case MemberFieldType::String:	was_saved = SaveString(dst, src, table_string, flags);									break;
 		case MemberFieldType::ObjectPtr:was_saved = SaveObject(dst.data_, src, property.GetOptionalStructID(), flags);			break;
 		case MemberFieldType::Array:	was_saved = SaveArray(src, dst, structure, property_index, nest_level + 1, flags);		break;
-		case MemberFieldType::Vector:	was_saved = SaveVector(src, dst, structure, property_index, nest_level + 1, flags);		break;
-		case MemberFieldType::Map:		was_saved = SaveMap(src, dst, structure, property_index, nest_level + 1, flags);		break;
+		case MemberFieldType::Vector:	was_saved = packed_vector
+			? SavePackedVector(src, dst.data_, structure, property_index, flags)
+			: SaveVector(src, dst, structure, property_index, nest_level + 1, flags);											break;
+		case MemberFieldType::Map:		was_saved = SaveMap(src, dst, structure, property_index, nest_level + 1, flags, removed_keys);	break;
+		case MemberFieldType::Set:		was_saved = SaveSet(src, dst, structure, property_index, nest_level + 1, flags);		break;
 		case MemberFieldType::Struct:
 			const Structure& inner_structure = Structure::GetStructure(property.GetOptionalStructID());
 			Assert(inner_structure.RepresentNonObjectStructure());
@@ -295,555 +765,1912 @@ namespace save
 	}
 }
 
-void serialization::DataTemplate::SaveFromObject(const Object * obj, const Flag32<SaveFlags> flags)
+bool serialization::details::SaveStructure(const uint8* src, DataTemplate& dst, const Structure& structure
+	, const uint32 nest_level, const Flag32<SaveFlags> flags)
 {
-	Assert(nullptr != obj);
-	Assert(kWrongID == GetStructID()); //uninitialized
-	const auto structure_id = obj->GetReflectionStructureID();
-	Assert(kWrongID != structure_id);
-	const auto& structure = Structure::GetStructure(structure_id);
-	Assert(structure.RepresentsObjectClass());
-	Assert(tags_.empty() && data_.empty());
-	save::SaveStructure(reinterpret_cast<const uint8*>(obj), *this, structure, 0, flags);
-	Assert(tags_.empty() == data_.empty());
+	return save::SaveStructure(src, dst, structure, nest_level, flags);
 }
 
-#pragma endregion
+bool serialization::details::SaveObjectPtr(std::vector<uint8>& dst, const Object* obj, const StructID property_struct_id
+	, const Flag32<SaveFlags> flags)
+{
+	return save::SaveObject(dst, reinterpret_cast<const uint8*>(&obj), property_struct_id, flags);
+}
 
+#pragma region Compiled programs
 namespace load
+{
+	uint32 LoadValue(const DataTemplateView& src, uint8* dst, const Structure& structure, uint32 tag_index
+		, ObjectFixups* fixups);
+}
+
+// Flattened save/load of a structure: inheritance is inlined, offsets are resolved
+// and adjacent numbers are fused into a single memcpy.
+struct serialization::StructureProgram
+{
+	enum class EOp : uint8
+	{
+		StructHeader,	// struct id in data
+		SuperTag,		// tag of the super structure, its ops follow
+		StructTag,		// tag of a struct member, its ops follow
+		PodRun,			// adjacent numbers
+		Value,			// anything else, handled by the generic code
+	};
+
+	struct Op
+	{
+		EOp op = EOp::StructHeader;
+		uint32 nest_level = 0;
+		uint32 src_offset = 0;					// from the object
+		const Structure* structure = nullptr;	// owner of the properties
+		PropertyIndex property_index = 0;		// first property for PodRun
+		uint32 num = 0;							// PodRun: number of properties
+		uint32 bytes = 0;						// PodRun: native size, the same as saved size
+		uint32 skip_to = 0;						// SuperTag, StructTag: first op after the nested ops
+	};
+
+	std::vector<Op> ops_;
+};
+
+namespace compiled
 {
 	using namespace serialization;
+	using Op = StructureProgram::Op;
+	using EOp = StructureProgram::EOp;
 
-	uint32 LoadValue(const DataTemplate& src, uint8* dst, const Structure& structure, uint32 tag_index);
-	uint32 LoadArray(const DataTemplate& src, uint8* dst, const Structure& structure, const Tag tag, uint32 tag_index) 
+	// Mirrors save::SaveValue without SkipNativeDefaultValues, is any tag saved?
+	bool AlwaysSaves(const Structure& structure);
+	bool AlwaysSavesValue(const Structure& structure, const PropertyIndex property_index)
 	{
-		const auto& property = structure.GetProperty(tag.GetPropertyIndex());
-		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Array_Element);
-		const uint32 element_size = structure.GetNativeFieldSize(element_property_index);
-		while (tag_index < src.tags_.size())
+		const auto& property = structure.GetProperty(property_index);
+		switch (property.GetFieldType())
 		{
-			const Tag inner_tag = src.tags_[tag_index];
-			const bool within_size = inner_tag.GetElementIndex() < property.GetArraySize();
-			Assert(within_size);
-			const bool expected_property_idx = inner_tag.GetPropertyIndex() == element_property_index;
-			const bool expected_nest_idx = inner_tag.GetNestLevel() == tag.GetNestLevel() + 1;
-			Assert(expected_property_idx == expected_nest_idx);
-			if (!expected_property_idx || !expected_nest_idx || !within_size)
-				break;
-
-			tag_index = LoadValue(src, dst + inner_tag.GetElementIndex() * element_size, structure, tag_index);
+		case MemberFieldType::Struct:	return AlwaysSaves(Structure::GetStructure(property.GetOptionalStructID()));
+		case MemberFieldType::Array:	return (0 != property.GetArraySize())
+			&& AlwaysSavesValue(structure, structure.GetSubPropertyIndex(property_index, ESubType::Array_Element));
 		}
-		return tag_index;
+		return true;
 	}
 
-	uint32 LoadVector(const DataTemplate& src, uint8* dst, const Structure& structure, const Tag tag, uint32 tag_index) 
+	bool AlwaysSaves(const Structure& structure)
 	{
-		const auto& handler = structure.GetHandlerProperty(tag.GetPropertyIndex()).GetVectorHandler();
-		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Vector_Element);
-		const uint32 size = GetConstRef<uint16>(src.data_.data(), tag.GetDataOffset());
-		handler.SetSize(dst, size);
-		while (tag_index < src.tags_.size())
+		const Structure* super_struct = structure.TryGetSuperStructure();
+		if (super_struct && AlwaysSaves(*super_struct))
+			return true;
+		for (uint32 property_index = 0; property_index < structure.GetNumberOfProperties();
+			property_index = structure.NextPropertyIndexOnThisLevel(property_index))
 		{
-			const Tag inner_tag = src.tags_[tag_index];
-			const bool expected_property_idx = inner_tag.GetPropertyIndex() == element_property_index;
-			const bool expected_nest_idx = inner_tag.GetNestLevel() == (tag.GetNestLevel() + 1);
-			Assert(expected_property_idx == expected_nest_idx);
-			if (!expected_property_idx || !expected_nest_idx)
-				break;
-			Assert(inner_tag.GetElementIndex() < size);
-			tag_index = LoadValue(src, handler.GetElement(dst, inner_tag.GetElementIndex()), structure, tag_index);
+			if (AlwaysSavesValue(structure, property_index))
+				return true;
 		}
-		return tag_index;
+		return false;
 	}
 
-	uint32 LoadMap(const DataTemplate& src, uint8* dst, const Structure& structure, const Tag tag, uint32 tag_index) 
+	void Compile(StructureProgram& program, const Structure& structure, const uint32 src_offset, const uint32 nest_level)
 	{
-		const auto& handler = structure.GetHandlerProperty(tag.GetPropertyIndex()).GetMapHandler();
-		const PropertyIndex key_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Key);
-		const PropertyIndex value_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Map_Value);
-		const uint32 map_size = GetConstRef<uint16>(src.data_.data(), tag.GetDataOffset()); //number of keys
-
-		std::vector<uint8> temp_key_memory;
-		for (uint32 idx = 0; idx < map_size; idx++)
-		{
-			//assume proper order
-			Assert(tag_index < src.tags_.size());
-			{
-				//assume !SkipNativeDefaultValues, full key data
-				const Tag key_tag = src.tags_[tag_index];
-				Assert(key_tag.GetNestLevel() == (tag.GetNestLevel() + 1));
-				Assert(key_tag.IsKey());
-				Assert(key_tag.GetPropertyIndex() == key_property_index);
-				Assert(key_tag.GetElementIndex() == idx);
-				handler.InitializeKeyMemory(temp_key_memory);
-				tag_index = LoadValue(src, temp_key_memory.data(), structure, tag_index);
-			}
-
-			uint8* value_ptr = handler.Add(dst, temp_key_memory);
-			if (tag_index < src.tags_.size())
-			{
-				const Tag value_tag = src.tags_[tag_index];
-				const bool expected_nest_lvl = value_tag.GetNestLevel() == (tag.GetNestLevel() + 1);
-				const bool expected_property_idx = value_tag.GetPropertyIndex() == value_property_index;
-				const bool proper_value = expected_nest_lvl && expected_property_idx && !value_tag.IsKey();
-				Assert(proper_value == expected_nest_lvl && proper_value == expected_property_idx);
-				if (proper_value)
+		auto& ops = program.ops_;
+		Op header;
+		header.op = EOp::StructHeader;
+		header.structure = &structure;
+		ops.push_back(header);
+
+		const Structure* super_struct = structure.TryGetSuperStructure();
+		if (super_struct && AlwaysSaves(*super_struct))
+		{
+			const uint32 op_index = ops.size();
+			Op super_tag;
+			super_tag.op = EOp::SuperTag;
+			super_tag.nest_level = nest_level;
+			super_tag.structure = &structure;
+			ops.push_back(super_tag);
+			Compile(program, *super_struct, src_offset, nest_level + 1);
+			ops[op_index].skip_to = ops.size();
+		}
+
+		for (uint32 property_index = 0; property_index < structure.GetNumberOfProperties();
+			property_index = structure.NextPropertyIndexOnThisLevel(property_index))
+		{
+			const auto& property = structure.GetProperty(property_index);
+			const uint32 field_offset = src_offset + property.GetFieldOffset();
+			const uint32 pod_size = GetPackedElementSize(property.GetFieldType());
+			if (pod_size)
+			{
+				Assert(pod_size == property.GetNativeSize());
+				Op& last = ops.back();
+				const bool extends_run = (EOp::PodRun == last.op) && (&structure == last.structure) 
+					&& (nest_level == last.nest_level) && (last.property_index + last.num == property_index)
+					&& (last.src_offset + last.bytes == field_offset);
+				if (extends_run)
+				{
+					last.num++;
+					last.bytes += pod_size;
+				}
+				else
+				{
+					Op run;
+					run.op = EOp::PodRun;
+					run.nest_level = nest_level;
+					run.src_offset = field_offset;
+					run.structure = &structure;
+					run.property_index = property_index;
+					run.num = 1;
+					run.bytes = pod_size;
+					ops.push_back(run);
+				}
+			}
+			else if (MemberFieldType::Struct == property.GetFieldType())
+			{
+				const Structure& inner_structure = Structure::GetStructure(property.GetOptionalStructID());
+				Assert(inner_structure.RepresentNonObjectStructure());
+				if (AlwaysSaves(inner_structure))
 				{
-					Assert(value_tag.GetElementIndex() == idx);
-					tag_index = LoadValue(src, value_ptr, structure, tag_index);
+					const uint32 op_index = ops.size();
+					Op struct_tag;
+					struct_tag.op = EOp::StructTag;
+					struct_tag.nest_level = nest_level;
+					struct_tag.structure = &structure;
+					struct_tag.property_index = property_index;
+					ops.push_back(struct_tag);
+					Compile(program, inner_structure, field_offset, nest_level + 1);
+					ops[op_index].skip_to = ops.size();
 				}
 			}
+			else
+			{
+				Op value;
+				value.op = EOp::Value;
+				value.nest_level = nest_level;
+				value.src_offset = field_offset;
+				value.structure = &structure;
+				value.property_index = property_index;
+				ops.push_back(value);
+			}
 		}
-		return tag_index;
 	}
 
-	uint32 LoadStructure(const DataTemplate& src, uint8* dst, const Structure& structure, uint32 tag_index) 
+	const StructureProgram& GetProgram(const Structure& structure)
 	{
-		if (tag_index >= src.tags_.size())
-			return tag_index;
+		if (const StructureProgram* program = structure.GetSerializationProgram())
+			return *program;
 
-		const Tag first_tag = src.tags_[tag_index];
-		do
+		auto program = std::make_unique<StructureProgram>();
+		if (AlwaysSaves(structure))
 		{
-			const Tag tag = src.tags_[tag_index];
-			Assert(tag.GetNestLevel() <= first_tag.GetNestLevel());
-			if (tag.GetNestLevel() != first_tag.GetNestLevel() || tag.GetElementIndex() != first_tag.GetElementIndex()
-				|| tag.IsKey() != first_tag.IsKey())
+			Compile(*program, structure, 0, 0);
+		}
+		const StructureProgram* published = structure.PublishSerializationProgram(program.get());
+		if (published == program.get())
+		{
+			static std::mutex owned_programs_mutex;
+			static std::vector<std::unique_ptr<StructureProgram>> owned_programs;
+			std::lock_guard<std::mutex> lock(owned_programs_mutex);
+			owned_programs.emplace_back(std::move(program));
+		}
+		return *published;
+	}
+
+	// Produces the same output as save::SaveStructure, as long as SkipNativeDefaultValues is not used
+	void Save(const StructureProgram& program, const uint8* const src, DataTemplate& dst, const Flag32<SaveFlags> flags)
+	{
+		Assert(!flags[SaveFlags::SkipNativeDefaultValues]);
+		for (const Op& op : program.ops_)
+		{
+			switch (op.op)
+			{
+			case EOp::StructHeader:
+				save::SaveStructId(dst.data_, op.structure->id_);
 				break;
-			if (kSuperStructPropertyIndex == tag.GetPropertyIndex())
+			case EOp::SuperTag:
+				dst.tags_.emplace_back(Tag(kSuperStructPropertyID, kSuperStructPropertyIndex, 0, MemberFieldType::Struct
+					, dst.data_.size(), op.nest_level, 0, 0));
+				break;
+			case EOp::StructTag:
+				dst.tags_.emplace_back(Tag(op.structure->GetProperty(op.property_index).GetPropertyID(), op.property_index, 0
+					, MemberFieldType::Struct, dst.data_.size(), op.nest_level, 0, 0));
+				break;
+			case EOp::PodRun:
 			{
-				tag_index++;
-				const auto* super_struct = structure.TryGetSuperStructure();
-				Assert(nullptr != super_struct);
-				tag_index = LoadStructure(src, dst, *super_struct, tag_index);
+				const uint32 dst_offset = dst.data_.size();
+				uint32 data_offset = dst_offset;
+				for (uint32 i = 0; i < op.num; i++)
+				{
+					const auto& property = op.structure->GetProperty(op.property_index + i);
+					dst.tags_.emplace_back(Tag(property.GetPropertyID(), op.property_index + i, 0, property.GetFieldType()
+						, data_offset, op.nest_level, 0, 0));
+					data_offset += property.GetNativeSize();
+				}
+				dst.data_.resize(dst_offset + op.bytes);
+				std::memcpy(dst.data_.data() + dst_offset, src + op.src_offset, op.bytes);
+				break;
 			}
-			else
-			{
-				const auto& property = structure.GetProperty(tag.GetPropertyIndex());
-				tag_index = LoadValue(src, dst + property.GetFieldOffset(), structure, tag_index);
+			case EOp::Value:
+				save::SaveValue(src + op.src_offset, dst, *op.structure, op.property_index, op.nest_level, flags);
+				break;
 			}
-		} while (tag_index < src.tags_.size());
-		return tag_index;
+		}
 	}
 
-	uint32 LoadValue(const DataTemplate& src, uint8* dst, const Structure& structure, uint32 tag_index)
+	bool IsExpectedTag(const Tag tag, const PropertyIndex property_index, const uint32 nest_level)
 	{
-		const Tag tag = src.tags_[tag_index];
-		const auto& property = structure.GetProperty(tag.GetPropertyIndex());
-		Assert(property.GetPropertyUsage() != EPropertyUsage::Handler);
-		tag_index++;
-		switch (property.GetFieldType())
+		return (tag.GetPropertyIndex() == property_index) && (tag.GetNestLevel() == nest_level)
+			&& (0 == tag.GetElementIndex()) && !tag.IsKey();
+	}
+
+	// Walks the tags along the program. Without dst it only checks that the template fits the program,
+	// so a template that doesn't fit is detected before anything is written.
+	// Missing values and structures are skipped, but a number run must be complete.
+	bool Walk(const StructureProgram& program, const DataTemplateView& src, uint8* const dst
+		, ObjectFixups* const fixups)
+	{
+		const auto& ops = program.ops_;
+		uint32 tag_index = 0;
+		uint32 op_index = 0;
+		while (op_index < ops.size())
 		{
-		case MemberFieldType::Int8:		LoadSimpleValue<uint8>(dst, src.data_.data(), tag.GetDataOffset());			break;
-		case MemberFieldType::Int16:	LoadSimpleValue<int16>(dst, src.data_.data(), tag.GetDataOffset());			break;
-		case MemberFieldType::Int32:	LoadSimpleValue<int32>(dst, src.data_.data(), tag.GetDataOffset());			break;
-		case MemberFieldType::Int64:	LoadSimpleValue<int64>(dst, src.data_.data(), tag.GetDataOffset());			break;
-		case MemberFieldType::UInt8:	LoadSimpleValue<uint8>(dst, src.data_.data(), tag.GetDataOffset());			break;
-		case MemberFieldType::UInt16:	LoadSimpleValue<uint16>(dst, src.data_.data(), tag.GetDataOffset());		break;
-		case MemberFieldType::UInt32:	LoadSimpleValue<uint32>(dst, src.data_.data(), tag.GetDataOffset());		break;
-		case MemberFieldType::UInt64:	LoadSimpleValue<uint64>(dst, src.data_.data(), tag.GetDataOffset());		break;
-		case MemberFieldType::Float:	LoadSimpleValue<float>(dst, src.data_.data(), tag.GetDataOffset());			break;
-		case MemberFieldType::Double:	LoadSimpleValue<double>(dst, src.data_.data(), tag.GetDataOffset());		break;
-		case MemberFieldType::String:	LoadSimpleValue<std::string>(dst, src.data_.data(), tag.GetDataOffset());	break;
-		case MemberFieldType::ObjectPtr:LoadSimpleValue<Object*>(dst, src.data_.data(), tag.GetDataOffset());		break;
-		case MemberFieldType::Array:	tag_index = LoadArray(src, dst, structure, tag, tag_index);					break;
-		case MemberFieldType::Vector:	tag_index = LoadVector(src, dst, structure, tag, tag_index);				break;
-		case MemberFieldType::Map:		tag_index = LoadMap(src, dst, structure, tag, tag_index);					break;
-		case MemberFieldType::Struct:	tag_index = LoadStructure(src, dst,
-			Structure::GetStructure(property.GetOptionalStructID()), tag_index);									break;
+			const Op& op = ops[op_index];
+			op_index++;
+			if (EOp::StructHeader == op.op)
+				continue;
+
+			const PropertyIndex expected_property_index = (EOp::SuperTag == op.op) ? kSuperStructPropertyIndex : op.property_index;
+			const bool match = (tag_index < src.TagNum()) 
+				&& IsExpectedTag(src.tags_[tag_index], expected_property_index, op.nest_level);
+			switch (op.op)
+			{
+			case EOp::SuperTag:
+			case EOp::StructTag:
+				if (match)
+				{
+					tag_index++;
+				}
+				else
+				{
+					op_index = op.skip_to;
+				}
+				break;
+			case EOp::PodRun:
+			{
+				if (!dst)
+				{
+					if (!match || (tag_index + op.num > src.TagNum()))
+						return false;
+					for (uint32 i = 1; i < op.num; i++)
+					{
+						if (!IsExpectedTag(src.tags_[tag_index + i], op.property_index + i, op.nest_level))
+							return false;
+					}
+					const uint32 data_offset = src.tags_[tag_index].GetDataOffset();
+					const PropertyIndex last_property_index = op.property_index + op.num - 1;
+					const bool contiguous = (src.tags_[tag_index + op.num - 1].GetDataOffset()
+						+ op.structure->GetProperty(last_property_index).GetNativeSize()) == (data_offset + op.bytes);
+					if (!contiguous || (data_offset + op.bytes > src.data_.size()))
+						return false;
+				}
+				else
+				{
+					std::memcpy(dst + op.src_offset, src.data_.data() + src.tags_[tag_index].GetDataOffset(), op.bytes);
+				}
+				tag_index += op.num;
+				break;
+			}
+			case EOp::Value:
+				if (match)
+				{
+					tag_index = dst ? load::LoadValue(src, dst + op.src_offset, *op.structure, tag_index, fixups)
+						: SkipValue(src, tag_index);
+				}
+				break;
+			}
 		}
-		return tag_index;
+		return tag_index == src.TagNum();
+	}
+
+	// Returns false and writes nothing, when the template doesn't fit the program
+	bool Load(const StructureProgram& program, const DataTemplateView& src, uint8* const dst
+		, ObjectFixups* const fixups)
+	{
+		if (!Walk(program, src, nullptr, nullptr))
+			return false;
+		const bool loaded = Walk(program, src, dst, fixups);
+		Assert(loaded);
+		return loaded;
 	}
 }
-void serialization::DataTemplate::LoadIntoObject(Object* obj) const
+#pragma endregion
+
+void serialization::DataTemplate::SaveFromObject(const Object * obj, const Flag32<SaveFlags> flags)
 {
 	Assert(nullptr != obj);
-	const auto struct_id = GetStructID();
-	Assert(kWrongID != struct_id);
-	const auto& structure = Structure::GetStructure(struct_id);
-	Assert(Structure::GetStructure(obj->GetReflectionStructureID()).IsBasedOn(struct_id));
+	Assert(kWrongID == GetStructID()); //uninitialized
+	const auto structure_id = obj->GetReflectionStructureID();
+	Assert(kWrongID != structure_id);
+	const auto& structure = Structure::GetStructure(structure_id);
 	Assert(structure.RepresentsObjectClass());
-	load::LoadStructure(*this, reinterpret_cast<uint8*>(obj), structure, 0);
+	Assert(tags_.empty() && data_.empty());
+	if (flags[SaveFlags::SkipNativeDefaultValues])
+	{
+		save::SaveStructure(reinterpret_cast<const uint8*>(obj), *this, structure, 0, flags);
+	}
+	else
+	{
+		compiled::Save(compiled::GetProgram(structure), reinterpret_cast<const uint8*>(obj), *this, flags);
+	}
+	layout_hash_ = structure.GetLayoutHash();
+	Assert(tags_.empty() == data_.empty());
+	if (flags[SaveFlags::InternTags])
+	{
+		TagSchemaPool::Get().Intern(tags_);
+	}
 }
 
-#pragma endregion
-
-namespace layout_changed
+void serialization::DataTemplate::SaveDirty(const Object* obj, const DirtyPropertySet& dirty, const Flag32<SaveFlags> flags)
 {
-	using namespace serialization;
-
-	bool LoadValue(DataTemplate& dst, const Structure& structure, const DataTemplate& src, uint32& tag_index);
-	bool LoadStructure(DataTemplate& dst, const Structure& structure, const DataTemplate& src, const uint32 src_offset, uint32& tag_index);
+	Assert(nullptr != obj);
+	Assert(kWrongID == GetStructID()); //uninitialized
+	const auto& structure = Structure::GetStructure(obj->GetReflectionStructureID());
+	Assert(structure.RepresentsObjectClass());
+	Assert(tags_.empty() && data_.empty());
+	save::SaveStructure(reinterpret_cast<const uint8*>(obj), *this, structure, 0
+		, Flag32<SaveFlags>::Remove(flags, SaveFlags::SkipNativeDefaultValues), &dirty);
+	layout_hash_ = structure.GetLayoutHash();
+	Assert(tags_.empty() == data_.empty());
+}
 
-	template<typename M> static bool LoadSimpleValue(DataTemplate& dst, const uint8* const src, const uint32 src_offset)
+uint32 serialization::DirtyPropertySet::GetFirstBit(const Structure& structure)
+{
+	uint32 first_bit = 0;
+	for (const Structure* super_struct = structure.TryGetSuperStructure(); super_struct; super_struct = super_struct->TryGetSuperStructure())
 	{
-		const auto vec_size = dst.data_.size();
-		dst.data_.resize(vec_size + sizeof(M));
-		GetRef<M>(dst.data_.data(), vec_size) = GetConstRef<M>(src, src_offset);
-		return true;
+		first_bit += super_struct->GetNumberOfProperties();
 	}
+	return first_bit;
+}
 
-	template<> bool LoadSimpleValue<Object*>(DataTemplate& dst, const uint8* const src, const uint32 src_offset)
+void serialization::DirtyPropertySet::Mark(const Structure& owner, const PropertyIndex main_property_index)
+{
+	Assert(EPropertyUsage::Main == owner.GetProperty(main_property_index).GetPropertyUsage());
+	const uint32 bit = GetFirstBit(owner) + main_property_index;
+	if (bits_.size() <= (bit / 64))
 	{
-		const uint32 dst_offset = dst.data_.size();
-		dst.data_.resize(dst_offset + sizeof(StructID) + sizeof(ObjectID));
-
-		GetRef<StructID>(dst.data_.data(), dst_offset) = GetConstRef<StructID>(src, src_offset);
-		GetRef<ObjectID>(dst.data_.data(), dst_offset + sizeof(StructID)) = GetConstRef<ObjectID>(src, src_offset + sizeof(StructID));
-		return true;
+		bits_.resize(bit / 64 + 1, 0);
 	}
+	bits_[bit / 64] |= uint64(1) << (bit % 64);
+}
 
-	template<> bool LoadSimpleValue<std::string>(DataTemplate& dst, const uint8* const src, const uint32 src_offset)
+bool serialization::DirtyPropertySet::FindField(const Structure& object_structure, const uint32 field_offset
+	, const Structure*& owner, PropertyIndex& main_property_index)
+{
+	for (const Structure* structure = &object_structure; structure; structure = structure->TryGetSuperStructure())
 	{
-		const uint16 len = GetConstRef<uint16>(src, src_offset);
-		const char* c_str = &GetConstRef<char>(src, src_offset + sizeof(uint16));
-		const uint32 dst_offset = dst.data_.size();
-		dst.data_.resize(dst_offset + sizeof(uint16) + len * sizeof(char));
-		GetRef<uint16>(dst.data_.data(), dst_offset) = static_cast<uint16>(len);
-		for (uint32 i = 0; i < len; i++)
+		for (uint32 property_index = 0; property_index < structure->GetNumberOfProperties();
+			property_index = structure->NextPropertyIndexOnThisLevel(property_index))
 		{
-			GetRef<char>(dst.data_.data(), dst_offset + sizeof(uint16) + i * sizeof(char)) = c_str[i];
+			if (structure->GetProperty(property_index).GetFieldOffset() == field_offset)
+			{
+				owner = structure;
+				main_property_index = property_index;
+				return true;
+			}
 		}
-		return true;
 	}
+	return false;
+}
+
+bool serialization::DirtyPropertySet::MarkField(const Structure& object_structure, const uint32 field_offset)
+{
+	const Structure* owner = nullptr;
+	PropertyIndex property_index = kWrongID;
+	if (!FindField(object_structure, field_offset, owner, property_index))
+		return false;
+	Mark(*owner, property_index);
+	return true;
+}
+
+bool serialization::DirtyPropertySet::MarkRemovedKey(const Structure& object_structure, const uint32 field_offset, std::shared_ptr<const void> key)
+{
+	const Structure* owner = nullptr;
+	PropertyIndex property_index = kWrongID;
+	if (!FindField(object_structure, field_offset, owner, property_index))
+		return false;
+	Assert(MemberFieldType::Map == owner->GetProperty(property_index).GetFieldType());
+	Mark(*owner, property_index);
+	removed_keys_.push_back(RemovedKey{ GetFirstBit(*owner) + property_index, std::move(key) });
+	return true;
+}
+
+bool serialization::DirtyPropertySet::IsDirty(const Structure& owner, const PropertyIndex main_property_index) const
+{
+	const uint32 bit = GetFirstBit(owner) + main_property_index;
+	return ((bit / 64) < bits_.size()) && (bits_[bit / 64] & (uint64(1) << (bit % 64)));
+}
 
-	bool LoadArray(DataTemplate& dst, const Structure& structure, const DataTemplate& src, const PropertyIndex main_property_index, const Tag tag, uint32& tag_index)
+std::vector<const void*> serialization::DirtyPropertySet::GetRemovedKeys(const Structure& owner, const PropertyIndex main_property_index) const
+{
+	const uint32 bit = GetFirstBit(owner) + main_property_index;
+	std::vector<const void*> keys;
+	for (const RemovedKey& removed : removed_keys_)
 	{
-		const auto& property = structure.GetProperty(main_property_index + tag.GetSubPropertyOffset());
-		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(main_property_index + tag.GetSubPropertyOffset(), ESubType::Array_Element);
-		const SubPropertyOffset element_property_offset = element_property_index - main_property_index;
-		bool was_saved = false;
-		while (tag_index < src.TagNum())
+		if (removed.bit == bit)
 		{
-			const Tag inner_tag = src.tags_[tag_index];
-			if (inner_tag.GetNestLevel() <= tag.GetNestLevel())
-				break;
-			if (inner_tag.GetNestLevel() > (tag.GetNestLevel() + 1))
-			{
-				tag_index++;
-				continue;
-			}
-
-			const bool expected_property = (inner_tag.GetPropertyID() == property.GetPropertyID()) &&
-				(element_property_offset == inner_tag.GetSubPropertyOffset());
-			if (!expected_property)
-				break;
-			const bool within_size = inner_tag.GetElementIndex() < property.GetArraySize();
-			if (!within_size)
-			{
-				tag_index++;
-				continue;
-			}
-			was_saved |= LoadValue(dst, structure, src, tag_index);
+			keys.push_back(removed.key.get());
 		}
-		return was_saved;
 	}
+	return keys;
+}
 
-	bool LoadVector(DataTemplate& dst, const Structure& structure, const DataTemplate& src, const PropertyIndex main_property_index, const Tag tag, uint32& tag_index)
+std::vector<serialization::DataTemplate> serialization::DataTemplate::SaveMany(std::span<const Object* const> objects
+	, const Flag32<SaveFlags> flags)
+{
+	constexpr uint32 kBatchSize = 64;
+	const uint32 num = static_cast<uint32>(objects.size());
+	std::vector<DataTemplate> result(num);
+	// Per worker scratch, it grows to the biggest object once. Results are copied out with the exact size.
+	std::vector<DataTemplate> scratch(GetParallelForWorkersNum(num, kBatchSize));
+	// The scratch tags are not interned, they would lose the grown storage
+	const Flag32<SaveFlags> buffer_flags = Flag32<SaveFlags>::Remove(flags, SaveFlags::InternTags);
+	ParallelFor(num, kBatchSize, [&](const uint32 begin, const uint32 end, const uint32 worker_index)
 	{
-		const auto& property = structure.GetProperty(main_property_index + tag.GetSubPropertyOffset());
-		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(main_property_index + tag.GetSubPropertyOffset(), ESubType::Vector_Element);
-		const SubPropertyOffset element_property_offset = element_property_index - main_property_index;
-		const uint32 size = GetConstRef<uint16>(src.data_.data(), tag.GetDataOffset());
-		bool was_saved = save::SaveLength16(dst.data_, size, Flag32<SaveFlags>());
-
-		while (tag_index < src.TagNum())
+		DataTemplate& buffer = scratch[worker_index];
+		for (uint32 idx = begin; idx < end; idx++)
 		{
-			const Tag inner_tag = src.tags_[tag_index];
-			if (inner_tag.GetNestLevel() <= tag.GetNestLevel())
-				break;
-			if (inner_tag.GetNestLevel() >(tag.GetNestLevel() + 1))
+			buffer.tags_.clear();
+			buffer.data_.clear();
+			buffer.SaveFromObject(objects[idx], buffer_flags);
+			result[idx].tags_.assign(buffer.tags_.begin(), buffer.tags_.end());
+			if (flags[SaveFlags::InternTags])
 			{
-				tag_index++;
-				continue;
+				TagSchemaPool::Get().Intern(result[idx].tags_);
 			}
+			result[idx].data_.assign(buffer.data_.begin(), buffer.data_.end());
+			result[idx].strings_ = std::move(buffer.strings_);
+			result[idx].layout_hash_ = buffer.layout_hash_;
+		}
+	});
+	return result;
+}
 
-			const bool expected_property = (inner_tag.GetPropertyID() == property.GetPropertyID()) &&
-				(element_property_offset == inner_tag.GetSubPropertyOffset());
-			if (!expected_property)
-				break;
-
-			const bool within_size = inner_tag.GetElementIndex() < size;
-			if (!within_size)
-			{
-				tag_index++;
-				continue;
-			}
+#pragma endregion
 
-			was_saved |= LoadValue(dst, structure, src, tag_index);
-		}
-		return was_saved;
-	}
+namespace load
+{
+	using namespace serialization;
 
-	bool LoadMap(DataTemplate& dst, const Structure& structure, const DataTemplate& src, const PropertyIndex main_property_index, const Tag tag, uint32& tag_index)
+	uint32 LoadValue(const DataTemplateView& src, uint8* dst, const Structure& structure, uint32 tag_index
+		, ObjectFixups* fixups);
+	uint32 LoadArray(const DataTemplateView& src, uint8* dst, const Structure& structure, const Tag tag, uint32 tag_index
+		, ObjectFixups* fixups)
 	{
-		const PropertyIndex map_property_index = main_property_index + tag.GetSubPropertyOffset();
-		const auto& property = structure.GetProperty(map_property_index);
-		const PropertyIndex key_property_index = structure.GetSubPropertyIndex(map_property_index, ESubType::Key);
-		const SubPropertyOffset key_property_offset = key_property_index - main_property_index;
-		const PropertyIndex value_property_index = structure.GetSubPropertyIndex(map_property_index, ESubType::Map_Value);
-		const SubPropertyOffset value_property_offset = value_property_index - main_property_index;
-		const uint32 map_size = GetConstRef<uint16>(src.data_.data(), tag.GetDataOffset()); //number of keys
-		bool was_saved = save::SaveLength16(dst.data_, map_size, Flag32<SaveFlags>());
-		while (tag_index < src.TagNum())
+		const auto& property = structure.GetProperty(tag.GetPropertyIndex());
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Array_Element);
+		const uint32 element_size = structure.GetNativeFieldSize(element_property_index);
+		uint32 element_index = 0;
+		while (tag_index < src.tags_.size())
 		{
 			const Tag inner_tag = src.tags_[tag_index];
-			if (inner_tag.GetNestLevel() <= tag.GetNestLevel())
-				break;
-
-			if (inner_tag.GetNestLevel() >(tag.GetNestLevel() + 1))
-			{
-				tag_index++;
-				continue;
-			}
-
-			const bool expected_main_property = inner_tag.GetPropertyID() == property.GetPropertyID();
-			if (!expected_main_property)
+			const bool expected_property_idx = inner_tag.GetPropertyIndex() == element_property_index;
+			const bool expected_nest_idx = inner_tag.GetNestLevel() == tag.GetNestLevel() + 1;
+			Assert(expected_property_idx == expected_nest_idx);
+			if (!expected_property_idx || !expected_nest_idx)
 				break;
-
-			const bool expected_property_offset = inner_tag.GetSubPropertyOffset() == (inner_tag.IsKey() ? key_property_offset : value_property_offset);
-			if (!expected_property_offset)
+			element_index = DecodeElementIndex(inner_tag.GetElementIndex(), element_index);
+			const bool within_size = element_index < property.GetArraySize();
+			Assert(within_size);
+			if (!within_size)
 				break;
 
-			const bool within_size = inner_tag.GetElementIndex() < map_size;
-			if (!within_size)
-			{
-				tag_index++;
-				continue;
-			}
-			
-			was_saved |= LoadValue(dst, structure, src, tag_index);
+			tag_index = LoadValue(src, dst + element_index * element_size, structure, tag_index, fixups);
 		}
-		return was_saved;
+		return tag_index;
 	}
 
-	bool LoadValue(DataTemplate& dst, const Structure& structure, const DataTemplate& src, uint32& tag_index)
+	uint32 LoadVector(const DataTemplateView& src, uint8* dst, const Structure& structure, const Tag tag, uint32 tag_index
+		, ObjectFixups* fixups)
 	{
-		const Tag tag = src.tags_[tag_index];
-		tag_index++;
-		const PropertyIndex main_property_idx = structure.GetMainPropertyIndex(tag.GetPropertyID());
-		if (kWrongID == main_property_idx) {
-			ErrorStream() << "layout_changed::LoadValue cannot find property by ID\n";
-			return tag_index;
-		}
-		const PropertyIndex property_idx = main_property_idx + tag.GetSubPropertyOffset();
-		if (property_idx >= structure.GetNumberOfProperties()) {
-			ErrorStream() << "layout_changed::LoadValue property index out of scope\n";
-			return tag_index;
-		}
-		const auto& property = structure.GetProperty(property_idx);
-		if (EPropertyUsage::Handler == property.GetPropertyUsage()) {
-			ErrorStream() << "layout_changed::LoadValue unexpected handler property\n";
-			return tag_index;
+		const auto& handler = structure.GetHandlerProperty(tag.GetPropertyIndex()).GetVectorHandler();
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Vector_Element);
+		const uint32 size = ReadLength(src.data_.data(), tag.GetDataOffset());
+		if (tag.IsVectorEdits())
+		{
+			handler.Rearrange(dst, ReadVectorEdits(src.data_.data(), tag.GetDataOffset()));
 		}
-		if (tag.GetFieldType() != property.GetFieldType()) {
-			ErrorStream() << "layout_changed::LoadValue " << property.GetName() << " different type\n";
-			return tag_index;
+		else
+		{
+			handler.SetSize(dst, size);
 		}
-		const uint32 saved_data = dst.data_.size();
-		dst.tags_.emplace_back(Tag(property.GetPropertyID(), property_idx, (property_idx - main_property_idx),
-			property.GetFieldType(), saved_data, tag.GetNestLevel(), tag.GetElementIndex(), tag.IsKey() ? 1 : 0));
-		bool was_saved = false;
-		switch (property.GetFieldType())
+		uint32 element_index = 0;
+		while (tag_index < src.tags_.size())
 		{
-			case MemberFieldType::Int8:		was_saved = LoadSimpleValue<uint8>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::Int16:	was_saved = LoadSimpleValue<int16>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::Int32:	was_saved = LoadSimpleValue<int32>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::Int64:	was_saved = LoadSimpleValue<int64>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::UInt8:	was_saved = LoadSimpleValue<uint8>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::UInt16:	was_saved = LoadSimpleValue<uint16>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::UInt32:	was_saved = LoadSimpleValue<uint32>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::UInt64:	was_saved = LoadSimpleValue<uint64>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::Float:	was_saved = LoadSimpleValue<float>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::Double:	was_saved = LoadSimpleValue<double>		(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::String:	was_saved = LoadSimpleValue<std::string>(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::ObjectPtr:was_saved = LoadSimpleValue<Object*>	(dst, src.data_.data(), tag.GetDataOffset());	break;
-			case MemberFieldType::Array:	was_saved = LoadArray		(dst, structure, src, main_property_idx, tag, tag_index);	break;
-			case MemberFieldType::Vector:	was_saved = LoadVector		(dst, structure, src, main_property_idx, tag, tag_index);	break;
-			case MemberFieldType::Map:		was_saved = LoadMap			(dst, structure, src, main_property_idx, tag, tag_index);	break;
-			case MemberFieldType::Struct:	was_saved = LoadStructure(dst,
-				Structure::GetStructure(property.GetOptionalStructID()), src, tag.GetDataOffset(), tag_index);	break;
+			const Tag inner_tag = src.tags_[tag_index];
+			const bool expected_property_idx = inner_tag.GetPropertyIndex() == element_property_index;
+			const bool expected_nest_idx = inner_tag.GetNestLevel() == (tag.GetNestLevel() + 1);
+			Assert(expected_property_idx == expected_nest_idx);
+			if (!expected_property_idx || !expected_nest_idx)
+				break;
+			element_index = DecodeElementIndex(inner_tag.GetElementIndex(), element_index);
+			Assert(element_index < size);
+			tag_index = LoadValue(src, handler.GetElement(dst, element_index), structure, tag_index, fixups);
 		}
-		if (!was_saved)
+		return tag_index;
+	}
+
+	uint32 LoadPackedVector(const DataTemplateView& src, uint8* dst, const Structure& structure, const Tag tag, uint32 tag_index)
+	{
+		const auto& handler = structure.GetHandlerProperty(tag.GetPropertyIndex()).GetVectorHandler();
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Vector_Element);
+		const uint32 size = ReadLength(src.data_.data(), tag.GetDataOffset());
+		const auto element_type = static_cast<MemberFieldType>(GetConstRef<uint8>(src.data_.data(), tag.GetDataOffset() + GetLengthSize(size)));
+		Assert(element_type == structure.GetProperty(element_property_index).GetFieldType());
+		Assert(handler.IsTriviallyCopyable());
+		handler.SetSize(dst, size);
+		if (size)
 		{
-			dst.tags_.pop_back();
+			std::memcpy(handler.GetData(dst), src.data_.data() + tag.GetDataOffset() + GetPackedVectorHeaderSize(size)
+				, size * GetPackedElementSize(element_type));
 		}
 		return tag_index;
 	}
 
-	bool LoadStructure(DataTemplate& dst, const Structure& structure, const DataTemplate& src, const uint32 src_offset, uint32& tag_index)
+	// Loads a map key or a set element into temporary memory. When it has pointers to resolve, returns the index
+	// of the place reserved for its insert in fixups->inserts (see ObjectFixups::inserts), otherwise kWrongID.
+	uint32 LoadDetachedValue(const DataTemplateView& src, std::vector<uint8>& memory, const Structure& structure
+		, uint32& tag_index, ObjectFixups* const fixups)
 	{
-		bool was_saved = false;
-		if (tag_index < src.TagNum())
+		if (!fixups)
 		{
-			const auto old_dst_size = dst.data_.size();
-			const auto actual_struct_id = GetConstRef<StructID>(src.data_.data(), src_offset);
-			save::SaveStructId(dst.data_, actual_struct_id);
-			const bool structs_match = actual_struct_id == structure.id_;
-			if (!structs_match)
-			{
-				const Structure* actual_struct = Structure::TryGetStructure(actual_struct_id);
-				ErrorStream() << "Error layout_changed::LoadStructure - expected structure: '" << structure.GetName() << "' actual structure: '"
-					<< (actual_struct ? actual_struct->GetName().c_str() : "unknown") << '\n';
-			}
+			tag_index = LoadValue(src, memory.data(), structure, tag_index, nullptr);
+			return kWrongID;
+		}
+		const uint32 slots_num = fixups->slots.size();
+		const uint32 insert_index = fixups->inserts.size();
+		fixups->inserts.emplace_back(); // before the inserts of nested containers
+		tag_index = LoadValue(src, memory.data(), structure, tag_index, fixups);
+		if (fixups->slots.size() != slots_num)
+			return insert_index;
+		Assert(fixups->inserts.size() == (insert_index + 1));
+		fixups->inserts.pop_back();
+		return kWrongID;
+	}
 
-			const Tag first_tag = src.tags_[tag_index];
-			while (tag_index < src.TagNum())
+	// Map entry with pointers in the key, added after the pointers are resolved
+	struct DetachedMapEntry
+	{
+		std::vector<uint8> key;
+		std::vector<uint8> value;
+	};
+
+	uint32 LoadMap(const DataTemplateView& src, uint8* dst, const Structure& structure, const Tag tag, const uint32 first_tag_index
+		, ObjectFixups* fixups)
+	{
+		const auto& handler = structure.GetHandlerProperty(tag.GetPropertyIndex()).GetMapHandler();
+		const PropertyIndex key_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Key);
+		const PropertyIndex value_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Map_Value);
+		const uint32 map_size = ReadLength(src.data_.data(), tag.GetDataOffset()); //number of keys
+
+		std::vector<uint8> temp_key_memory;
+		std::vector<std::shared_ptr<DetachedMapEntry>> detached_entries(fixups ? map_size : 0); // by entry index
+		// keys_pass erases the removed keys and adds the others, values_pass loads the values
+		auto load_entries = [&](ObjectFixups* const value_fixups, const bool keys_pass, const bool values_pass) -> uint32
+		{
+			uint32 tag_index = first_tag_index;
+			for (uint32 idx = 0; idx < map_size; idx++)
 			{
-				const Tag tag = src.tags_[tag_index];
-				if (structs_match && tag.GetNestLevel() == first_tag.GetNestLevel() && tag.GetElementIndex() == first_tag.GetElementIndex() && tag.IsKey() == first_tag.IsKey())
+				//assume proper order
+				Assert(tag_index < src.tags_.size());
 				{
-					if (kSuperStructPropertyID == tag.GetPropertyID())
+					//assume !SkipNativeDefaultValues, full key data
+					const Tag key_tag = src.tags_[tag_index];
+					Assert(key_tag.GetNestLevel() == (tag.GetNestLevel() + 1));
+					Assert(key_tag.IsKey());
+					Assert(key_tag.GetPropertyIndex() == key_property_index);
+					Assert(key_tag.GetElementIndex() == (idx % kElementIndexRange));
+					const bool detached = fixups && detached_entries[idx];
+					if (!keys_pass && (key_tag.IsRemovedKey() || detached))
 					{
-						tag_index++;
-						const Structure* super_struct = structure.TryGetSuperStructure();
-						if (super_struct)
+						tag_index = SkipValue(src, tag_index);
+						if (key_tag.IsRemovedKey())
+							continue;
+					}
+					else
+					{
+						handler.InitializeKeyMemory(temp_key_memory);
+						const uint32 insert_index = LoadDetachedValue(src, temp_key_memory, structure, tag_index, keys_pass ? fixups : nullptr);
+						if (kWrongID != insert_index)
 						{
-							const uint32 saved_data = dst.data_.size();
-							dst.tags_.emplace_back(Tag(kSuperStructPropertyID, kSuperStructPropertyIndex, 0, MemberFieldType::Struct
-								, saved_data, tag.GetNestLevel(), 0, 0));
-							const bool super_was_saved = LoadStructure(dst, *super_struct, src, tag.GetDataOffset(), tag_index);
-							if (!super_was_saved)
+							// the swapped memory keeps its address, so the slots in it stay valid
+							auto entry = std::make_shared<DetachedMapEntry>();
+							entry->key.swap(temp_key_memory);
+							const IMapHandler* const map_handler = &handler;
+							if (key_tag.IsRemovedKey())
 							{
-								dst.tags_.pop_back();
+								fixups->inserts[insert_index] = [map_handler, dst, entry]() { map_handler->Remove(dst, entry->key); };
+								continue;
 							}
-							was_saved |= super_was_saved;
+							handler.InitializeValueMemory(entry->value);
+							fixups->inserts[insert_index] = [map_handler, dst, entry]() { map_handler->Add(dst, entry->key, entry->value); };
+							detached_entries[idx] = std::move(entry);
 						}
-						else
+						else if (key_tag.IsRemovedKey())
 						{
-							ErrorStream() << "Error layout_changed::LoadStructure - unknown super struct \n";
+							handler.Remove(dst, temp_key_memory);
+							continue;
 						}
 					}
-					else
+				}
+
+				uint8* value_ptr = (fixups && detached_entries[idx]) ? detached_entries[idx]->value.data()
+					: handler.Add(dst, temp_key_memory);
+				if (tag_index < src.tags_.size())
+				{
+					const Tag value_tag = src.tags_[tag_index];
+					const bool expected_nest_lvl = value_tag.GetNestLevel() == (tag.GetNestLevel() + 1);
+					const bool expected_property_idx = value_tag.GetPropertyIndex() == value_property_index;
+					const bool proper_value = expected_nest_lvl && expected_property_idx && !value_tag.IsKey();
+					// A key-only entry (default value) is followed directly by the next key
+					Assert(proper_value || !expected_nest_lvl || value_tag.IsKey());
+					if (proper_value && values_pass)
+					{
+						Assert(value_tag.GetElementIndex() == (idx % kElementIndexRange));
+						tag_index = LoadValue(src, value_ptr, structure, tag_index, value_fixups);
+					}
+					else if (proper_value)
 					{
-						was_saved |= LoadValue(dst, structure, src, tag_index);
+						tag_index = SkipValue(src, tag_index);
 					}
 				}
-				else if (tag.GetNestLevel() < first_tag.GetNestLevel())
+			}
+			return tag_index;
+		};
+
+		if (!fixups || handler.HasStableValues())
+			return load_entries(fixups, true, true);
+
+		// Values may still move while keys are added. They are loaded, when all the keys are in the map.
+		load_entries(nullptr, true, false);
+		return load_entries(fixups, false, true);
+	}
+
+	uint32 LoadSet(const DataTemplateView& src, uint8* dst, const Structure& structure, const Tag tag, uint32 tag_index
+		, ObjectFixups* fixups)
+	{
+		const auto& handler = structure.GetHandlerProperty(tag.GetPropertyIndex()).GetSetHandler();
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Set_Element);
+		const uint32 size = ReadLength(src.data_.data(), tag.GetDataOffset());
+		std::vector<uint8> temp_element_memory;
+		uint32 element_index = 0;
+		while (tag_index < src.tags_.size())
+		{
+			const Tag inner_tag = src.tags_[tag_index];
+			const bool expected_property_idx = inner_tag.GetPropertyIndex() == element_property_index;
+			const bool expected_nest_idx = inner_tag.GetNestLevel() == (tag.GetNestLevel() + 1);
+			Assert(expected_property_idx == expected_nest_idx);
+			if (!expected_property_idx || !expected_nest_idx)
+				break;
+			element_index = DecodeElementIndex(inner_tag.GetElementIndex(), element_index);
+			Assert(element_index < size);
+			handler.InitializeElementMemory(temp_element_memory);
+			const uint32 insert_index = LoadDetachedValue(src, temp_element_memory, structure, tag_index, fixups);
+			const bool removed = inner_tag.IsRemovedKey(); // see dt_operation::ProcessMap
+			if (kWrongID == insert_index)
+			{
+				if (removed)
 				{
-					break;
+					handler.Remove(dst, temp_element_memory);
 				}
 				else
 				{
-					tag_index++;
+					handler.Add(dst, temp_element_memory);
 				}
 			}
-
-			if (!was_saved)
+			else
 			{
-				dst.data_.resize(old_dst_size);
+				auto element_memory = std::make_shared<std::vector<uint8>>();
+				element_memory->swap(temp_element_memory);
+				const ISetHandler* const set_handler = &handler;
+				if (removed)
+				{
+					fixups->inserts[insert_index] = [set_handler, dst, element_memory]() { set_handler->Remove(dst, *element_memory); };
+				}
+				else
+				{
+					fixups->inserts[insert_index] = [set_handler, dst, element_memory]() { set_handler->Add(dst, *element_memory); };
+				}
 			}
 		}
-		return was_saved;
+		return tag_index;
 	}
-};
 
-void serialization::DataTemplate::RefreshAfterLayoutChanged(const StructID struct_id)
-{
-	Assert(kWrongID != GetStructID());
+	uint32 LoadStructure(const DataTemplateView& src, uint8* dst, const Structure& structure, uint32 tag_index
+		, ObjectFixups* fixups)
+	{
+		if (tag_index >= src.tags_.size())
+			return tag_index;
 
-	const auto& structure = Structure::GetStructure(struct_id);
-	Assert(structure.RepresentsObjectClass() && structure.Validate());
+		const Tag first_tag = src.tags_[tag_index];
+		do
+		{
+			const Tag tag = src.tags_[tag_index];
+			Assert(tag.GetNestLevel() <= first_tag.GetNestLevel());
+			if (tag.GetNestLevel() != first_tag.GetNestLevel() || tag.GetElementIndex() != first_tag.GetElementIndex()
+				|| tag.IsKey() != first_tag.IsKey())
+				break;
+			if (kSuperStructPropertyIndex == tag.GetPropertyIndex())
+			{
+				tag_index++;
+				const auto* super_struct = structure.TryGetSuperStructure();
+				Assert(nullptr != super_struct);
+				tag_index = LoadStructure(src, dst, *super_struct, tag_index, fixups);
+			}
+			else
+			{
+				const auto& property = structure.GetProperty(tag.GetPropertyIndex());
+				tag_index = LoadValue(src, dst + property.GetFieldOffset(), structure, tag_index, fixups);
+			}
+		} while (tag_index < src.tags_.size());
+		return tag_index;
+	}
 
-	DataTemplate refreshed_dt;
-	uint32 tag_index = 0;
-	layout_changed::LoadStructure(refreshed_dt, structure, *this, 0, tag_index);
+	uint32 LoadValue(const DataTemplateView& src, uint8* dst, const Structure& structure, uint32 tag_index
+		, ObjectFixups* fixups)
+	{
+		const Tag tag = src.tags_[tag_index];
+		const auto& property = structure.GetProperty(tag.GetPropertyIndex());
+		Assert(property.GetPropertyUsage() != EPropertyUsage::Handler);
+		tag_index++;
+		switch (property.GetFieldType())
+		{
+		case MemberFieldType::Int8:		LoadSimpleValue<uint8>(dst, src.data_.data(), tag.GetDataOffset());			break;
+		case MemberFieldType::Int16:	LoadSimpleValue<int16>(dst, src.data_.data(), tag.GetDataOffset());			break;
+		case MemberFieldType::Int32:	LoadSimpleValue<int32>(dst, src.data_.data(), tag.GetDataOffset());			break;
+		case MemberFieldType::Int64:	LoadSimpleValue<int64>(dst, src.data_.data(), tag.GetDataOffset());			break;
+		case MemberFieldType::UInt8:	LoadSimpleValue<uint8>(dst, src.data_.data(), tag.GetDataOffset());			break;
+		case MemberFieldType::UInt16:	LoadSimpleValue<uint16>(dst, src.data_.data(), tag.GetDataOffset());		break;
+		case MemberFieldType::UInt32:	LoadSimpleValue<uint32>(dst, src.data_.data(), tag.GetDataOffset());		break;
+		case MemberFieldType::UInt64:	LoadSimpleValue<uint64>(dst, src.data_.data(), tag.GetDataOffset());		break;
+		case MemberFieldType::Float:	LoadSimpleValue<float>(dst, src.data_.data(), tag.GetDataOffset());			break;
+		case MemberFieldType::Double:	LoadSimpleValue<double>(dst, src.data_.data(), tag.GetDataOffset());		break;
+		case MemberFieldType::String:	LoadString(dst, src, tag);													break;
+		case MemberFieldType::ObjectPtr:LoadObjectPtr(dst, src.data_.data(), tag.GetDataOffset(), fixups);			break;
+		case MemberFieldType::Array:	tag_index = LoadArray(src, dst, structure, tag, tag_index, fixups);			break;
+		case MemberFieldType::Vector:	tag_index = tag.IsPackedVector()
+			? LoadPackedVector(src, dst, structure, tag, tag_index)
+			: LoadVector(src, dst, structure, tag, tag_index, fixups);												break;
+		case MemberFieldType::Map:		tag_index = LoadMap(src, dst, structure, tag, tag_index, fixups);			break;
+		case MemberFieldType::Set:		tag_index = LoadSet(src, dst, structure, tag, tag_index, fixups);			break;
+		case MemberFieldType::Struct:	tag_index = LoadStructure(src, dst,
+			Structure::GetStructure(property.GetOptionalStructID()), tag_index, fixups);							break;
+		}
+		return tag_index;
+	}
+}
+uint32 serialization::details::LoadStructure(const DataTemplateView& src, uint8* dst, const Structure& structure
+	, const uint32 tag_index, ObjectFixups* fixups)
+{
+	return load::LoadStructure(src, dst, structure, tag_index, fixups);
+}
 
-	*this = refreshed_dt;
-	Assert(kWrongID != GetStructID());
+uint32 serialization::details::SkipValue(const DataTemplateView& src, const uint32 tag_index)
+{
+	return ::SkipValue(src, tag_index);
 }
 
-namespace dt_operation
+void serialization::details::LoadObjectPtr(uint8* dst, const uint8* src, const uint32 src_offset, ObjectFixups* fixups)
 {
-	using namespace serialization;
+	::LoadObjectPtr(dst, src, src_offset, fixups);
+}
 
-	bool TagsEqual(const Tag a, const Tag b)
+namespace load
+{
+	void LoadObject(const DataTemplateView& src, Object* obj, ObjectFixups* const fixups)
 	{
-		//byte_offset_ is skipped
-
-		const bool are_equal =
-			a.GetPropertyIndex() == b.GetPropertyIndex() &&
-			a.GetElementIndex() == b.GetElementIndex() &&
-			a.IsKey() == b.IsKey();
-		if (are_equal)
+		Assert(nullptr != obj);
+		const auto struct_id = src.GetStructID();
+		Assert(kWrongID != struct_id);
+		const auto& structure = Structure::GetStructure(struct_id);
+		Assert(Structure::GetStructure(obj->GetReflectionStructureID()).IsBasedOn(struct_id));
+		Assert(structure.RepresentsObjectClass());
+		Assert(!src.layout_hash_ || (src.layout_hash_ == structure.GetLayoutHash())); // see RefreshAfterLayoutChanged
+		uint8* const dst = reinterpret_cast<uint8*>(obj);
+		if (!compiled::Load(compiled::GetProgram(structure), src, dst, fixups))
 		{
-			Assert(a.GetFieldType() == b.GetFieldType());
-			Assert(a.GetPropertyID() == b.GetPropertyID());
-			Assert(a.GetSubPropertyOffset() == b.GetSubPropertyOffset());
+			LoadStructure(src, dst, structure, 0, fixups); // sparse or reordered template
 		}
-		return are_equal;
 	}
+}
+
+void serialization::details::LoadObject(const DataTemplateView& src, Object* obj, ObjectFixups* fixups)
+{
+	load::LoadObject(src, obj, fixups);
+}
+
+void serialization::DataTemplate::LoadIntoObject(Object* obj) const
+{
+	load::LoadObject(*this, obj, nullptr);
+}
+
+void serialization::DataTemplateView::LoadIntoObject(Object* obj) const
+{
+	load::LoadObject(*this, obj, nullptr);
+}
 
-	//returns if a goes before b
-	bool IsTagFirst(const Tag a, const Tag b)
+void serialization::DataTemplate::LoadIntoObjects(std::span<const std::pair<const DataTemplate*, Object*>> batch
+	, ObjectSolver* solver)
+{
+	constexpr uint32 kBatchSize = 32;
+	const uint32 num = static_cast<uint32>(batch.size());
+	std::vector<ObjectFixups> fixups(GetParallelForWorkersNum(num, kBatchSize));
+	ParallelFor(num, kBatchSize, [&](const uint32 begin, const uint32 end, const uint32 worker_index)
 	{
-		if (a.GetPropertyIndex() == b.GetPropertyIndex())
+		ObjectFixups* const worker_fixups = solver ? &fixups[worker_index] : nullptr;
+		for (uint32 idx = begin; idx < end; idx++)
 		{
-			if (a.GetElementIndex() < b.GetElementIndex())
-				return true;
-			if ((a.GetElementIndex() == b.GetElementIndex()) && a.IsKey() && !b.IsKey())
-				return true;
-
-			return false;
+			Assert(nullptr != batch[idx].first);
+			load::LoadObject(*batch[idx].first, batch[idx].second, worker_fixups);
 		}
-		if (a.GetPropertyIndex() == kSuperStructPropertyIndex)
-			return true;
-		if (b.GetPropertyIndex() == kSuperStructPropertyIndex)
-			return false;
-		return a.GetPropertyIndex() < b.GetPropertyIndex();
-	}
+	});
 
-	void CopySingleTagUnchecked(DataTemplate& dst, const DataTemplate& src, const uint32 tag_index, const uint32 nest_lvl_offset)
+	// All the targets are loaded, the solver can see them
+	if (!solver)
+		return;
+	for (auto& worker_fixups : fixups)
 	{
-		const Tag tag = src.tags_[tag_index];
-		dst.tags_.emplace_back(Tag(tag.GetPropertyID(), tag.GetPropertyIndex(), tag.GetSubPropertyOffset(),
-			tag.GetFieldType(), dst.data_.size(), tag.GetNestLevel() + nest_lvl_offset, tag.GetElementIndex(), tag.IsKey() ? 1 : 0));
-
-		const uint32 src_data_chunk_end = (src.TagNum() > (tag_index + 1)) ? src.tags_[tag_index + 1].GetDataOffset() : src.data_.size();
-		std::copy(src.data_.begin() + tag.GetDataOffset(), src.data_.begin() + src_data_chunk_end, std::back_inserter(dst.data_));
+		worker_fixups.Resolve(*solver);
 	}
+}
 
-	bool CopyNestedTags(DataTemplate& dst, const DataTemplate& src, uint32& tag_index, const uint32 nest_lvl_offset)
+void serialization::ObjectFixups::Resolve(ObjectSolver& solver)
+{
+	for (const ObjectFixup& fixup : slots)
 	{
-		if (src.TagNum() <= tag_index)
-			return false;
-		const uint32 min_nest_level = src.tags_[tag_index].GetNestLevel();
-		do
-		{
-			CopySingleTagUnchecked(dst, src, tag_index, nest_lvl_offset);
-			tag_index++;
-		} while ((tag_index < src.TagNum()) && (src.tags_[tag_index].GetNestLevel() > min_nest_level));
-		return true;
+		*fixup.slot = solver.ObjectFromId(fixup.object_id);
 	}
-
-	void SkipNestedTags(const DataTemplate& src, uint32& tag_index)
+	for (auto it = inserts.rbegin(); it != inserts.rend(); it++)
 	{
-		if (src.TagNum() <= tag_index)
-			return;
-		const uint32 min_nest_level = src.tags_[tag_index].GetNestLevel();
-		do {
-			tag_index++;
-		} while ((tag_index < src.TagNum()) && (src.tags_[tag_index].GetNestLevel() > min_nest_level));
+		Assert(*it);
+		(*it)();
 	}
+	slots.clear();
+	inserts.clear();
+}
 
-	enum class EDataTemplateOperation
-	{
-		Merge,
-		Diff
-	};
+#pragma endregion
 
-	struct ProcessContext
+namespace layout_changed
+{
+	using namespace serialization;
+
+	// Recorded while a template is refreshed. Apart from the checked data below, the refresh depends only on the tags,
+	// so it can be replayed on templates with the same tags (data offsets aside), see Replay.
+	struct MigrationPlan
+	{
+		StructID struct_id = kWrongID;
+		TagList source_tags;
+		std::vector<Tag> tags;										// refreshed tags, the data offsets are set on replay
+		std::vector<uint32> sources;								// source tag index of each refreshed tag
+		std::vector<std::pair<uint32, StructID>> struct_ids;		// struct id at the data of a source tag, kWrongID is the root
+		std::vector<std::pair<uint32, MemberFieldType>> packed_types;	// element type of a packed vector
+		std::vector<std::pair<uint32, uint32>> min_lengths;			// length needed by the element tags of a container
+		bool replayable = true;										// false, when the data changed a decision
+	};
+
+	bool LoadValue(DataTemplate& dst, const Structure& structure, const DataTemplateView& src, uint32& tag_index, MigrationPlan* const plan);
+	bool LoadStructure(DataTemplate& dst, const Structure& structure, const DataTemplateView& src, const uint32 src_offset, uint32& tag_index
+		, MigrationPlan* const plan);
+
+	template<typename M> static bool LoadSimpleValue(DataTemplate& dst, const uint8* const src, const uint32 src_offset)
+	{
+		const auto vec_size = dst.data_.size();
+		dst.data_.resize(vec_size + sizeof(M));
+		GetRef<M>(dst.data_.data(), vec_size) = GetConstRef<M>(src, src_offset);
+		return true;
+	}
+
+	template<> bool LoadSimpleValue<Object*>(DataTemplate& dst, const uint8* const src, const uint32 src_offset)
+	{
+		const uint32 dst_offset = dst.data_.size();
+		dst.data_.resize(dst_offset + sizeof(StructID) + sizeof(ObjectID));
+
+		GetRef<StructID>(dst.data_.data(), dst_offset) = GetConstRef<StructID>(src, src_offset);
+		GetRef<ObjectID>(dst.data_.data(), dst_offset + sizeof(StructID)) = GetConstRef<ObjectID>(src, src_offset + sizeof(StructID));
+		return true;
+	}
+
+	bool SharesStringTable(const DataTemplate& dst, const DataTemplateView& src)
+	{
+		return dst.strings_ && (dst.strings_->GetData().data() == src.strings_.data());
+	}
+
+	// Keeps the way the string is stored. The table offset is copied, when dst shares the table of src.
+	bool LoadString(DataTemplate& dst, const DataTemplateView& src, const Tag tag)
+	{
+		if (tag.IsTableString() && SharesStringTable(dst, src))
+			return LoadSimpleValue<uint32>(dst, src.data_.data(), tag.GetDataOffset());
+		serialization::details::SaveString(dst, src.GetString(tag), tag.IsTableString());
+		return true;
+	}
+
+	bool LoadArray(DataTemplate& dst, const Structure& structure, const DataTemplateView& src, const PropertyIndex main_property_index, const Tag tag, uint32& tag_index
+		, MigrationPlan* const plan)
+	{
+		const auto& property = structure.GetProperty(main_property_index + tag.GetSubPropertyOffset());
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(main_property_index + tag.GetSubPropertyOffset(), ESubType::Array_Element);
+		const SubPropertyOffset element_property_offset = element_property_index - main_property_index;
+		bool was_saved = false;
+		uint32 element_index = 0;
+		while (tag_index < src.TagNum())
+		{
+			const Tag inner_tag = src.tags_[tag_index];
+			if (inner_tag.GetNestLevel() <= tag.GetNestLevel())
+				break;
+			if (inner_tag.GetNestLevel() > (tag.GetNestLevel() + 1))
+			{
+				tag_index++;
+				continue;
+			}
+
+			const bool expected_property = (inner_tag.GetPropertyID() == property.GetPropertyID()) &&
+				(element_property_offset == inner_tag.GetSubPropertyOffset());
+			if (!expected_property)
+				break;
+			element_index = DecodeElementIndex(inner_tag.GetElementIndex(), element_index);
+			const bool within_size = element_index < property.GetArraySize();
+			if (!within_size)
+			{
+				tag_index++;
+				continue;
+			}
+			was_saved |= LoadValue(dst, structure, src, tag_index, plan);
+		}
+		return was_saved;
+	}
+
+	// Vectors and sets
+	bool LoadVector(DataTemplate& dst, const Structure& structure, const DataTemplateView& src, const PropertyIndex main_property_index, const Tag tag, uint32& tag_index
+		, MigrationPlan* const plan)
+	{
+		const uint32 vector_tag_index = tag_index - 1;
+		const auto& property = structure.GetProperty(main_property_index + tag.GetSubPropertyOffset());
+		const ESubType element_sub_type = (MemberFieldType::Set == property.GetFieldType()) ? ESubType::Set_Element : ESubType::Vector_Element;
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(main_property_index + tag.GetSubPropertyOffset(), element_sub_type);
+		const SubPropertyOffset element_property_offset = element_property_index - main_property_index;
+		const uint32 size = ReadLength(src.data_.data(), tag.GetDataOffset());
+		bool was_saved = true;
+		if (tag.IsVectorEdits())
+		{
+			AppendVectorEdits(dst.data_, ReadVectorEdits(src.data_.data(), tag.GetDataOffset()));
+		}
+		else
+		{
+			was_saved = save::SaveLength(dst.data_, size, Flag32<SaveFlags>());
+		}
+		uint32 element_index = 0;
+		uint32 needed_size = 0;
+		while (tag_index < src.TagNum())
+		{
+			const Tag inner_tag = src.tags_[tag_index];
+			if (inner_tag.GetNestLevel() <= tag.GetNestLevel())
+				break;
+			if (inner_tag.GetNestLevel() >(tag.GetNestLevel() + 1))
+			{
+				tag_index++;
+				continue;
+			}
+
+			const bool expected_property = (inner_tag.GetPropertyID() == property.GetPropertyID()) &&
+				(element_property_offset == inner_tag.GetSubPropertyOffset());
+			if (!expected_property)
+				break;
+
+			element_index = DecodeElementIndex(inner_tag.GetElementIndex(), element_index);
+			const bool within_size = element_index < size;
+			if (!within_size)
+			{
+				if (plan)
+				{
+					plan->replayable = false;
+				}
+				tag_index++;
+				continue;
+			}
+			needed_size = element_index + 1;
+
+			was_saved |= LoadValue(dst, structure, src, tag_index, plan);
+		}
+		if (plan && needed_size)
+		{
+			plan->min_lengths.emplace_back(vector_tag_index, needed_size);
+		}
+		return was_saved;
+	}
+
+	bool CanLoadPackedVector(const Structure& structure, const PropertyIndex vector_property_index, const DataTemplateView& src, const Tag tag)
+	{
+		const auto& handler = structure.GetHandlerProperty(vector_property_index).GetVectorHandler();
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(vector_property_index, ESubType::Vector_Element);
+		const auto element_type = GetPackedElementType(src.data_.data(), tag.GetDataOffset());
+		return handler.IsTriviallyCopyable() && (element_type == structure.GetProperty(element_property_index).GetFieldType());
+	}
+
+	bool LoadPackedVector(DataTemplate& dst, const DataTemplateView& src, const Tag tag)
+	{
+		const uint32 data_size = GetPackedVectorDataSize(src.data_.data(), tag.GetDataOffset());
+		const auto src_begin = src.data_.begin() + tag.GetDataOffset();
+		std::copy(src_begin, src_begin + data_size, std::back_inserter(dst.data_));
+		return true;
+	}
+
+	bool LoadMap(DataTemplate& dst, const Structure& structure, const DataTemplateView& src, const PropertyIndex main_property_index, const Tag tag, uint32& tag_index
+		, MigrationPlan* const plan)
+	{
+		const uint32 map_tag_index = tag_index - 1;
+		const PropertyIndex map_property_index = main_property_index + tag.GetSubPropertyOffset();
+		const auto& property = structure.GetProperty(map_property_index);
+		const PropertyIndex key_property_index = structure.GetSubPropertyIndex(map_property_index, ESubType::Key);
+		const SubPropertyOffset key_property_offset = key_property_index - main_property_index;
+		const PropertyIndex value_property_index = structure.GetSubPropertyIndex(map_property_index, ESubType::Map_Value);
+		const SubPropertyOffset value_property_offset = value_property_index - main_property_index;
+		const uint32 map_size = ReadLength(src.data_.data(), tag.GetDataOffset()); //number of keys
+		bool was_saved = save::SaveLength(dst.data_, map_size, Flag32<SaveFlags>());
+		uint32 element_index = 0;
+		uint32 needed_size = 0;
+		while (tag_index < src.TagNum())
+		{
+			const Tag inner_tag = src.tags_[tag_index];
+			if (inner_tag.GetNestLevel() <= tag.GetNestLevel())
+				break;
+
+			if (inner_tag.GetNestLevel() >(tag.GetNestLevel() + 1))
+			{
+				tag_index++;
+				continue;
+			}
+
+			const bool expected_main_property = inner_tag.GetPropertyID() == property.GetPropertyID();
+			if (!expected_main_property)
+				break;
+
+			const bool expected_property_offset = inner_tag.GetSubPropertyOffset() == (inner_tag.IsKey() ? key_property_offset : value_property_offset);
+			if (!expected_property_offset)
+				break;
+
+			element_index = DecodeElementIndex(inner_tag.GetElementIndex(), element_index);
+			const bool within_size = element_index < map_size;
+			if (!within_size)
+			{
+				if (plan)
+				{
+					plan->replayable = false;
+				}
+				tag_index++;
+				continue;
+			}
+			needed_size = element_index + 1;
+			
+			was_saved |= LoadValue(dst, structure, src, tag_index, plan);
+		}
+		if (plan && needed_size)
+		{
+			plan->min_lengths.emplace_back(map_tag_index, needed_size);
+		}
+		return was_saved;
+	}
+
+	bool LoadValue(DataTemplate& dst, const Structure& structure, const DataTemplateView& src, uint32& tag_index, MigrationPlan* const plan)
+	{
+		const Tag tag = src.tags_[tag_index];
+		tag_index++;
+		const PropertyIndex main_property_idx = structure.GetMainPropertyIndex(tag.GetPropertyID());
+		if (kWrongID == main_property_idx) {
+			ErrorStream() << "layout_changed::LoadValue cannot find property by ID\n";
+			return tag_index;
+		}
+		const PropertyIndex property_idx = main_property_idx + tag.GetSubPropertyOffset();
+		if (property_idx >= structure.GetNumberOfProperties()) {
+			ErrorStream() << "layout_changed::LoadValue property index out of scope\n";
+			return tag_index;
+		}
+		const auto& property = structure.GetProperty(property_idx);
+		if (EPropertyUsage::Handler == property.GetPropertyUsage()) {
+			ErrorStream() << "layout_changed::LoadValue unexpected handler property\n";
+			return tag_index;
+		}
+		if (tag.GetFieldType() != property.GetFieldType()) {
+			ErrorStream() << "layout_changed::LoadValue " << property.GetName() << " different type\n";
+			return tag_index;
+		}
+		if (tag.IsPackedVector() && plan) {
+			plan->packed_types.emplace_back(tag_index - 1, GetPackedElementType(src.data_.data(), tag.GetDataOffset()));
+		}
+		if (tag.IsPackedVector() && !CanLoadPackedVector(structure, property_idx, src, tag)) {
+			ErrorStream() << "layout_changed::LoadValue " << property.GetName() << " cannot be loaded as packed vector\n";
+			return false;
+		}
+		const uint32 saved_data = dst.data_.size();
+		dst.tags_.emplace_back(Tag(property.GetPropertyID(), property_idx, (property_idx - main_property_idx),
+			property.GetFieldType(), saved_data, tag.GetNestLevel(), tag.GetElementIndex(), tag.IsKey() ? 1 : 0, tag.GetFlags()));
+		if (plan)
+		{
+			plan->sources.push_back(tag_index - 1);
+		}
+		bool was_saved = false;
+		switch (property.GetFieldType())
+		{
+			case MemberFieldType::Int8:		was_saved = LoadSimpleValue<uint8>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::Int16:	was_saved = LoadSimpleValue<int16>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::Int32:	was_saved = LoadSimpleValue<int32>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::Int64:	was_saved = LoadSimpleValue<int64>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::UInt8:	was_saved = LoadSimpleValue<uint8>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::UInt16:	was_saved = LoadSimpleValue<uint16>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::UInt32:	was_saved = LoadSimpleValue<uint32>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::UInt64:	was_saved = LoadSimpleValue<uint64>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::Float:	was_saved = LoadSimpleValue<float>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::Double:	was_saved = LoadSimpleValue<double>		(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::String:	was_saved = LoadString				(dst, src, tag);								break;
+			case MemberFieldType::ObjectPtr:was_saved = LoadSimpleValue<Object*>	(dst, src.data_.data(), tag.GetDataOffset());	break;
+			case MemberFieldType::Array:	was_saved = LoadArray		(dst, structure, src, main_property_idx, tag, tag_index, plan);	break;
+			case MemberFieldType::Vector:	was_saved = tag.IsPackedVector()
+				? LoadPackedVector(dst, src, tag)
+				: LoadVector(dst, structure, src, main_property_idx, tag, tag_index, plan);								break;
+			case MemberFieldType::Map:		was_saved = LoadMap			(dst, structure, src, main_property_idx, tag, tag_index, plan);	break;
+			case MemberFieldType::Set:		was_saved = LoadVector		(dst, structure, src, main_property_idx, tag, tag_index, plan);	break;
+			case MemberFieldType::Struct:	was_saved = LoadStructure(dst,
+				Structure::GetStructure(property.GetOptionalStructID()), src, tag.GetDataOffset(), tag_index, plan);	break;
+		}
+		if (!was_saved)
+		{
+			dst.tags_.pop_back();
+			if (plan)
+			{
+				plan->sources.pop_back();
+			}
+		}
+		return tag_index;
+	}
+
+	bool LoadStructure(DataTemplate& dst, const Structure& structure, const DataTemplateView& src, const uint32 src_offset, uint32& tag_index
+		, MigrationPlan* const plan)
+	{
+		bool was_saved = false;
+		if (tag_index < src.TagNum())
+		{
+			const auto old_dst_size = dst.data_.size();
+			const auto actual_struct_id = GetConstRef<StructID>(src.data_.data(), src_offset);
+			save::SaveStructId(dst.data_, actual_struct_id);
+			if (plan)
+			{
+				// Nested structures are read right after their tag
+				plan->struct_ids.emplace_back(tag_index ? (tag_index - 1) : kWrongID, actual_struct_id);
+			}
+			const bool structs_match = actual_struct_id == structure.id_;
+			if (!structs_match)
+			{
+				const Structure* actual_struct = Structure::TryGetStructure(actual_struct_id);
+				ErrorStream() << "Error layout_changed::LoadStructure - expected structure: '" << structure.GetName() << "' actual structure: '"
+					<< (actual_struct ? actual_struct->GetName().c_str() : "unknown") << '\n';
+			}
+
+			const Tag first_tag = src.tags_[tag_index];
+			while (tag_index < src.TagNum())
+			{
+				const Tag tag = src.tags_[tag_index];
+				if (structs_match && tag.GetNestLevel() == first_tag.GetNestLevel() && tag.GetElementIndex() == first_tag.GetElementIndex() && tag.IsKey() == first_tag.IsKey())
+				{
+					if (kSuperStructPropertyID == tag.GetPropertyID())
+					{
+						tag_index++;
+						const Structure* super_struct = structure.TryGetSuperStructure();
+						if (super_struct)
+						{
+							const uint32 saved_data = dst.data_.size();
+							dst.tags_.emplace_back(Tag(kSuperStructPropertyID, kSuperStructPropertyIndex, 0, MemberFieldType::Struct
+								, saved_data, tag.GetNestLevel(), 0, 0));
+							if (plan)
+							{
+								plan->sources.push_back(tag_index - 1);
+							}
+							const bool super_was_saved = LoadStructure(dst, *super_struct, src, tag.GetDataOffset(), tag_index, plan);
+							if (!super_was_saved)
+							{
+								dst.tags_.pop_back();
+								if (plan)
+								{
+									plan->sources.pop_back();
+								}
+							}
+							was_saved |= super_was_saved;
+						}
+						else
+						{
+							ErrorStream() << "Error layout_changed::LoadStructure - unknown super struct \n";
+						}
+					}
+					else
+					{
+						was_saved |= LoadValue(dst, structure, src, tag_index, plan);
+					}
+				}
+				else if (tag.GetNestLevel() < first_tag.GetNestLevel())
+				{
+					break;
+				}
+				else
+				{
+					tag_index++;
+				}
+			}
+
+			if (!was_saved)
+			{
+				dst.data_.resize(old_dst_size);
+			}
+		}
+		return was_saved;
+	}
+
+	DataTemplate Refresh(const DataTemplate& src, const StructID struct_id, MigrationPlan* const plan)
+	{
+		Assert(kWrongID != src.GetStructID());
+
+		const auto& structure = Structure::GetStructure(struct_id);
+		Assert(structure.RepresentsObjectClass() && structure.Validate());
+
+		DataTemplate refreshed_dt;
+		refreshed_dt.strings_ = src.strings_;
+		uint32 tag_index = 0;
+		LoadStructure(refreshed_dt, structure, src, 0, tag_index, plan);
+		refreshed_dt.layout_hash_ = structure.GetLayoutHash();
+		if (plan)
+		{
+			plan->struct_id = struct_id;
+			plan->source_tags = src.tags_;
+			plan->tags.assign(refreshed_dt.tags_.begin(), refreshed_dt.tags_.end());
+		}
+		Assert(kWrongID != refreshed_dt.GetStructID());
+		return refreshed_dt;
+	}
+
+	bool SameTagsIgnoringOffsets(const Tag a, const Tag b)
+	{
+		return (a.GetPropertyID() == b.GetPropertyID()) && (a.GetPropertyIndex() == b.GetPropertyIndex())
+			&& (a.GetNestLevel() == b.GetNestLevel()) && (a.GetElementIndex() == b.GetElementIndex())
+			&& (a.IsKey() == b.IsKey()) && (a.GetFlags() == b.GetFlags())
+			&& (a.GetFieldType() == b.GetFieldType()) && (a.GetSubPropertyOffset() == b.GetSubPropertyOffset());
+	}
+
+	// Hashed by words, it's computed for every template
+	uint64 GetPlanKey(const DataTemplate& src, const StructID struct_id)
+	{
+		constexpr uint64 kPrime = 0x100000001b3;
+		uint64 hash = (0xcbf29ce484222325 ^ struct_id) * kPrime;
+		for (const Tag tag : src.tags_)
+		{
+			const Tag tag0 = tag.WithDataOffset(0);
+			uint32 words[sizeof(Tag) / sizeof(uint32)];
+			std::memcpy(words, &tag0, sizeof(Tag));
+			for (const uint32 word : words)
+			{
+				hash = (hash ^ word) * kPrime;
+			}
+		}
+		return hash ^ (hash >> 32);
+	}
+
+	// The refreshed data is the data of the kept tags, in order. Returns false, when src doesn't fit the plan.
+	bool Replay(const MigrationPlan& plan, const DataTemplate& src, const StructID struct_id, DataTemplate& dst)
+	{
+		const bool same_tags = plan.replayable && (plan.struct_id == struct_id) && (src.TagNum() == plan.source_tags.size())
+			&& (src.tags_.IsSharedWith(plan.source_tags)
+				|| std::equal(src.tags_.begin(), src.tags_.end(), plan.source_tags.begin(), SameTagsIgnoringOffsets));
+		if (!same_tags)
+			return false;
+
+		const uint8* const data = src.data_.data();
+		auto data_offset = [&](const uint32 tag_index) { return (kWrongID == tag_index) ? 0 : src.tags_[tag_index].GetDataOffset(); };
+		for (const auto& [tag_index, saved_struct_id] : plan.struct_ids)
+		{
+			if (GetConstRef<StructID>(data, data_offset(tag_index)) != saved_struct_id)
+				return false;
+		}
+		for (const auto& [tag_index, element_type] : plan.packed_types)
+		{
+			if (GetPackedElementType(data, data_offset(tag_index)) != element_type)
+				return false;
+		}
+		for (const auto& [tag_index, min_length] : plan.min_lengths)
+		{
+			if (ReadLength(data, data_offset(tag_index)) < min_length)
+				return false;
+		}
+
+		dst.strings_ = src.strings_;
+		dst.layout_hash_ = Structure::GetStructure(struct_id).GetLayoutHash();
+		if (plan.tags.empty())
+			return true;
+		dst.data_.reserve(src.data_.size());
+		save::SaveStructId(dst.data_, plan.struct_ids.front().second); // the root is read first
+		std::vector<Tag> tags(plan.tags.size());
+		for (uint32 idx = 0; idx < tags.size();)
+		{
+			// Data of consecutive kept tags is copied at once
+			uint32 source = plan.sources[idx];
+			const uint32 run_begin = src.tags_[source].GetDataOffset();
+			const uint32 run_dst = dst.data_.size();
+			for (; (idx < tags.size()) && (plan.sources[idx] == source); idx++, source++)
+			{
+				tags[idx] = plan.tags[idx].WithDataOffset(run_dst + src.tags_[source].GetDataOffset() - run_begin);
+			}
+			const uint32 run_end = (source < src.TagNum()) ? src.tags_[source].GetDataOffset() : src.data_.size();
+			dst.data_.insert(dst.data_.end(), data + run_begin, data + run_end);
+		}
+		dst.tags_ = TagList(std::move(tags));
+		return true;
+	}
+};
+
+bool serialization::DataTemplate::IsLayoutCurrent(const StructID struct_id) const
+{
+	return layout_hash_ && (GetStructID() == struct_id) && (Structure::GetStructure(struct_id).GetLayoutHash() == layout_hash_);
+}
+
+void serialization::DataTemplate::RefreshAfterLayoutChanged(const StructID struct_id)
+{
+	if (!IsLayoutCurrent(struct_id))
+	{
+		*this = layout_changed::Refresh(*this, struct_id, nullptr);
+	}
+}
+
+void serialization::DataTemplate::RefreshManyAfterLayoutChanged(std::span<const std::pair<DataTemplate*, StructID>> batch)
+{
+	constexpr uint32 kBatchSize = 32;
+	const uint32 num = static_cast<uint32>(batch.size());
+	std::vector<uint64> keys(num);
+	std::vector<uint8> current(num);
+	ParallelFor(num, kBatchSize, [&](const uint32 begin, const uint32 end, const uint32)
+	{
+		for (uint32 idx = begin; idx < end; idx++)
+		{
+			const auto& [dt, struct_id] = batch[idx];
+			current[idx] = dt->IsLayoutCurrent(struct_id);
+			keys[idx] = current[idx] ? 0 : layout_changed::GetPlanKey(*dt, struct_id);
+		}
+	});
+
+	// The first template of each key records the plan
+	std::unordered_map<uint64, uint32> plan_by_key;
+	std::vector<uint32> plan_indices(num, kWrongID);
+	std::vector<uint32> recorded; // template index by plan index
+	for (uint32 idx = 0; idx < num; idx++)
+	{
+		if (current[idx])
+			continue;
+		const auto it = plan_by_key.emplace(keys[idx], static_cast<uint32>(recorded.size()));
+		if (it.second)
+		{
+			recorded.push_back(idx);
+		}
+		plan_indices[idx] = it.first->second;
+	}
+
+	std::vector<layout_changed::MigrationPlan> plans(recorded.size());
+	ParallelFor(static_cast<uint32>(recorded.size()), 1, [&](const uint32 begin, const uint32 end, const uint32)
+	{
+		for (uint32 plan_index = begin; plan_index < end; plan_index++)
+		{
+			const auto& [dt, struct_id] = batch[recorded[plan_index]];
+			*dt = layout_changed::Refresh(*dt, struct_id, &plans[plan_index]);
+		}
+	});
+
+	ParallelFor(num, kBatchSize, [&](const uint32 begin, const uint32 end, const uint32)
+	{
+		for (uint32 idx = begin; idx < end; idx++)
+		{
+			const uint32 plan_index = plan_indices[idx];
+			if ((kWrongID == plan_index) || (recorded[plan_index] == idx))
+				continue;
+			const auto& [dt, struct_id] = batch[idx];
+			DataTemplate refreshed_dt;
+			if (!layout_changed::Replay(plans[plan_index], *dt, struct_id, refreshed_dt))
+			{
+				refreshed_dt = layout_changed::Refresh(*dt, struct_id, nullptr); // a hash collision or other data
+			}
+			*dt = std::move(refreshed_dt);
+		}
+	});
+}
+
+namespace dt_operation
+{
+	using namespace serialization;
+
+	// The same property, the element index is skipped
+	bool SameValueKind(const Tag a, const Tag b)
+	{
+		const bool are_equal =
+			a.GetPropertyIndex() == b.GetPropertyIndex() &&
+			a.IsKey() == b.IsKey();
+		if (are_equal)
+		{
+			Assert(a.GetFieldType() == b.GetFieldType());
+			Assert(a.GetPropertyID() == b.GetPropertyID());
+			Assert(a.GetSubPropertyOffset() == b.GetSubPropertyOffset());
+		}
+		return are_equal;
+	}
+
+	bool TagsEqual(const Tag a, const Tag b)
+	{
+		//byte_offset_ is skipped
+		return (a.GetElementIndex() == b.GetElementIndex()) && SameValueKind(a, b);
+	}
+
+	//returns if a goes before b, the element indexes are decoded
+	bool IsTagFirst(const Tag a, const uint32 a_element_index, const Tag b, const uint32 b_element_index)
+	{
+		if (a.GetPropertyIndex() == b.GetPropertyIndex())
+		{
+			if (a_element_index < b_element_index)
+				return true;
+			if ((a_element_index == b_element_index) && a.IsKey() && !b.IsKey())
+				return true;
+
+			return false;
+		}
+		if (a.GetPropertyIndex() == kSuperStructPropertyIndex)
+			return true;
+		if (b.GetPropertyIndex() == kSuperStructPropertyIndex)
+			return false;
+		return a.GetPropertyIndex() < b.GetPropertyIndex();
+	}
+
+	void CopyTagAs(DataTemplate& dst, const DataTemplateView& src, const uint32 tag_index, const uint32 nest_lvl_offset
+		, const uint32 element_index, const uint32 flags)
+	{
+		const Tag tag = src.tags_[tag_index];
+		dst.tags_.emplace_back(Tag(tag.GetPropertyID(), tag.GetPropertyIndex(), tag.GetSubPropertyOffset(),
+			tag.GetFieldType(), dst.data_.size(), tag.GetNestLevel() + nest_lvl_offset, element_index, tag.IsKey() ? 1 : 0
+			, flags));
+		if (tag.IsTableString())
+		{
+			layout_changed::LoadString(dst, src, tag); // the offset may point to another table
+			return;
+		}
+
+		const uint32 src_data_chunk_end = (src.TagNum() > (tag_index + 1)) ? src.tags_[tag_index + 1].GetDataOffset() : src.data_.size();
+		std::copy(src.data_.begin() + tag.GetDataOffset(), src.data_.begin() + src_data_chunk_end, std::back_inserter(dst.data_));
+	}
+
+	void CopySingleTagUnchecked(DataTemplate& dst, const DataTemplateView& src, const uint32 tag_index, const uint32 nest_lvl_offset)
+	{
+		const Tag tag = src.tags_[tag_index];
+		CopyTagAs(dst, src, tag_index, nest_lvl_offset, tag.GetElementIndex(), tag.GetFlags());
+	}
+
+	// The first tag gets element_index and extra_flags, e.g. a map element saved at another position
+	bool CopyNestedTagsAs(DataTemplate& dst, const DataTemplateView& src, uint32& tag_index, const uint32 nest_lvl_offset
+		, const uint32 element_index, const uint32 extra_flags = 0)
+	{
+		if (src.TagNum() <= tag_index)
+			return false;
+		const Tag first_tag = src.tags_[tag_index];
+		CopyTagAs(dst, src, tag_index, nest_lvl_offset, element_index, first_tag.GetFlags() | extra_flags);
+		tag_index++;
+		while ((tag_index < src.TagNum()) && (src.tags_[tag_index].GetNestLevel() > first_tag.GetNestLevel()))
+		{
+			CopySingleTagUnchecked(dst, src, tag_index, nest_lvl_offset);
+			tag_index++;
+		}
+		return true;
+	}
+
+	bool CopyNestedTags(DataTemplate& dst, const DataTemplateView& src, uint32& tag_index, const uint32 nest_lvl_offset)
+	{
+		if (src.TagNum() <= tag_index)
+			return false;
+		return CopyNestedTagsAs(dst, src, tag_index, nest_lvl_offset, src.tags_[tag_index].GetElementIndex());
+	}
+
+	void SkipNestedTags(const DataTemplateView& src, uint32& tag_index)
+	{
+		if (src.TagNum() <= tag_index)
+			return;
+		const uint32 min_nest_level = src.tags_[tag_index].GetNestLevel();
+		do {
+			tag_index++;
+		} while ((tag_index < src.TagNum()) && (src.tags_[tag_index].GetNestLevel() > min_nest_level));
+	}
+
+	// A map element: the key tags, optionally followed by the value tags
+	struct MapRecord
+	{
+		const DataTemplateView* dt = nullptr;
+		uint32 nest_lvl_offset = 0;
+		uint32 key_tag_index = 0;
+		uint32 value_tag_index = kWrongID; // the value can be skipped as default
+		uint64 key_hash = 0;
+
+		bool IsRemoved() const { return dt->tags_[key_tag_index].IsRemovedKey(); }
+		bool HasValue() const { return kWrongID != value_tag_index; }
+	};
+
+	// Strings by value, either template can store them in its table
+	std::span<const uint8> GetTagData(const DataTemplateView& src, const uint32 tag_index)
+	{
+		const Tag tag = src.tags_[tag_index];
+		if (MemberFieldType::String == tag.GetFieldType())
+		{
+			const std::string_view str = src.GetString(tag);
+			return std::span<const uint8>(reinterpret_cast<const uint8*>(str.data()), str.size());
+		}
+		const uint32 data_chunk_end = (src.TagNum() > (tag_index + 1)) ? src.tags_[tag_index + 1].GetDataOffset() : src.data_.size();
+		return src.data_.subspan(tag.GetDataOffset(), data_chunk_end - tag.GetDataOffset());
+	}
+
+	// Compared by SubtreesEqual. The element index of the root tag is skipped, the same key can be at another position.
+	std::array<uint32, 5> GetTagFields(const Tag tag, const uint32 root_nest_level, const bool is_root)
+	{
+		return { tag.GetPropertyIndex(), tag.GetNestLevel() - root_nest_level, is_root ? 0 : tag.GetElementIndex()
+			, tag.IsKey() ? 1u : 0u, tag.GetFlags() & (static_cast<uint32>(ETagFlags::PackedVector) | static_cast<uint32>(ETagFlags::VectorEdits)) };
+	}
+
+	uint64 HashSubtree(const DataTemplateView& src, const uint32 tag_index)
+	{
+		const uint32 root_nest_level = src.tags_[tag_index].GetNestLevel();
+		uint64 hash = HashBytes64(nullptr, 0);
+		uint32 idx = tag_index;
+		do
+		{
+			const auto fields = GetTagFields(src.tags_[idx], root_nest_level, idx == tag_index);
+			const auto data = GetTagData(src, idx);
+			hash = HashBytes64(fields.data(), sizeof(fields), hash);
+			hash = HashBytes64(data.data(), data.size(), hash);
+			idx++;
+		} while ((idx < src.TagNum()) && (src.tags_[idx].GetNestLevel() > root_nest_level));
+		return hash;
+	}
+
+	bool SubtreesEqual(const DataTemplateView& a, const uint32 a_tag_index, const DataTemplateView& b, const uint32 b_tag_index)
+	{
+		const uint32 a_root_nest_level = a.tags_[a_tag_index].GetNestLevel();
+		const uint32 b_root_nest_level = b.tags_[b_tag_index].GetNestLevel();
+		uint32 a_idx = a_tag_index, b_idx = b_tag_index;
+		while (true)
+		{
+			const auto a_data = GetTagData(a, a_idx);
+			const auto b_data = GetTagData(b, b_idx);
+			const bool equal = (GetTagFields(a.tags_[a_idx], a_root_nest_level, a_idx == a_tag_index)
+				== GetTagFields(b.tags_[b_idx], b_root_nest_level, b_idx == b_tag_index))
+				&& std::equal(a_data.begin(), a_data.end(), b_data.begin(), b_data.end());
+			if (!equal)
+				return false;
+			a_idx++;
+			b_idx++;
+			const bool a_nested = (a_idx < a.TagNum()) && (a.tags_[a_idx].GetNestLevel() > a_root_nest_level);
+			const bool b_nested = (b_idx < b.TagNum()) && (b.tags_[b_idx].GetNestLevel() > b_root_nest_level);
+			if (a_nested != b_nested)
+				return false;
+			if (!a_nested)
+				return true;
+		}
+	}
+
+	bool SameKey(const MapRecord& a, const MapRecord& b)
+	{
+		return (a.key_hash == b.key_hash) && SubtreesEqual(*a.dt, a.key_tag_index, *b.dt, b.key_tag_index);
+	}
+
+	// tag_index is at the first element of the map saved at map_nest_level, it's moved past the map.
+	// Each element of a set is a key without a value.
+	std::vector<MapRecord> ReadMapRecords(const DataTemplateView& src, uint32& tag_index, const uint32 map_nest_level
+		, const uint32 nest_lvl_offset, const bool is_set)
+	{
+		std::vector<MapRecord> records;
+		while ((tag_index < src.TagNum()) && (src.tags_[tag_index].GetNestLevel() > map_nest_level))
+		{
+			const Tag tag = src.tags_[tag_index];
+			Assert(tag.GetNestLevel() == (map_nest_level + 1));
+			if (tag.IsKey() || is_set)
+			{
+				records.push_back(MapRecord{ &src, nest_lvl_offset, tag_index, kWrongID, HashSubtree(src, tag_index) });
+			}
+			else if (!records.empty())
+			{
+				Assert(!records.back().HasValue() && !records.back().IsRemoved());
+				records.back().value_tag_index = tag_index;
+			}
+			SkipNestedTags(src, tag_index);
+		}
+		return records;
+	}
+
+	// Record indexes by key hash
+	using MapKeyIndex = std::unordered_multimap<uint64, uint32>;
+
+	// get_record returns nullptr for records that no longer count
+	template<typename F> uint32 FindKey(const MapKeyIndex& index, const MapRecord& key, F&& get_record)
+	{
+		const auto range = index.equal_range(key.key_hash);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			const MapRecord* record = get_record(it->second);
+			if (record && SameKey(*record, key))
+				return it->second;
+		}
+		return kWrongID;
+	}
+
+	// tag_index is at the tag of a vector, it's moved past the vector. Returns the tag index of each element, kWrongID when not saved.
+	std::vector<uint32> ReadVectorElements(const DataTemplateView& src, uint32& tag_index)
+	{
+		const Tag tag = src.tags_[tag_index];
+		std::vector<uint32> elements(ReadLength(src.data_.data(), tag.GetDataOffset()), kWrongID);
+		uint32 element_index = 0;
+		tag_index++;
+		while ((tag_index < src.TagNum()) && (src.tags_[tag_index].GetNestLevel() > tag.GetNestLevel()))
+		{
+			element_index = DecodeElementIndex(src.tags_[tag_index].GetElementIndex(), element_index);
+			if (element_index < elements.size())
+			{
+				elements[element_index] = tag_index;
+			}
+			SkipNestedTags(src, tag_index);
+		}
+		return elements;
+	}
+
+	// Source index in the lower sequence of each higher element, kWrongID when none is equal. Matched are: the common prefix
+	// and suffix, the elements unique in both sequences kept in order (patience), their equal neighbours and finally
+	// any other equal elements, as moves. Linear in the common case, at most O(n log n).
+	template<typename F> std::vector<uint32> MatchEqualElements(const std::vector<uint64>& lower, const std::vector<uint64>& higher
+		, F&& equal)
+	{
+		const uint32 lower_num = static_cast<uint32>(lower.size());
+		const uint32 higher_num = static_cast<uint32>(higher.size());
+		std::vector<uint32> sources(higher_num, kWrongID);
+		std::vector<bool> lower_used(lower_num, false);
+		auto try_match = [&](const uint32 lower_idx, const uint32 higher_idx)
+		{
+			if ((lower_idx >= lower_num) || lower_used[lower_idx] || (kWrongID != sources[higher_idx]) || !equal(lower_idx, higher_idx))
+				return false;
+			sources[higher_idx] = lower_idx;
+			lower_used[lower_idx] = true;
+			return true;
+		};
+
+		uint32 prefix = 0;
+		while ((prefix < lower_num) && (prefix < higher_num) && try_match(prefix, prefix))
+		{
+			prefix++;
+		}
+		uint32 suffix = 0;
+		while (((prefix + suffix) < lower_num) && ((prefix + suffix) < higher_num)
+			&& try_match(lower_num - 1 - suffix, higher_num - 1 - suffix))
+		{
+			suffix++;
+		}
+
+		// lower count, higher count, last lower index, last higher index
+		std::unordered_map<uint64, std::array<uint32, 4>> counts;
+		for (uint32 idx = prefix; idx < (lower_num - suffix); idx++)
+		{
+			auto& count = counts[lower[idx]];
+			count[0]++;
+			count[2] = idx;
+		}
+		for (uint32 idx = prefix; idx < (higher_num - suffix); idx++)
+		{
+			const auto it = counts.find(higher[idx]);
+			if (it != counts.end())
+			{
+				it->second[1]++;
+				it->second[3] = idx;
+			}
+		}
+		std::vector<std::pair<uint32, uint32>> unique; // higher index, lower index
+		for (const auto& [hash, count] : counts)
+		{
+			if ((1 == count[0]) && (1 == count[1]))
+			{
+				unique.emplace_back(count[3], count[2]);
+			}
+		}
+		std::sort(unique.begin(), unique.end());
+
+		// The longest run of increasing lower indexes
+		std::vector<uint32> tails; // index in unique of the smallest tail of each run length
+		std::vector<uint32> previous(unique.size(), kWrongID);
+		for (uint32 idx = 0; idx < unique.size(); idx++)
+		{
+			const auto pos = std::lower_bound(tails.begin(), tails.end(), unique[idx].second
+				, [&](const uint32 tail, const uint32 lower_idx) { return unique[tail].second < lower_idx; });
+			if (pos != tails.begin())
+			{
+				previous[idx] = *(pos - 1);
+			}
+			if (pos == tails.end())
+			{
+				tails.push_back(idx);
+			}
+			else
+			{
+				*pos = idx;
+			}
+		}
+		for (uint32 idx = tails.empty() ? kWrongID : tails.back(); kWrongID != idx; idx = previous[idx])
+		{
+			try_match(unique[idx].second, unique[idx].first);
+		}
+
+		for (uint32 idx = 1; idx < higher_num; idx++)
+		{
+			if (kWrongID != sources[idx - 1])
+			{
+				try_match(sources[idx - 1] + 1, idx);
+			}
+		}
+		for (uint32 idx = higher_num; idx > 1; idx--)
+		{
+			const uint32 source = sources[idx - 1];
+			if ((kWrongID != source) && source)
+			{
+				try_match(source - 1, idx - 2);
+			}
+		}
+
+		// Repeated elements are taken in order, so they stay in runs
+		std::unordered_map<uint64, std::pair<std::vector<uint32>, uint32>> unused_lower; // indexes, the first not taken
+		for (uint32 idx = prefix; idx < (lower_num - suffix); idx++)
+		{
+			if (!lower_used[idx])
+			{
+				unused_lower[lower[idx]].first.push_back(idx);
+			}
+		}
+		for (uint32 idx = prefix; idx < (higher_num - suffix); idx++)
+		{
+			const auto it = (kWrongID == sources[idx]) ? unused_lower.find(higher[idx]) : unused_lower.end();
+			if (it == unused_lower.end())
+				continue;
+			auto& [indexes, first] = it->second;
+			for (uint32 pos = first; pos < indexes.size(); pos++)
+			{
+				if (try_match(indexes[pos], idx))
+				{
+					first = (pos == first) ? (pos + 1) : first;
+					break;
+				}
+			}
+		}
+		return sources;
+	}
+
+	// A saved vector element
+	struct ElementSource
+	{
+		const DataTemplateView* dt = nullptr;
+		uint32 tag_index = 0;
+		uint32 nest_lvl_offset = 0;
+	};
+
+	// The same vector in a few templates, applied from the lowest one (see ETagFlags::VectorEdits)
+	struct VectorLayers
+	{
+		std::vector<std::vector<ElementSource>> elements; // saved values of each element, from the lowest template
+		std::vector<uint32> sources; // with edits, the index in the vector below the lowest template
+		bool has_edits = false;
+		bool any_applied = false;
+
+		// tag_index is at the tag of the vector, it's moved past the vector
+		void Apply(const DataTemplateView& dt, uint32& tag_index, const uint32 nest_lvl_offset)
+		{
+			const Tag tag = dt.tags_[tag_index];
+			const uint32 size = ReadLength(dt.data_.data(), tag.GetDataOffset());
+			if (tag.IsVectorEdits())
+			{
+				const std::vector<uint32> edits = ReadVectorEdits(dt.data_.data(), tag.GetDataOffset());
+				std::vector<std::vector<ElementSource>> rearranged(size);
+				std::vector<uint32> rearranged_sources(size, kWrongID);
+				for (uint32 idx = 0; idx < size; idx++)
+				{
+					const uint32 source = edits[idx];
+					if (!any_applied)
+					{
+						rearranged_sources[idx] = source;
+					}
+					else if (source < elements.size())
+					{
+						rearranged[idx] = std::move(elements[source]);
+						rearranged_sources[idx] = has_edits ? sources[source] : kWrongID;
+					}
+				}
+				elements = std::move(rearranged);
+				sources = std::move(rearranged_sources);
+				has_edits |= !any_applied;
+			}
+			else
+			{
+				elements.resize(size);
+				sources.resize(has_edits ? size : 0, kWrongID);
+			}
+			any_applied = true;
+
+			const std::vector<uint32> saved = ReadVectorElements(dt, tag_index);
+			for (uint32 idx = 0; idx < saved.size(); idx++)
+			{
+				if (kWrongID != saved[idx])
+				{
+					elements[idx].push_back(ElementSource{ &dt, saved[idx], nest_lvl_offset });
+				}
+			}
+		}
+
+		// Data of the tag of the merged vector
+		void SaveHeader(std::vector<uint8>& dst) const
+		{
+			if (has_edits)
+			{
+				AppendVectorEdits(dst, sources);
+			}
+			else
+			{
+				AppendLength(dst, static_cast<uint32>(elements.size()));
+			}
+		}
+
+		// Index of the first saved element at or after each index, kWrongID when there's none
+		std::vector<uint32> GetNextSaved() const
+		{
+			std::vector<uint32> next_saved(elements.size() + 1, kWrongID);
+			for (uint32 idx = static_cast<uint32>(elements.size()); idx > 0; idx--)
+			{
+				next_saved[idx - 1] = elements[idx - 1].empty() ? next_saved[idx] : (idx - 1);
+			}
+			return next_saved;
+		}
+
+		// Not saved elements are default, except the ones kept from the vector below the lowest template
+		bool IsDefault(const uint32 idx) const
+		{
+			return !has_edits || (kWrongID == sources[idx]);
+		}
+	};
+
+	// Not saved element of a merged vector, written only so the element index of the next one can be decoded
+	// (see MustSaveElement). Only a default element can be written, a kept one has no data in the templates.
+	bool SaveGapElement(DataTemplate& dst, const Structure& structure, const Tag vector_tag, const uint32 nest_level
+		, const uint32 element_index, const bool is_default)
+	{
+		if (!is_default)
+			return false;
+		const auto& handler = structure.GetHandlerProperty(vector_tag.GetPropertyIndex()).GetVectorHandler();
+		const PropertyIndex element_property_index = structure.GetSubPropertyIndex(vector_tag.GetPropertyIndex(), ESubType::Vector_Element);
+		std::vector<uint8> element_mem;
+		handler.InitializeElementMemory(element_mem);
+		const bool was_saved = save::SaveValue(element_mem.data(), dst, structure, element_property_index, nest_level
+			, SaveFlags::None, element_index);
+		handler.DestroyElementMemory(element_mem);
+		return was_saved;
+	}
+
+	enum class EDataTemplateOperation
+	{
+		Merge,
+		Diff
+	};
+
+	struct ProcessContext
 	{
 		DataTemplate& dst;
-		const DataTemplate& lower_dt;
-		const DataTemplate& higher_dt;
+		const DataTemplateView& lower_dt;
+		const DataTemplateView& higher_dt;
 		uint32& lower_tag_index; 
 		uint32& higher_tag_index;
 		const uint32 nest_lvl_offset;
 		const EDataTemplateOperation op;
+		const Flag32<DiffFlags> flags;
 
-		ProcessContext(DataTemplate& in_dst, const DataTemplate& in_lower_dt, const DataTemplate& in_higher_dt, uint32& in_lower_tag_index, uint32& in_higher_tag_index
-			, const uint32 in_nest_lvl_offset, const EDataTemplateOperation in_op)
+		ProcessContext(DataTemplate& in_dst, const DataTemplateView& in_lower_dt, const DataTemplateView& in_higher_dt, uint32& in_lower_tag_index, uint32& in_higher_tag_index
+			, const uint32 in_nest_lvl_offset, const EDataTemplateOperation in_op, const Flag32<DiffFlags> in_flags)
 			: dst(in_dst)
 			, lower_dt(in_lower_dt)
 			, higher_dt(in_higher_dt)
@@ -851,75 +2678,428 @@ namespace dt_operation
 			, higher_tag_index(in_higher_tag_index)
 			, nest_lvl_offset(in_nest_lvl_offset)
 			, op(in_op)
+			, flags(in_flags)
 		{}
 
-		bool AnyReachedEnd() const
+		bool AnyReachedEnd() const
+		{
+			return lower_tag_index >= lower_dt.TagNum() || higher_tag_index >= higher_dt.TagNum();
+		}
+
+		Tag GetHighTag() const
+		{
+			return higher_dt.tags_[higher_tag_index];
+		}
+
+		Tag GetLowTag() const
+		{
+			return lower_dt.tags_[lower_tag_index];
+		}
+	};
+
+	bool ProcessInner(ProcessContext& ctx, const Structure& structure, const uint32 max_size, const uint32 nest_lvl);
+
+	// Diff skips equal elements. The current element is kept when skipping it would leave the next element of the higher layer
+	// too far from the last saved one to decode its index.
+	bool MustKeepElement(const ProcessContext& ctx, const uint32 element_index, const uint32 last_saved_index)
+	{
+		const Tag tag = ctx.GetHighTag();
+		uint32 next_tag_index = ctx.higher_tag_index;
+		SkipNestedTags(ctx.higher_dt, next_tag_index);
+		if (next_tag_index >= ctx.higher_dt.TagNum())
+			return false;
+		const Tag next_tag = ctx.higher_dt.tags_[next_tag_index];
+		if ((next_tag.GetNestLevel() != tag.GetNestLevel()) || (next_tag.GetPropertyIndex() != tag.GetPropertyIndex()))
+			return false;
+		return MustSaveElement(DecodeElementIndex(next_tag.GetElementIndex(), element_index), last_saved_index);
+	}
+
+	template<typename M> bool AreSimpleValuesEqual(const uint8* const a, const uint8* const b)
+	{
+		return GetConstRef<M>(a, 0) == GetConstRef<M>(b, 0);
+	}
+
+	template<> bool AreSimpleValuesEqual<Object*>(const uint8* const a, const uint8* const b)
+	{
+		const auto obj_a = GetConstRef<ObjectID>(a, sizeof(StructID));
+		const auto obj_b = GetConstRef<ObjectID>(b, sizeof(StructID));
+		return obj_a == obj_b;
+	}
+
+
+	template<typename M> bool ProcessSimpleValue(ProcessContext& ctx, const uint32 low_offser, const uint32 high_offset)
+	{
+		const bool save_high = (EDataTemplateOperation::Merge == ctx.op)
+			|| ((EDataTemplateOperation::Diff == ctx.op) 
+				&& !AreSimpleValuesEqual<M>(ctx.higher_dt.data_.data() + high_offset, ctx.lower_dt.data_.data() + low_offser));
+		if (save_high)
+		{
+			layout_changed::LoadSimpleValue<M>(ctx.dst, ctx.higher_dt.data_.data(), high_offset);
+		}
+		return save_high;
+	}
+
+	// Either layer can store the string in its table
+	bool ProcessString(ProcessContext& ctx, const Tag low_tag, const Tag high_tag)
+	{
+		const bool save_high = (EDataTemplateOperation::Merge == ctx.op)
+			|| ((EDataTemplateOperation::Diff == ctx.op) && (ctx.higher_dt.GetString(high_tag) != ctx.lower_dt.GetString(low_tag)));
+		if (save_high)
+		{
+			layout_changed::LoadString(ctx.dst, ctx.higher_dt, high_tag);
+		}
+		return save_high;
+	}
+
+	// Packed vectors are compared and copied as a whole. When only one layer is packed, the higher one wins.
+	bool ProcessPackedVector(ProcessContext& ctx, const uint32 element_index)
+	{
+		const Tag high_tag = ctx.GetHighTag();
+		const Tag low_tag = ctx.GetLowTag();
+		Assert(SameValueKind(low_tag, high_tag));
+		bool save_high = true;
+		if ((EDataTemplateOperation::Diff == ctx.op) && high_tag.IsPackedVector() && low_tag.IsPackedVector())
+		{
+			const uint32 high_size = GetPackedVectorDataSize(ctx.higher_dt.data_.data(), high_tag.GetDataOffset());
+			const uint32 low_size = GetPackedVectorDataSize(ctx.lower_dt.data_.data(), low_tag.GetDataOffset());
+			save_high = (high_size != low_size) || (0 != std::memcmp(ctx.higher_dt.data_.data() + high_tag.GetDataOffset()
+				, ctx.lower_dt.data_.data() + low_tag.GetDataOffset(), high_size));
+		}
+		SkipNestedTags(ctx.lower_dt, ctx.lower_tag_index);
+		if (save_high)
+		{
+			return CopyNestedTagsAs(ctx.dst, ctx.higher_dt, ctx.higher_tag_index, 0, element_index);
+		}
+		SkipNestedTags(ctx.higher_dt, ctx.higher_tag_index);
+		return false;
+	}
+
+	bool ProcessValue(ProcessContext& ctx, const Structure& structure, const uint32 element_index);
+
+	// Elements are matched by key, set elements are keys. Removed keys go first, so a key can be removed and added again
+	// (Diff does so when a value is reset to default). The lower template can be a diff too.
+	bool ProcessMap(ProcessContext& ctx, const Structure& structure, const Tag low_tag, const Tag high_tag, const bool is_set)
+	{
+		const std::vector<MapRecord> lower = ReadMapRecords(ctx.lower_dt, ctx.lower_tag_index, low_tag.GetNestLevel(), ctx.nest_lvl_offset, is_set);
+		const std::vector<MapRecord> higher = ReadMapRecords(ctx.higher_dt, ctx.higher_tag_index, high_tag.GetNestLevel(), 0, is_set);
+		const bool is_diff = (EDataTemplateOperation::Diff == ctx.op);
+
+		MapKeyIndex lower_keys;
+		for (uint32 idx = 0; idx < lower.size(); idx++)
+		{
+			if (!lower[idx].IsRemoved())
+			{
+				lower_keys.emplace(lower[idx].key_hash, idx);
+			}
+		}
+		std::vector<bool> lower_erased(lower.size(), false); // by a removed key of the higher template
+		auto get_lower = [&](const uint32 idx) { return lower_erased[idx] ? nullptr : &lower[idx]; };
+
+		std::vector<const MapRecord*> removed;
+		MapKeyIndex removed_keys;
+		auto add_removed = [&](const MapRecord& record)
+		{
+			if (kWrongID == FindKey(removed_keys, record, [&](const uint32 idx) { return removed[idx]; }))
+			{
+				removed_keys.emplace(record.key_hash, static_cast<uint32>(removed.size()));
+				removed.push_back(&record);
+			}
+		};
+		for (const MapRecord& record : lower)
+		{
+			if (record.IsRemoved() && !is_diff)
+			{
+				add_removed(record);
+			}
+		}
+		for (const MapRecord& record : higher)
+		{
+			if (!record.IsRemoved())
+				continue;
+			const uint32 lower_idx = is_diff ? kWrongID : FindKey(lower_keys, record, get_lower);
+			if (kWrongID != lower_idx)
+			{
+				lower_erased[lower_idx] = true;
+			}
+			add_removed(record);
+		}
+
+		std::vector<uint32> higher_match(higher.size(), kWrongID);
+		std::vector<bool> lower_matched(lower.size(), false);
+		for (uint32 idx = 0; idx < higher.size(); idx++)
+		{
+			if (higher[idx].IsRemoved())
+				continue;
+			higher_match[idx] = FindKey(lower_keys, higher[idx], get_lower);
+			if (kWrongID != higher_match[idx])
+			{
+				lower_matched[higher_match[idx]] = true;
+			}
+		}
+
+		// Lower and higher element with the same key, either can be missing
+		std::vector<std::pair<const MapRecord*, const MapRecord*>> elements;
+		if (is_diff)
+		{
+			for (uint32 idx = 0; idx < lower.size(); idx++)
+			{
+				if (!lower[idx].IsRemoved() && !lower_matched[idx])
+				{
+					add_removed(lower[idx]);
+				}
+			}
+			for (uint32 idx = 0; idx < higher.size(); idx++)
+			{
+				const MapRecord& high = higher[idx];
+				if (high.IsRemoved())
+					continue;
+				const MapRecord* low = (kWrongID != higher_match[idx]) ? &lower[higher_match[idx]] : nullptr;
+				if (!low || (high.HasValue() && !low->HasValue()))
+				{
+					elements.emplace_back(nullptr, &high);
+				}
+				else if (high.HasValue())
+				{
+					if (!SubtreesEqual(*low->dt, low->value_tag_index, *high.dt, high.value_tag_index))
+					{
+						elements.emplace_back(low, &high);
+					}
+				}
+				else if (low->HasValue())
+				{
+					add_removed(*low);
+					elements.emplace_back(nullptr, &high);
+				}
+			}
+		}
+		else
+		{
+			std::vector<uint32> lower_match(lower.size(), kWrongID);
+			for (uint32 idx = 0; idx < higher.size(); idx++)
+			{
+				if (kWrongID != higher_match[idx])
+				{
+					lower_match[higher_match[idx]] = idx;
+				}
+			}
+			for (uint32 idx = 0; idx < lower.size(); idx++)
+			{
+				if (!lower[idx].IsRemoved() && !lower_erased[idx])
+				{
+					elements.emplace_back(&lower[idx], (kWrongID != lower_match[idx]) ? &higher[lower_match[idx]] : nullptr);
+				}
+			}
+			for (uint32 idx = 0; idx < higher.size(); idx++)
+			{
+				if (!higher[idx].IsRemoved() && (kWrongID == higher_match[idx]))
+				{
+					elements.emplace_back(nullptr, &higher[idx]);
+				}
+			}
+		}
+
+		// Merge keeps an empty map, the length is the value
+		const uint32 num = static_cast<uint32>(removed.size() + elements.size());
+		if ((0 == num) && is_diff)
+			return false;
+		save::SaveLength(ctx.dst.data_, num, SaveFlags::None);
+		uint32 element_index = 0;
+		for (const MapRecord* record : removed)
+		{
+			uint32 tag_index = record->key_tag_index;
+			CopyNestedTagsAs(ctx.dst, *record->dt, tag_index, record->nest_lvl_offset, element_index, static_cast<uint32>(ETagFlags::RemovedKey));
+			element_index++;
+		}
+		for (const auto& [low, high] : elements)
+		{
+			const MapRecord& key = high ? *high : *low;
+			uint32 key_tag_index = key.key_tag_index;
+			CopyNestedTagsAs(ctx.dst, *key.dt, key_tag_index, key.nest_lvl_offset, element_index);
+			if (low && high && low->HasValue() && high->HasValue())
+			{
+				uint32 low_tag_index = low->value_tag_index;
+				uint32 high_tag_index = high->value_tag_index;
+				ProcessContext value_ctx(ctx.dst, ctx.lower_dt, ctx.higher_dt, low_tag_index, high_tag_index, ctx.nest_lvl_offset, ctx.op, ctx.flags);
+				ProcessValue(value_ctx, structure, element_index);
+			}
+			else if (const MapRecord* value = (high && high->HasValue()) ? high : ((low && low->HasValue()) ? low : nullptr))
+			{
+				uint32 value_tag_index = value->value_tag_index;
+				CopyNestedTagsAs(ctx.dst, *value->dt, value_tag_index, value->nest_lvl_offset, element_index);
+			}
+			element_index++;
+		}
+		return true;
+	}
+
+	// Vectors with edits and Diff in the DiffFlags::VectorEdits mode. The tag indexes are at the tags of the vector.
+	bool ProcessVectorEdits(ProcessContext& ctx, const Structure& structure, const uint32 element_index)
+	{
+		const Tag high_tag = ctx.GetHighTag();
+		const Tag low_tag = ctx.GetLowTag();
+		const auto& property = structure.GetProperty(high_tag.GetPropertyIndex());
+		auto emplace_tag = [&](const uint32 flags)
+		{
+			ctx.dst.tags_.emplace_back(Tag(property.GetPropertyID(), high_tag.GetPropertyIndex(), high_tag.GetSubPropertyOffset(),
+				property.GetFieldType(), ctx.dst.data_.size(), high_tag.GetNestLevel(), element_index, high_tag.IsKey() ? 1 : 0, flags));
+		};
+
+		if (EDataTemplateOperation::Merge == ctx.op)
 		{
-			return lower_tag_index >= lower_dt.TagNum() || higher_tag_index >= higher_dt.TagNum();
+			VectorLayers layers;
+			layers.Apply(ctx.lower_dt, ctx.lower_tag_index, ctx.nest_lvl_offset);
+			layers.Apply(ctx.higher_dt, ctx.higher_tag_index, 0);
+			emplace_tag(layers.has_edits ? static_cast<uint32>(ETagFlags::VectorEdits) : 0);
+			layers.SaveHeader(ctx.dst.data_);
+			// Defaults are not saved, moved apart the saved elements can be too far from each other
+			const std::vector<uint32> next_saved = layers.GetNextSaved();
+			uint32 last_saved_index = 0;
+			for (uint32 idx = 0; idx < layers.elements.size(); idx++)
+			{
+				const std::vector<ElementSource>& element = layers.elements[idx];
+				if (element.empty())
+				{
+					if ((kWrongID != next_saved[idx]) && MustSaveElement(idx, last_saved_index)
+						&& SaveGapElement(ctx.dst, structure, high_tag, high_tag.GetNestLevel() + 1, idx, layers.IsDefault(idx)))
+					{
+						last_saved_index = idx;
+					}
+					continue;
+				}
+				Assert((idx - last_saved_index) < kElementIndexRange); // kept elements can't fill a gap, see SaveGapElement
+				last_saved_index = idx;
+				if (1 == element.size())
+				{
+					uint32 tag_index = element[0].tag_index;
+					CopyNestedTagsAs(ctx.dst, *element[0].dt, tag_index, element[0].nest_lvl_offset, idx);
+					continue;
+				}
+				Assert((2 == element.size()) && (element[0].dt == &ctx.lower_dt) && (element[1].dt == &ctx.higher_dt));
+				uint32 low_tag_index = element[0].tag_index;
+				uint32 high_tag_index = element[1].tag_index;
+				ProcessContext value_ctx(ctx.dst, ctx.lower_dt, ctx.higher_dt, low_tag_index, high_tag_index, ctx.nest_lvl_offset, ctx.op, ctx.flags);
+				ProcessValue(value_ctx, structure, idx);
+			}
+			return true;
 		}
 
-		Tag GetHighTag() const
+		// Edits are not diffed, the higher vector is saved whole
+		if (low_tag.IsVectorEdits() || high_tag.IsVectorEdits())
 		{
-			return higher_dt.tags_[higher_tag_index];
+			SkipNestedTags(ctx.lower_dt, ctx.lower_tag_index);
+			return CopyNestedTagsAs(ctx.dst, ctx.higher_dt, ctx.higher_tag_index, 0, element_index);
 		}
 
-		Tag GetLowTag() const
+		const std::vector<uint32> lower = ReadVectorElements(ctx.lower_dt, ctx.lower_tag_index);
+		const std::vector<uint32> higher = ReadVectorElements(ctx.higher_dt, ctx.higher_tag_index);
+		// Default elements are not saved
+		auto hash_elements = [](const DataTemplateView& dt, const std::vector<uint32>& elements)
 		{
-			return lower_dt.tags_[lower_tag_index];
+			std::vector<uint64> hashes(elements.size(), 0);
+			for (uint32 idx = 0; idx < elements.size(); idx++)
+			{
+				if (kWrongID != elements[idx])
+				{
+					hashes[idx] = HashSubtree(dt, elements[idx]);
+				}
+			}
+			return hashes;
+		};
+		const std::vector<uint64> lower_hashes = hash_elements(ctx.lower_dt, lower);
+		const std::vector<uint64> higher_hashes = hash_elements(ctx.higher_dt, higher);
+		std::vector<uint32> sources = MatchEqualElements(lower_hashes, higher_hashes, [&](const uint32 lower_idx, const uint32 higher_idx)
+		{
+			if ((kWrongID == lower[lower_idx]) || (kWrongID == higher[higher_idx]))
+				return lower[lower_idx] == higher[higher_idx];
+			return (lower_hashes[lower_idx] == higher_hashes[higher_idx])
+				&& SubtreesEqual(ctx.lower_dt, lower[lower_idx], ctx.higher_dt, higher[higher_idx]);
+		});
+
+		// Not matched elements are diffed against the unused lower element after the source of the previous one
+		std::vector<bool> lower_used(lower.size(), false);
+		for (const uint32 source : sources)
+		{
+			if (kWrongID != source)
+			{
+				lower_used[source] = true;
+			}
 		}
-	};
-
-	bool ProcessInner(ProcessContext& ctx, const Structure& structure, const uint32 max_size);
-
-	template<typename M> bool AreSimpleValuesEqual(const uint8* const a, const uint8* const b)
-	{
-		return GetConstRef<M>(a, 0) == GetConstRef<M>(b, 0);
-	}
-
-	template<> bool AreSimpleValuesEqual<Object*>(const uint8* const a, const uint8* const b)
-	{
-		const auto obj_a = GetConstRef<ObjectID>(a, sizeof(StructID));
-		const auto obj_b = GetConstRef<ObjectID>(b, sizeof(StructID));
-		return obj_a == obj_b;
-	}
-
-	template<> bool AreSimpleValuesEqual<std::string>(const uint8* const a, const uint8* const b)
-	{
-		if (GetConstRef<uint16>(a, 0) != GetConstRef<uint16>(b, 0))
-			return false;
-		const uint16 len = GetConstRef<uint16>(a, 0);
-		for (uint32 i = 0; i < len; i++)
+		std::vector<bool> modified(higher.size(), false);
+		bool any_change = (lower.size() != higher.size());
+		for (uint32 idx = 0; idx < higher.size(); idx++)
 		{
-			if (GetConstRef<char>(a, sizeof(uint16) + i * sizeof(char)) != GetConstRef<char>(b, sizeof(uint16) + i * sizeof(char)))
-				return false;
+			if (kWrongID != sources[idx])
+			{
+				any_change |= (sources[idx] != idx);
+				continue;
+			}
+			any_change = true;
+			const uint32 candidate = idx ? ((kWrongID != sources[idx - 1]) ? (sources[idx - 1] + 1) : kWrongID) : 0;
+			if ((candidate < lower.size()) && !lower_used[candidate] && (kWrongID != lower[candidate]) && (kWrongID != higher[idx]))
+			{
+				sources[idx] = candidate;
+				lower_used[candidate] = true;
+				modified[idx] = true;
+			}
 		}
-		return true;
-	}
+		if (!any_change)
+			return false;
 
-	template<typename M> bool ProcessSimpleValue(ProcessContext& ctx, const uint32 low_offser, const uint32 high_offset)
-	{
-		const bool save_high = (EDataTemplateOperation::Merge == ctx.op)
-			|| ((EDataTemplateOperation::Diff == ctx.op) 
-				&& !AreSimpleValuesEqual<M>(ctx.higher_dt.data_.data() + high_offset, ctx.lower_dt.data_.data() + low_offser));
-		if (save_high)
+		emplace_tag(static_cast<uint32>(ETagFlags::VectorEdits));
+		AppendVectorEdits(ctx.dst.data_, sources);
+		// Equal elements are skipped, unless the next one that can be saved would be too far from the last saved one
+		std::vector<uint32> next_needed(higher.size() + 1, kWrongID);
+		std::vector<uint32> next_saved(higher.size() + 1, kWrongID); // in the higher template
+		for (uint32 idx = static_cast<uint32>(higher.size()); idx > 0; idx--)
 		{
-			layout_changed::LoadSimpleValue<M>(ctx.dst, ctx.higher_dt.data_.data(), high_offset);
+			const bool needed = modified[idx - 1] || ((kWrongID == sources[idx - 1]) && (kWrongID != higher[idx - 1]));
+			next_needed[idx - 1] = needed ? (idx - 1) : next_needed[idx];
+			next_saved[idx - 1] = (kWrongID != higher[idx - 1]) ? (idx - 1) : next_saved[idx];
 		}
-		return save_high;
+		uint32 last_saved_index = 0;
+		for (uint32 idx = 0; idx < higher.size(); idx++)
+		{
+			if (kWrongID == higher[idx])
+				continue;
+			uint32 high_tag_index = higher[idx];
+			if (modified[idx])
+			{
+				uint32 low_tag_index = lower[sources[idx]];
+				ProcessContext value_ctx(ctx.dst, ctx.lower_dt, ctx.higher_dt, low_tag_index, high_tag_index, ctx.nest_lvl_offset, ctx.op, ctx.flags);
+				if (ProcessValue(value_ctx, structure, idx))
+				{
+					last_saved_index = idx;
+				}
+			}
+			else if ((next_needed[idx] == idx)
+				|| ((kWrongID != next_needed[idx]) && MustSaveElement(next_saved[idx + 1], last_saved_index)))
+			{
+				CopyNestedTagsAs(ctx.dst, ctx.higher_dt, high_tag_index, 0, idx);
+				last_saved_index = idx;
+			}
+		}
+		return true;
 	}
 
-	bool ProcessValue(ProcessContext& ctx, const Structure& structure)
+	bool ProcessValue(ProcessContext& ctx, const Structure& structure, const uint32 element_index)
 	{
 		if (ctx.AnyReachedEnd())
 			return false;
+		if (ctx.GetHighTag().IsPackedVector() || ctx.GetLowTag().IsPackedVector())
+			return ProcessPackedVector(ctx, element_index);
+		const bool vector_edits = ctx.GetHighTag().IsVectorEdits() || ctx.GetLowTag().IsVectorEdits()
+			|| ((EDataTemplateOperation::Diff == ctx.op) && ctx.flags[DiffFlags::VectorEdits]);
+		if (vector_edits && (MemberFieldType::Vector == structure.GetProperty(ctx.GetHighTag().GetPropertyIndex()).GetFieldType()))
+			return ProcessVectorEdits(ctx, structure, element_index);
 		const Tag high_tag = ctx.GetHighTag();
 		const Tag low_tag = ctx.GetLowTag();
 		ctx.higher_tag_index++;
 		ctx.lower_tag_index++;
-		Assert(TagsEqual(low_tag, high_tag));
+		Assert(SameValueKind(low_tag, high_tag));
 		const auto& property = structure.GetProperty(high_tag.GetPropertyIndex());
 		ctx.dst.tags_.emplace_back(Tag(property.GetPropertyID(), high_tag.GetPropertyIndex(), high_tag.GetSubPropertyOffset(),
-			property.GetFieldType(), ctx.dst.data_.size(), high_tag.GetNestLevel(), high_tag.GetElementIndex(), high_tag.IsKey() ? 1 : 0));
+			property.GetFieldType(), ctx.dst.data_.size(), high_tag.GetNestLevel(), element_index, high_tag.IsKey() ? 1 : 0
+			, high_tag.GetFlags() & static_cast<uint32>(ETagFlags::TableString)));
 		bool was_saved = false;
 		switch (property.GetFieldType())
 		{
@@ -933,23 +3113,26 @@ namespace dt_operation
 			case MemberFieldType::UInt64:	was_saved = ProcessSimpleValue<uint64>(ctx, low_tag.GetDataOffset(), high_tag.GetDataOffset());	break;
 			case MemberFieldType::Float:	was_saved = ProcessSimpleValue<float>(ctx, low_tag.GetDataOffset(), high_tag.GetDataOffset());	break;
 			case MemberFieldType::Double:	was_saved = ProcessSimpleValue<double>(ctx, low_tag.GetDataOffset(), high_tag.GetDataOffset());	break;
-			case MemberFieldType::String:	was_saved = ProcessSimpleValue<std::string>(ctx, low_tag.GetDataOffset(), high_tag.GetDataOffset());	break;
+			case MemberFieldType::String:	was_saved = ProcessString(ctx, low_tag, high_tag);	break;
 			case MemberFieldType::ObjectPtr:was_saved = ProcessSimpleValue<Object*>(ctx, low_tag.GetDataOffset(), high_tag.GetDataOffset());	break;
-			case MemberFieldType::Array:	was_saved = ProcessInner(ctx, structure, property.GetArraySize()); break;
+			case MemberFieldType::Array:	was_saved = ProcessInner(ctx, structure, property.GetArraySize(), high_tag.GetNestLevel() + 1); break;
+			case MemberFieldType::Map:		was_saved = ProcessMap(ctx, structure, low_tag, high_tag, false); break;
+			case MemberFieldType::Set:		was_saved = ProcessMap(ctx, structure, low_tag, high_tag, true); break;
 			case MemberFieldType::Vector:
-			case MemberFieldType::Map:
 			{
-				const uint32 size = GetConstRef<uint16>(ctx.higher_dt.data_.data(), high_tag.GetDataOffset());
+				const uint32 size = ReadLength(ctx.higher_dt.data_.data(), high_tag.GetDataOffset());
 				const uint32 data_size = ctx.dst.data_.size();
-				save::SaveLength16(ctx.dst.data_, size, SaveFlags::None);
-				was_saved = ProcessInner(ctx, structure, size);
+				save::SaveLength(ctx.dst.data_, size, SaveFlags::None);
+				// Merge keeps the length, also of an empty container
+				was_saved = ProcessInner(ctx, structure, size, high_tag.GetNestLevel() + 1)
+					|| (EDataTemplateOperation::Merge == ctx.op);
 				if (!was_saved)
 				{
 					ctx.dst.data_.resize(data_size);
 				}
 				break;
 			} 
-			case MemberFieldType::Struct:	was_saved = ProcessInner(ctx, Structure::GetStructure(property.GetOptionalStructID()), 1);	break;
+			case MemberFieldType::Struct:	was_saved = ProcessInner(ctx, Structure::GetStructure(property.GetOptionalStructID()), 1, high_tag.GetNestLevel() + 1);	break;
 		}
 		if (!was_saved)
 		{
@@ -958,22 +3141,28 @@ namespace dt_operation
 		return was_saved;
 	}
 
-	bool ProcessInner(ProcessContext& ctx, const Structure& structure, const uint32 max_size)
+	// nest_lvl of the processed tags in the higher template, e.g. an empty container has none
+	bool ProcessInner(ProcessContext& ctx, const Structure& structure, const uint32 max_size, const uint32 nest_lvl)
 	{
 		if (ctx.AnyReachedEnd())
 			return false;
 		//Assert(ctx.GetLowTag().GetStructID() == ctx.GetHighTag().GetStructID());
 		//Assert(ctx.GetLowTag().GetStructID() == structure.id_);
-		const uint32 max_nest_lvl = std::max(ctx.GetLowTag().GetNestLevel() + ctx.nest_lvl_offset, ctx.GetHighTag().GetNestLevel());
 		bool was_saved = false;
+		// last element indexes of lower, higher and dst
+		uint32 last_lower_index = 0, last_higher_index = 0, last_saved_index = 0;
 		do
 		{
 			const Tag higher_tag = ctx.higher_dt.tags_[ctx.higher_tag_index];
 			const Tag lower_tag = ctx.lower_dt.tags_[ctx.lower_tag_index];
-			const bool lower_in_struct = (lower_tag.GetNestLevel() + ctx.nest_lvl_offset == max_nest_lvl);// TODO: && (lower_tag.GetStructID() == structure.id_);
-			const bool higher_in_struct = (higher_tag.GetNestLevel() == max_nest_lvl);// TODO:  && (higher_tag.GetStructID() == structure.id_);
-			if (lower_in_struct && higher_in_struct && TagsEqual(lower_tag, higher_tag))
+			const bool lower_in_struct = (lower_tag.GetNestLevel() + ctx.nest_lvl_offset == nest_lvl);// TODO: && (lower_tag.GetStructID() == structure.id_);
+			const bool higher_in_struct = (higher_tag.GetNestLevel() == nest_lvl);// TODO:  && (higher_tag.GetStructID() == structure.id_);
+			const uint32 lower_index = DecodeElementIndex(lower_tag.GetElementIndex(), last_lower_index);
+			const uint32 higher_index = DecodeElementIndex(higher_tag.GetElementIndex(), last_higher_index);
+			if (lower_in_struct && higher_in_struct && TagsEqual(lower_tag, higher_tag) && (lower_index == higher_index))
 			{
+				last_lower_index = lower_index;
+				last_higher_index = higher_index;
 				if (kSuperStructPropertyID == higher_tag.GetPropertyID())
 				{
 					ctx.higher_tag_index++;
@@ -982,7 +3171,7 @@ namespace dt_operation
 					Assert(super_struct);
 					ctx.dst.tags_.emplace_back(Tag(kSuperStructPropertyID, kSuperStructPropertyIndex, 0, MemberFieldType::Struct
 						, ctx.dst.data_.size(), higher_tag.GetNestLevel(), 0, 0));
-					const bool was_super_struct_safe = ProcessInner(ctx, *super_struct, 1);
+					const bool was_super_struct_safe = ProcessInner(ctx, *super_struct, 1, higher_tag.GetNestLevel() + 1);
 					if (!was_super_struct_safe)
 					{
 						ctx.dst.tags_.pop_back();
@@ -991,12 +3180,20 @@ namespace dt_operation
 				}
 				else
 				{
-					was_saved |= ProcessValue(ctx, structure);
+					const bool keep_element = (EDataTemplateOperation::Diff == ctx.op) && MustKeepElement(ctx, higher_index, last_saved_index);
+					ProcessContext value_ctx(ctx.dst, ctx.lower_dt, ctx.higher_dt, ctx.lower_tag_index, ctx.higher_tag_index
+						, ctx.nest_lvl_offset, keep_element ? EDataTemplateOperation::Merge : ctx.op, ctx.flags);
+					if (ProcessValue(value_ctx, structure, higher_index))
+					{
+						was_saved = true;
+						last_saved_index = higher_index;
+					}
 				}
 			}
-			else if (lower_in_struct && (!higher_in_struct || IsTagFirst(lower_tag, higher_tag)))
+			else if (lower_in_struct && (!higher_in_struct || IsTagFirst(lower_tag, lower_index, higher_tag, higher_index)))
 			{
-				if ((EDataTemplateOperation::Diff == ctx.op) || (lower_tag.GetElementIndex() >= max_size))
+				last_lower_index = lower_index;
+				if ((EDataTemplateOperation::Diff == ctx.op) || (lower_index >= max_size))
 				{
 					SkipNestedTags(ctx.lower_dt, ctx.lower_tag_index);
 				}
@@ -1005,8 +3202,10 @@ namespace dt_operation
 					was_saved |= CopyNestedTags(ctx.dst, ctx.lower_dt, ctx.lower_tag_index, ctx.nest_lvl_offset);
 				}
 			}
-			else if(higher_in_struct && (!lower_in_struct || IsTagFirst(higher_tag, lower_tag)))
+			else if(higher_in_struct && (!lower_in_struct || IsTagFirst(higher_tag, higher_index, lower_tag, lower_index)))
 			{
+				last_higher_index = higher_index;
+				last_saved_index = higher_index;
 				was_saved |= CopyNestedTags(ctx.dst, ctx.higher_dt, ctx.higher_tag_index, 0);
 			}
 			else
@@ -1018,7 +3217,8 @@ namespace dt_operation
 		return was_saved;
 	}
 
-	DataTemplate Process(const DataTemplate& lower_dt, const DataTemplate& higher_dt, const EDataTemplateOperation op)
+	DataTemplate Process(const DataTemplateView& lower_dt, const DataTemplateView& higher_dt, const EDataTemplateOperation op
+		, const Flag32<DiffFlags> flags)
 	{
 		Assert(kWrongID != lower_dt.GetStructID());
 		Assert(kWrongID != higher_dt.GetStructID());
@@ -1027,6 +3227,7 @@ namespace dt_operation
 		DataTemplate dst;
 		dst.tags_.reserve(std::max(higher_dt.TagNum(), lower_dt.TagNum()));
 		dst.data_.reserve(std::max(higher_dt.data_.size(), lower_dt.data_.size()));
+		save::SaveStructId(dst.data_, higher_dt.GetStructID());
 
 		uint32 lower_tag_index = 0, higher_tag_index = 0;
 		uint32 nest_lvl_offset = 0;
@@ -1050,8 +3251,8 @@ namespace dt_operation
 				higher_tag_index++;
 				nest_lvl_offset++;
 			}
-			ProcessContext ctx(dst, lower_dt, higher_dt, lower_tag_index, higher_tag_index, nest_lvl_offset, op);
-			ProcessInner(ctx, Structure::GetStructure(lower_struct_id), 1);
+			ProcessContext ctx(dst, lower_dt, higher_dt, lower_tag_index, higher_tag_index, nest_lvl_offset, op, flags);
+			ProcessInner(ctx, Structure::GetStructure(lower_struct_id), 1, nest_lvl_offset);
 		}
 		if (op == EDataTemplateOperation::Merge)
 		{
@@ -1064,17 +3265,465 @@ namespace dt_operation
 		{
 			CopySingleTagUnchecked(dst, higher_dt, higher_tag_index, 0);
 		}
+		if (dst.tags_.empty())
+		{
+			dst.data_.clear(); // nothing differs
+		}
+		return dst;
+	}
+}
+
+namespace merge_layers
+{
+	using namespace serialization;
+
+	// Bit per layer
+	using LayerMask = uint64;
+	constexpr uint32 kMaxLayers = 64;
+
+	struct Layer
+	{
+		DataTemplateView dt;
+		uint32 tag_index = 0;
+		uint32 nest_lvl_offset = 0; // super struct levels between the structure of the result and the structure of this layer
+
+		Tag GetTag() const { return dt.tags_[tag_index]; }
+		bool IsAt(const uint32 nest_lvl) const
+		{
+			return (tag_index < dt.TagNum()) && ((GetTag().GetNestLevel() + nest_lvl_offset) == nest_lvl);
+		}
+	};
+
+	struct Context
+	{
+		DataTemplate& dst;
+		std::vector<Layer>& layers;
+
+		template<typename F> void ForEach(const LayerMask mask, F&& func)
+		{
+			for (uint32 idx = 0; idx < layers.size(); idx++)
+			{
+				if (mask & (LayerMask(1) << idx))
+				{
+					func(layers[idx]);
+				}
+			}
+		}
+	};
+
+	bool MergeInner(Context& ctx, const Structure& structure, const LayerMask active, const uint32 nest_lvl, const uint32 max_size);
+	bool MergeStructure(Context& ctx, const Structure& structure, const LayerMask active, const LayerMask pending, const uint32 nest_lvl);
+
+	// The super struct tags of the active layers are already consumed
+	bool MergeSuperStruct(Context& ctx, const Structure& structure, const LayerMask active, const LayerMask pending, const uint32 nest_lvl)
+	{
+		const Structure* super_struct = structure.TryGetSuperStructure();
+		Assert(super_struct);
+		const uint32 data_size = ctx.dst.data_.size();
+		ctx.dst.tags_.emplace_back(Tag(kSuperStructPropertyID, kSuperStructPropertyIndex, 0, MemberFieldType::Struct
+			, data_size, nest_lvl, 0, 0));
+		save::SaveStructId(ctx.dst.data_, super_struct->id_);
+		const bool was_saved = MergeStructure(ctx, *super_struct, active, pending, nest_lvl + 1);
+		if (!was_saved)
+		{
+			ctx.dst.tags_.pop_back();
+			ctx.dst.data_.resize(data_size);
+		}
+		return was_saved;
+	}
+
+	// Layers of a base structure (pending) join at its super struct
+	bool MergeStructure(Context& ctx, const Structure& structure, const LayerMask active, const LayerMask pending, const uint32 nest_lvl)
+	{
+		bool was_saved = false;
+		if (pending)
+		{
+			LayerMask super_active = 0;
+			LayerMask super_pending = 0;
+			for (uint32 idx = 0; idx < ctx.layers.size(); idx++)
+			{
+				const LayerMask bit = LayerMask(1) << idx;
+				Layer& layer = ctx.layers[idx];
+				if (pending & bit)
+				{
+					((layer.nest_lvl_offset == (nest_lvl + 1)) ? super_active : super_pending) |= bit;
+				}
+				else if ((active & bit) && layer.IsAt(nest_lvl) && (kSuperStructPropertyIndex == layer.GetTag().GetPropertyIndex()))
+				{
+					layer.tag_index++;
+					super_active |= bit;
+				}
+			}
+			was_saved = MergeSuperStruct(ctx, structure, super_active, super_pending, nest_lvl);
+		}
+		was_saved |= MergeInner(ctx, structure, active, nest_lvl, 1);
+		return was_saved;
+	}
+
+	bool MergeValue(Context& ctx, const Structure& structure, const LayerMask matching, Layer& high, const uint32 nest_lvl
+		, const uint32 element_index);
+
+	// Like dt_operation::ProcessMap, the layers are applied from the lowest one. The tag of the map is already consumed.
+	void MergeMap(Context& ctx, const Structure& structure, const LayerMask matching, const uint32 nest_lvl, const bool is_set)
+	{
+		using dt_operation::MapRecord;
+		struct Element
+		{
+			MapRecord key;
+			std::vector<MapRecord> values; // from the lowest layer
+			bool erased = false;
+		};
+		std::vector<MapRecord> removed;
+		std::vector<Element> elements;
+		dt_operation::MapKeyIndex removed_keys, element_keys;
+		auto get_removed = [&](const uint32 idx) { return &removed[idx]; };
+		auto get_element = [&](const uint32 idx) { return elements[idx].erased ? nullptr : &elements[idx].key; };
+		std::vector<std::pair<Layer*, uint32>> map_ends;
+		ctx.ForEach(matching, [&](Layer& layer)
+		{
+			const std::vector<MapRecord> records = dt_operation::ReadMapRecords(layer.dt, layer.tag_index
+				, nest_lvl - layer.nest_lvl_offset, layer.nest_lvl_offset, is_set);
+			map_ends.emplace_back(&layer, layer.tag_index);
+			for (const MapRecord& record : records)
+			{
+				if (!record.IsRemoved())
+					continue;
+				const uint32 idx = dt_operation::FindKey(element_keys, record, get_element);
+				if (kWrongID != idx)
+				{
+					elements[idx].erased = true;
+				}
+				if (kWrongID == dt_operation::FindKey(removed_keys, record, get_removed))
+				{
+					removed_keys.emplace(record.key_hash, static_cast<uint32>(removed.size()));
+					removed.push_back(record);
+				}
+			}
+			for (const MapRecord& record : records)
+			{
+				if (record.IsRemoved())
+					continue;
+				uint32 idx = dt_operation::FindKey(element_keys, record, get_element);
+				if (kWrongID == idx)
+				{
+					idx = static_cast<uint32>(elements.size());
+					element_keys.emplace(record.key_hash, idx);
+					elements.push_back(Element{ record });
+				}
+				elements[idx].key = record;
+				if (record.HasValue())
+				{
+					elements[idx].values.push_back(record);
+				}
+			}
+		});
+
+		const uint32 num = static_cast<uint32>(removed.size() + std::count_if(elements.begin(), elements.end()
+			, [](const Element& element) { return !element.erased; }));
+		save::SaveLength(ctx.dst.data_, num, SaveFlags::None);
+		uint32 element_index = 0;
+		for (const MapRecord& record : removed)
+		{
+			uint32 tag_index = record.key_tag_index;
+			dt_operation::CopyNestedTagsAs(ctx.dst, *record.dt, tag_index, record.nest_lvl_offset, element_index
+				, static_cast<uint32>(ETagFlags::RemovedKey));
+			element_index++;
+		}
+		for (const Element& element : elements)
+		{
+			if (element.erased)
+				continue;
+			uint32 key_tag_index = element.key.key_tag_index;
+			dt_operation::CopyNestedTagsAs(ctx.dst, *element.key.dt, key_tag_index, element.key.nest_lvl_offset, element_index);
+			if (1 == element.values.size())
+			{
+				const MapRecord& value = element.values.front();
+				uint32 value_tag_index = value.value_tag_index;
+				dt_operation::CopyNestedTagsAs(ctx.dst, *value.dt, value_tag_index, value.nest_lvl_offset, element_index);
+			}
+			else if (element.values.size() > 1)
+			{
+				LayerMask value_layers = 0;
+				Layer* high = nullptr;
+				for (const MapRecord& value : element.values)
+				{
+					for (uint32 idx = 0; idx < ctx.layers.size(); idx++)
+					{
+						if (&ctx.layers[idx].dt == value.dt)
+						{
+							ctx.layers[idx].tag_index = value.value_tag_index;
+							value_layers |= LayerMask(1) << idx;
+							high = &ctx.layers[idx];
+						}
+					}
+				}
+				MergeValue(ctx, structure, value_layers, *high, nest_lvl + 1, element_index);
+			}
+			element_index++;
+		}
+		for (const auto& [layer, map_end] : map_ends)
+		{
+			layer->tag_index = map_end;
+		}
+	}
+
+	// Like dt_operation::ProcessVectorEdits, the tag of the vector is not consumed yet
+	void MergeVectorEdits(Context& ctx, const Structure& structure, const LayerMask matching, const Tag high_tag
+		, const uint32 nest_lvl, const uint32 element_index)
+	{
+		dt_operation::VectorLayers vector;
+		ctx.ForEach(matching, [&](Layer& layer) { vector.Apply(layer.dt, layer.tag_index, layer.nest_lvl_offset); });
+		std::vector<std::pair<Layer*, uint32>> vector_ends;
+		ctx.ForEach(matching, [&](Layer& layer) { vector_ends.emplace_back(&layer, layer.tag_index); });
+
+		const auto& property = structure.GetProperty(high_tag.GetPropertyIndex());
+		ctx.dst.tags_.emplace_back(Tag(property.GetPropertyID(), high_tag.GetPropertyIndex(), high_tag.GetSubPropertyOffset(),
+			property.GetFieldType(), ctx.dst.data_.size(), nest_lvl, element_index, high_tag.IsKey() ? 1 : 0
+			, vector.has_edits ? static_cast<uint32>(ETagFlags::VectorEdits) : 0));
+		vector.SaveHeader(ctx.dst.data_);
+		// Defaults are not saved, moved apart the saved elements can be too far from each other
+		const std::vector<uint32> next_saved = vector.GetNextSaved();
+		uint32 last_saved_index = 0;
+		for (uint32 idx = 0; idx < vector.elements.size(); idx++)
+		{
+			const std::vector<dt_operation::ElementSource>& element = vector.elements[idx];
+			if (element.empty())
+			{
+				if ((kWrongID != next_saved[idx]) && MustSaveElement(idx, last_saved_index)
+					&& dt_operation::SaveGapElement(ctx.dst, structure, high_tag, nest_lvl + 1, idx, vector.IsDefault(idx)))
+				{
+					last_saved_index = idx;
+				}
+				continue;
+			}
+			Assert((idx - last_saved_index) < kElementIndexRange); // kept elements can't fill a gap, see SaveGapElement
+			last_saved_index = idx;
+			if (1 == element.size())
+			{
+				uint32 tag_index = element[0].tag_index;
+				dt_operation::CopyNestedTagsAs(ctx.dst, *element[0].dt, tag_index, element[0].nest_lvl_offset, idx);
+				continue;
+			}
+			LayerMask element_layers = 0;
+			Layer* high = nullptr;
+			for (const dt_operation::ElementSource& source : element)
+			{
+				for (uint32 layer_idx = 0; layer_idx < ctx.layers.size(); layer_idx++)
+				{
+					if (&ctx.layers[layer_idx].dt == source.dt)
+					{
+						ctx.layers[layer_idx].tag_index = source.tag_index;
+						element_layers |= LayerMask(1) << layer_idx;
+						high = &ctx.layers[layer_idx];
+					}
+				}
+			}
+			MergeValue(ctx, structure, element_layers, *high, nest_lvl + 1, idx);
+		}
+		for (const auto& [layer, vector_end] : vector_ends)
+		{
+			layer->tag_index = vector_end;
+		}
+	}
+
+	// The value of the highest layer wins. Nested values are merged.
+	bool MergeValue(Context& ctx, const Structure& structure, const LayerMask matching, Layer& high, const uint32 nest_lvl
+		, const uint32 element_index)
+	{
+		bool any_packed = false;
+		ctx.ForEach(matching, [&](const Layer& layer) { any_packed |= layer.GetTag().IsPackedVector(); });
+		const Tag high_tag = high.GetTag();
+		const auto& property = structure.GetProperty(high_tag.GetPropertyIndex());
+		const MemberFieldType type = property.GetFieldType();
+		const bool nested = (MemberFieldType::Array == type) || (MemberFieldType::Vector == type) || (MemberFieldType::Map == type)
+			|| (MemberFieldType::Set == type) || (MemberFieldType::Struct == type);
+		if (any_packed || !nested)
+		{
+			// Simple values and packed vectors are copied whole from the highest layer
+			ctx.ForEach(matching, [&](Layer& layer) { if (&layer != &high) dt_operation::SkipNestedTags(layer.dt, layer.tag_index); });
+			return dt_operation::CopyNestedTagsAs(ctx.dst, high.dt, high.tag_index, high.nest_lvl_offset, element_index);
+		}
+		bool any_edits = false;
+		ctx.ForEach(matching, [&](const Layer& layer) { any_edits |= layer.GetTag().IsVectorEdits(); });
+		if (any_edits)
+		{
+			MergeVectorEdits(ctx, structure, matching, high_tag, nest_lvl, element_index);
+			return true;
+		}
+
+		ctx.ForEach(matching, [](Layer& layer) { layer.tag_index++; });
+		const uint32 data_size = ctx.dst.data_.size();
+		ctx.dst.tags_.emplace_back(Tag(property.GetPropertyID(), high_tag.GetPropertyIndex(), high_tag.GetSubPropertyOffset(),
+			type, data_size, nest_lvl, element_index, high_tag.IsKey() ? 1 : 0));
+		bool was_saved = true;
+		if (MemberFieldType::Array == type)
+		{
+			was_saved = MergeInner(ctx, structure, matching, nest_lvl + 1, property.GetArraySize());
+		}
+		else if (MemberFieldType::Struct == type)
+		{
+			const Structure& value_struct = Structure::GetStructure(property.GetOptionalStructID());
+			save::SaveStructId(ctx.dst.data_, value_struct.id_);
+			was_saved = MergeStructure(ctx, value_struct, matching, 0, nest_lvl + 1);
+		}
+		else if ((MemberFieldType::Map == type) || (MemberFieldType::Set == type))
+		{
+			MergeMap(ctx, structure, matching, nest_lvl, MemberFieldType::Set == type);
+		}
+		else
+		{
+			// The length of the highest layer is kept, even when no element was saved
+			const uint32 size = ReadLength(high.dt.data_.data(), high_tag.GetDataOffset());
+			save::SaveLength(ctx.dst.data_, size, SaveFlags::None);
+			MergeInner(ctx, structure, matching, nest_lvl + 1, size);
+		}
+		if (!was_saved)
+		{
+			ctx.dst.tags_.pop_back();
+			ctx.dst.data_.resize(data_size);
+		}
+		return was_saved;
+	}
+
+	bool MergeInner(Context& ctx, const Structure& structure, const LayerMask active, const uint32 nest_lvl, const uint32 max_size)
+	{
+		uint32 last_element_index[kMaxLayers] = {};
+		bool was_saved = false;
+		while (true)
+		{
+			// The first tag on this level and all layers that have it
+			LayerMask matching = 0;
+			uint32 high_idx = 0;
+			uint32 element_index = 0;
+			for (uint32 idx = 0; idx < ctx.layers.size(); idx++)
+			{
+				const LayerMask bit = LayerMask(1) << idx;
+				if (!(active & bit) || !ctx.layers[idx].IsAt(nest_lvl))
+					continue;
+				const Tag tag = ctx.layers[idx].GetTag();
+				const uint32 tag_element_index = DecodeElementIndex(tag.GetElementIndex(), last_element_index[idx]);
+				const Tag first_tag = ctx.layers[high_idx].GetTag();
+				if (!matching || dt_operation::IsTagFirst(tag, tag_element_index, first_tag, element_index))
+				{
+					matching = bit;
+				}
+				else if (dt_operation::TagsEqual(tag, first_tag) && (tag_element_index == element_index))
+				{
+					matching |= bit;
+				}
+				else
+				{
+					continue;
+				}
+				high_idx = idx;
+				element_index = tag_element_index;
+			}
+			if (!matching)
+				break;
+
+			for (uint32 idx = 0; idx < ctx.layers.size(); idx++)
+			{
+				if (matching & (LayerMask(1) << idx))
+				{
+					last_element_index[idx] = element_index;
+				}
+			}
+			Layer& high = ctx.layers[high_idx];
+			if (kSuperStructPropertyIndex == high.GetTag().GetPropertyIndex())
+			{
+				ctx.ForEach(matching, [](Layer& layer) { layer.tag_index++; });
+				was_saved |= MergeSuperStruct(ctx, structure, matching, 0, nest_lvl);
+			}
+			else if (element_index >= max_size)
+			{
+				ctx.ForEach(matching, [](Layer& layer) { dt_operation::SkipNestedTags(layer.dt, layer.tag_index); });
+			}
+			else if (matching == (LayerMask(1) << high_idx))
+			{
+				was_saved |= dt_operation::CopyNestedTags(ctx.dst, high.dt, high.tag_index, high.nest_lvl_offset);
+			}
+			else
+			{
+				was_saved |= MergeValue(ctx, structure, matching, high, nest_lvl, element_index);
+			}
+		}
+		return was_saved;
+	}
+
+	DataTemplate Merge(std::span<const DataTemplate* const> src)
+	{
+		Assert(src.size() <= kMaxLayers);
+		std::vector<Layer> layers;
+		layers.reserve(src.size());
+		for (const DataTemplate* dt : src)
+		{
+			if (dt->TagNum())
+			{
+				layers.emplace_back(Layer{ DataTemplateView(*dt) });
+			}
+		}
+		DataTemplate dst;
+		if (layers.empty())
+			return dst;
+
+		const StructID struct_id = layers.back().dt.GetStructID();
+		LayerMask active = 0;
+		LayerMask pending = 0;
+		uint32 tags_num = 0;
+		uint32 data_size = 0;
+		for (uint32 idx = 0; idx < layers.size(); idx++)
+		{
+			Layer& layer = layers[idx];
+			for (StructID id = struct_id; id != layer.dt.GetStructID(); id = Structure::GetStructure(id).super_id_)
+			{
+				Assert(kWrongID != id); // each layer must be based on the structure of the higher ones
+				layer.nest_lvl_offset++;
+			}
+			(layer.nest_lvl_offset ? pending : active) |= LayerMask(1) << idx;
+			tags_num = std::max<uint32>(tags_num, layer.dt.TagNum());
+			data_size = std::max<uint32>(data_size, static_cast<uint32>(layer.dt.data_.size()));
+		}
+		dst.tags_.reserve(tags_num);
+		dst.data_.reserve(data_size);
 
+		save::SaveStructId(dst.data_, struct_id);
+		Context ctx{ dst, layers };
+		MergeStructure(ctx, Structure::GetStructure(struct_id), active, pending, 0);
+		for (const Layer& layer : layers)
+		{
+			Assert(layer.tag_index == layer.dt.TagNum());
+		}
 		return dst;
 	}
 }
 
-DataTemplate serialization::DataTemplate::Merge(const DataTemplate& lower_dt, const DataTemplate& higher_dt)
+DataTemplate serialization::DataTemplate::Merge(const DataTemplateView& lower_dt, const DataTemplateView& higher_dt)
+{
+	DataTemplate result = dt_operation::Process(lower_dt, higher_dt, dt_operation::EDataTemplateOperation::Merge, Flag32<DiffFlags>());
+	result.layout_hash_ = (lower_dt.layout_hash_ == higher_dt.layout_hash_) ? higher_dt.layout_hash_ : 0;
+	return result;
+}
+
+DataTemplate serialization::DataTemplate::Diff(const DataTemplateView& higher_dt, const DataTemplateView& lower_dt
+	, const Flag32<DiffFlags> flags)
 {
-	return dt_operation::Process(lower_dt, higher_dt, dt_operation::EDataTemplateOperation::Merge);
+	DataTemplate result = dt_operation::Process(lower_dt, higher_dt, dt_operation::EDataTemplateOperation::Diff, flags);
+	result.layout_hash_ = (lower_dt.layout_hash_ == higher_dt.layout_hash_) ? higher_dt.layout_hash_ : 0;
+	return result;
 }
 
-DataTemplate serialization::DataTemplate::Diff(const DataTemplate& higher_dt, const DataTemplate& lower_dt)
+DataTemplate serialization::DataTemplate::MergeLayers(std::span<const DataTemplate* const> layers)
 {
-	return dt_operation::Process(lower_dt, higher_dt, dt_operation::EDataTemplateOperation::Diff);
+	DataTemplate result = merge_layers::Merge(layers);
+	// Known only when all the merged layers agree on it
+	const auto first = std::find_if(layers.begin(), layers.end(), [](const DataTemplate* dt) { return dt->TagNum(); });
+	result.layout_hash_ = (first != layers.end()) ? (*first)->layout_hash_ : 0;
+	for (const DataTemplate* dt : layers)
+	{
+		if (dt->TagNum() && (dt->layout_hash_ != result.layout_hash_))
+		{
+			result.layout_hash_ = 0;
+		}
+	}
+	return result;
 }
\ No newline at end of file
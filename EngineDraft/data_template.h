@@ -1,5 +1,9 @@
 #pragma once
 #include <iostream>
+#include <span>
+#include <mutex>
+#include <cstring>
+#include <string_view>
 #include "utils.h"
 #include "reflection.h"
 
@@ -9,21 +13,82 @@ namespace serialization
 
 	constexpr uint32 kSuperStructPropertyID = 0xFFFFFFFE;
 	constexpr uint32 kSuperStructPropertyIndex = 0x3FFF;
+
+	enum class ETagFlags : uint8
+	{
+		PackedVector = 1 << 0,	// whole vector in a single data chunk, see GetPackedVectorHeaderSize
+		TableString = 1 << 1,	// uint32 offset of the string in the StringTable of the template
+		RemovedKey = 1 << 2,	// map key without a value or set element, erased on load (see DataTemplate::Diff)
+		VectorEdits = 1 << 3,	// vector elements are rearranged before the element tags are loaded, see AppendVectorEdits
+	};
+	// Inline string data: uint16 length, chars
+	// Container data: length (see AppendLength), the elements have their own tags
+	// Packed vector data: length, uint8 element MemberFieldType, raw elements
+	// Map: the length is the number of keys saved, removed keys go first
+	// Vector edits data: length, number of runs (as a length), runs of uint32 first source index and uint32 count
+
+	// A length is uint16, from kLongLength up it's kLongLength followed by uint32
+	constexpr uint32 kLongLength = 0xFFFF;
+	inline uint32 GetLengthSize(const uint32 len) { return (len < kLongLength) ? sizeof(uint16) : (sizeof(uint16) + sizeof(uint32)); }
+	inline void AppendLength(std::vector<uint8>& dst, const uint32 len)
+	{
+		const uint32 dst_offset = static_cast<uint32>(dst.size());
+		const uint16 short_len = static_cast<uint16>(std::min<uint32>(len, kLongLength));
+		dst.resize(dst_offset + GetLengthSize(len));
+		std::memcpy(dst.data() + dst_offset, &short_len, sizeof(uint16));
+		if (kLongLength == short_len)
+		{
+			std::memcpy(dst.data() + dst_offset + sizeof(uint16), &len, sizeof(uint32));
+		}
+	}
+	inline uint32 ReadLength(const uint8* const data, const uint32 offset)
+	{
+		uint16 short_len = 0;
+		std::memcpy(&short_len, data + offset, sizeof(uint16));
+		uint32 len = short_len;
+		if (kLongLength == short_len)
+		{
+			std::memcpy(&len, data + offset + sizeof(uint16), sizeof(uint32));
+		}
+		return len;
+	}
+
+	inline uint32 GetPackedVectorHeaderSize(const uint32 len) { return GetLengthSize(len) + sizeof(uint8); }
+	// Element i of the edited vector is moved from sources[i], the index in the vector before the edit. kWrongID is a new default element.
+	void AppendVectorEdits(std::vector<uint8>& dst, const std::vector<uint32>& sources);
+	std::vector<uint32> ReadVectorEdits(const uint8* const data, const uint32 offset);
+	// Size of a number stored in a packed vector, 0 for types that cannot be packed
+	uint32 GetPackedElementSize(const MemberFieldType type);
+
+	// Tags keep only the low 8 bits of the element index. The full index follows from the previous element
+	// of the same container (the first one follows 0), as long as the saved elements are less than kElementIndexRange apart.
+	constexpr uint32 kElementIndexRange = 1 << 8;
+	inline uint32 DecodeElementIndex(const uint32 low_bits, const uint32 previous_index)
+	{
+		const uint32 index = (previous_index & ~(kElementIndexRange - 1)) | low_bits;
+		return (index < previous_index) ? (index + kElementIndexRange) : index;
+	}
+	// True when skipping the element (e.g. a default value) would break DecodeElementIndex of the next one
+	inline bool MustSaveElement(const uint32 element_index, const uint32 previous_index)
+	{
+		return (element_index - previous_index) >= (kElementIndexRange - 1);
+	}
+
 	class Tag
 	{
 		// Redundant fields are needed to restore data after layout was changed
 		PropertyID property_id_ = kWrongID;	// redundant
+		uint32 byte_offset_ = 0;
 
-		uint32 byte_offset_ : 16;
 		uint32 element_index_ : 8;
 		uint32 nest_level_ : 7;
 		uint32 is_key_ : 1;
+		uint32 reserved_ : 16;				// zero, tags are compared and hashed as bytes
 
 		uint32 type_ : 5;					// redundant
 		uint32 sub_property_offset_ : 5;	// redundant
 		uint32 property_index_ : 14;		
-		uint32 flags_ : 8;
-		//8 bits left - flags, etc..
+		uint32 flags_ : 8;					// ETagFlags
 
 	public:
 		uint32				GetDataOffset()			const { return byte_offset_; }
@@ -31,6 +96,11 @@ namespace serialization
 		uint32				GetNestLevel()			const { return nest_level_; }
 		bool				IsKey()					const { return 0 != is_key_; }
 		PropertyIndex		GetPropertyIndex()		const { return property_index_; }
+		uint32				GetFlags()				const { return flags_; }
+		bool				IsPackedVector()		const { return 0 != (flags_ & static_cast<uint32>(ETagFlags::PackedVector)); }
+		bool				IsTableString()			const { return 0 != (flags_ & static_cast<uint32>(ETagFlags::TableString)); }
+		bool				IsRemovedKey()			const { return 0 != (flags_ & static_cast<uint32>(ETagFlags::RemovedKey)); }
+		bool				IsVectorEdits()			const { return 0 != (flags_ & static_cast<uint32>(ETagFlags::VectorEdits)); }
 
 		// only needed to refresh after layout was changed:
 		//StructID			GetStructID()			const { return struct_id_; }
@@ -38,26 +108,42 @@ namespace serialization
 		MemberFieldType		GetFieldType()			const { return static_cast<MemberFieldType>(type_); }
 		SubPropertyOffset	GetSubPropertyOffset()	const { return sub_property_offset_; }
 
+		Tag WithDataOffset(const uint32 byte_offset) const
+		{
+			Tag tag = *this;
+			tag.byte_offset_ = byte_offset;
+			return tag;
+		}
+
+		Tag WithFlags(const uint32 flags) const
+		{
+			Assert(FitsInBits(flags, 8));
+			Tag tag = *this;
+			tag.flags_ = flags;
+			return tag;
+		}
+
 		Tag() = default;
 		Tag(PropertyID property_id, PropertyIndex property_index
 			, SubPropertyOffset sub_property_offset, MemberFieldType type
-			, uint32 byte_offset, uint32 nest_level, uint32 element_index, uint32 is_key)
+			, uint32 byte_offset, uint32 nest_level, uint32 element_index, uint32 is_key, uint32 flags = 0)
 			: property_id_(property_id)
 			, byte_offset_(byte_offset)
-			, element_index_(element_index)
+			, element_index_(element_index & (kElementIndexRange - 1))
 			, nest_level_(nest_level)
 			, is_key_(is_key)
+			, reserved_(0)
 			, type_(static_cast<uint8>(type))
 			, sub_property_offset_(sub_property_offset)
 			, property_index_(property_index)
+			, flags_(flags)
 		{
 			Assert((kSuperStructPropertyID == property_id_) == (kSuperStructPropertyIndex == property_index_));
-			Assert(FitsInBits(byte_offset_, 16));
-			Assert(FitsInBits(element_index_, 8));
 			Assert(FitsInBits(nest_level_, 7));
 			Assert(FitsInBits(is_key, 1));
 			Assert(FitsInBits(sub_property_offset, 5));
 			Assert(FitsInBits(property_index, 14));
+			Assert(FitsInBits(flags, 8));
 		}
 	};
 
@@ -65,6 +151,16 @@ namespace serialization
 	{
 		None = 0,
 		SkipNativeDefaultValues = 1 << 0,
+		PackTrivialVectors = 1 << 1,		// vectors of numbers are saved as a single tag and a raw block
+		UseStringTable = 1 << 2,			// strings are saved in the StringTable, longer ones always are
+		InternTags = 1 << 3,				// the tags share the storage of equal tag lists (see TagSchemaPool)
+	};
+
+	enum class DiffFlags : uint32
+	{
+		// Vectors are diffed as sequences: equal elements are matched also after an insertion, removal or move,
+		// only new and modified elements are saved (ETagFlags::VectorEdits). Packed vectors are still compared whole.
+		VectorEdits = 1 << 0,
 	};
 
 	__interface ObjectSolver
@@ -73,26 +169,320 @@ namespace serialization
 		Object* ObjectFromId(ObjectID id);
 	};
 
+	// Opt-in dirty tracking of the reflected properties of an object, see DataTemplate::SaveDirty.
+	// A bit per main property index; the bits of a structure follow the bits of its super structures.
+	class DirtyPropertySet
+	{
+		// A key erased from a map property, of the native key type
+		struct RemovedKey
+		{
+			uint32 bit = 0;
+			std::shared_ptr<const void> key;
+		};
+		std::vector<uint64> bits_;
+		std::vector<RemovedKey> removed_keys_;
+
+		static uint32 GetFirstBit(const Structure& structure);
+		static bool FindField(const Structure& object_structure, const uint32 field_offset, const Structure*& owner, PropertyIndex& main_property_index);
+	public:
+		// owner is the structure that declares the property
+		void Mark(const Structure& owner, const PropertyIndex main_property_index);
+		// Marks the property at the field offset in an object of object_structure. Returns false if no property is there.
+		bool MarkField(const Structure& object_structure, const uint32 field_offset);
+		// Marks the map at the field offset and records the erased key, it's saved as a removed key (see ETagFlags::RemovedKey)
+		bool MarkRemovedKey(const Structure& object_structure, const uint32 field_offset, std::shared_ptr<const void> key);
+		bool IsDirty(const Structure& owner, const PropertyIndex main_property_index) const;
+		// The recorded keys of the map property, in the erase order
+		std::vector<const void*> GetRemovedKeys(const Structure& owner, const PropertyIndex main_property_index) const;
+		bool Any() const { return std::any_of(bits_.begin(), bits_.end(), [](const uint64 word) { return 0 != word; }); }
+		void Clear() { bits_.clear(); removed_keys_.clear(); }
+	};
+
+	// Reflected setter: assigns the member and marks it dirty, e.g. SetReflected(obj, &MyClass::hp_, 10, dirty)
+	template<class C, class Owner, typename M, typename V> void SetReflected(C& obj, M Owner::* member, V&& value, DirtyPropertySet& dirty)
+	{
+		static_assert(std::is_base_of_v<Object, C> && std::is_base_of_v<Owner, C>);
+		M& field = obj.*member;
+		field = std::forward<V>(value);
+		const uint32 field_offset = static_cast<uint32>(reinterpret_cast<const uint8*>(&field) - reinterpret_cast<const uint8*>(static_cast<const Object*>(&obj)));
+		const bool found = dirty.MarkField(Structure::GetStructure(obj.GetReflectionStructureID()), field_offset);
+		Assert(found);
+	}
+
+	// Reflected erase from a map: the key is recorded, so SaveDirty can remove it from the last saved state,
+	// e.g. EraseReflected(obj, &MyClass::items_, key, dirty)
+	template<class C, class Owner, typename M, typename K> void EraseReflected(C& obj, M Owner::* member, const K& key, DirtyPropertySet& dirty)
+	{
+		static_assert(std::is_base_of_v<Object, C> && std::is_base_of_v<Owner, C> && is_map<M>::value);
+		M& field = obj.*member;
+		if (0 == field.erase(key))
+			return;
+		const uint32 field_offset = static_cast<uint32>(reinterpret_cast<const uint8*>(&field) - reinterpret_cast<const uint8*>(static_cast<const Object*>(&obj)));
+		const bool found = dirty.MarkRemovedKey(Structure::GetStructure(obj.GetReflectionStructureID()), field_offset
+			, std::make_shared<const typename M::key_type>(key));
+		Assert(found);
+	}
+
+	// Object pointer found by a load, it is resolved when all the objects of a batch exist
+	struct ObjectFixup
+	{
+		Object** slot = nullptr;
+		ObjectID object_id = kNullObjectID;
+	};
+
+	// Everything a load leaves to be done, when the pointers can be resolved
+	struct ObjectFixups
+	{
+		std::vector<ObjectFixup> slots;
+		// Map keys and set elements with pointers would be equal before the pointers are resolved. They are loaded aside
+		// and added to their containers after the slots are resolved, the last one first, so nested containers are
+		// complete before they are moved in.
+		std::vector<std::function<void()>> inserts;
+
+		void Resolve(ObjectSolver& solver);
+	};
+
+	// Tags of a template, with the subset of the std::vector interface used by the serialization.
+	// The storage can be shared by templates of the same shape (see TagSchemaPool), it is copied on the first write.
+	class TagList
+	{
+		std::shared_ptr<std::vector<Tag>> storage_;
+
+		static const std::vector<Tag>& GetEmpty()
+		{
+			static const std::vector<Tag> empty;
+			return empty;
+		}
+		const std::vector<Tag>& Get() const
+		{
+			return storage_ ? *storage_ : GetEmpty();
+		}
+		std::vector<Tag>& GetMutable()
+		{
+			if (!storage_)
+			{
+				storage_ = std::make_shared<std::vector<Tag>>();
+			}
+			else if (storage_.use_count() > 1)
+			{
+				storage_ = std::make_shared<std::vector<Tag>>(*storage_);
+			}
+			return *storage_;
+		}
+		friend class TagSchemaPool;
+
+	public:
+		using const_iterator = std::vector<Tag>::const_iterator;
+
+		TagList() = default;
+		explicit TagList(std::vector<Tag>&& tags) : storage_(std::make_shared<std::vector<Tag>>(std::move(tags))) {}
+
+		uint32 size() const { return static_cast<uint32>(Get().size()); }
+		bool empty() const { return Get().empty(); }
+		const Tag& operator[](const uint32 idx) const { return Get()[idx]; }
+		const Tag& back() const { return Get().back(); }
+		const Tag* data() const { return Get().data(); }
+		const_iterator begin() const { return Get().begin(); }
+		const_iterator end() const { return Get().end(); }
+
+		template<class... Args> Tag& emplace_back(Args&&... args)
+		{
+			return GetMutable().emplace_back(std::forward<Args>(args)...);
+		}
+		void pop_back() { GetMutable().pop_back(); }
+		void reserve(const uint32 num) { GetMutable().reserve(num); }
+		void resize(const uint32 num) { GetMutable().resize(num); }
+		template<class It> void assign(It first, It last) { GetMutable().assign(first, last); }
+		void clear()
+		{
+			if (storage_ && (storage_.use_count() > 1))
+			{
+				storage_.reset();
+			}
+			else if (storage_)
+			{
+				storage_->clear(); // keeps the capacity
+			}
+		}
+
+		// Shared storage, equal content is implied
+		bool IsSharedWith(const TagList& other) const { return storage_ && (storage_ == other.storage_); }
+		bool operator==(const TagList& other) const
+		{
+			return IsSharedWith(other) || ((size() == other.size())
+				&& (0 == std::memcmp(data(), other.data(), size() * sizeof(Tag))));
+		}
+		bool operator!=(const TagList& other) const { return !(*this == other); }
+	};
+
+	// Keeps one immutable copy of each distinct tag list. Thread safe.
+	class TagSchemaPool
+	{
+		mutable std::mutex mutex_;
+		std::unordered_multimap<uint64, std::shared_ptr<std::vector<Tag>>> schemas_; // by content hash
+
+	public:
+		static TagSchemaPool& Get();
+
+		// Makes tags use the pooled storage of the same content
+		void Intern(TagList& tags);
+		// Forgets schemas, that are not used by any template
+		void RemoveUnused();
+		uint32 GetNum() const;
+	};
+
+	// Deduplicated strings of a template, or of many templates (e.g. a whole archive) sharing it.
+	// Entry: uint32 length, chars. Entries are never removed, so offsets stay valid.
+	// Adding is not thread safe, a table shared by templates being saved in parallel must be filled before.
+	class StringTable
+	{
+		std::vector<uint8> data_;
+		std::unordered_multimap<size_t, uint32> offsets_by_hash_; // rebuilt on the first Add after loading
+
+	public:
+		StringTable() = default;
+		explicit StringTable(std::vector<uint8>&& data) : data_(std::move(data)) {}
+
+		uint32 Add(std::string_view str);
+		const std::vector<uint8>& GetData() const { return data_; }
+		// Returns an empty string for an offset outside the table
+		static std::string_view Get(std::span<const uint8> table, const uint32 offset);
+	};
+
+	struct DataTemplateView;
+
+	// Data of src with its table strings added to strings and the offsets replaced, e.g. to store templates with a common table
+	std::vector<uint8> RemapTableStrings(const DataTemplateView& src, StringTable& strings);
+
 	struct DataTemplate
 	{
-		std::vector<Tag> tags_;
+		TagList tags_;
 		std::vector<uint8> data_;
+		std::shared_ptr<StringTable> strings_; // only needed by values tagged as ETagFlags::TableString
+		uint32 layout_hash_ = 0; // Structure::GetLayoutHash of the root structure the tags were made for, 0 - unknown
 
 		StructID GetStructID() const;
 		uint32 TagNum() const { return tags_.size(); }
-		DataTemplate Clone() const { return *this; }
+		DataTemplate Clone() const { return *this; } // the tags are shared until either copy changes them
+		bool HasSameSchema(const DataTemplate& other) const { return tags_ == other.tags_; }
+		bool operator==(const DataTemplate& other) const;
+		std::span<const uint8> GetStrings() const { return strings_ ? std::span<const uint8>(strings_->GetData()) : std::span<const uint8>(); }
 
 		std::string ToString() const;
+		// True when the tags were made for the current layout of the structure (see layout_hash_), a refresh does nothing then
+		bool IsLayoutCurrent(const StructID struct_id) const;
 		void RefreshAfterLayoutChanged(const StructID struct_id);
+		// Refreshes on worker threads, templates of the current layout are skipped. Templates with the same tags (data offsets aside) and structure share a migration
+		// plan, it's recorded by refreshing the first one and replayed on the others. Errors are reported only once per plan.
+		static void RefreshManyAfterLayoutChanged(std::span<const std::pair<DataTemplate*, StructID>> batch);
 
 		//Todo: add object solver
 		void SaveFromObject(const Object* obj, const Flag32<SaveFlags> flags);
+		// Saves only the dirty properties, in full (SkipNativeDefaultValues is ignored). The result can be merged over
+		// the last saved state (see MergeLayers). A dirty map is merged by keys: only the keys erased with EraseReflected
+		// are removed, use Diff when the map was changed otherwise.
+		void SaveDirty(const Object* obj, const DirtyPropertySet& dirty, const Flag32<SaveFlags> flags);
+		void LoadIntoObject(Object* obj) const;
+		// Saves objects on worker threads, result is in the input order
+		static std::vector<DataTemplate> SaveMany(std::span<const Object* const> objects, const Flag32<SaveFlags> flags);
+		// Loads on worker threads, then resolves object pointers with the solver (skipped when null).
+		static void LoadIntoObjects(std::span<const std::pair<const DataTemplate*, Object*>> batch, ObjectSolver* solver);
+
+		// Map and set elements are matched by the saved key, not by position. Keys missing in higher_dt are saved as removed keys.
+		// Vector edits (see DiffFlags) are composed. A vector without edits below them is taken as complete, the result has no edits then.
+		static DataTemplate Merge(const DataTemplateView& lower_dt, const DataTemplateView& higher_dt); // 
+		static DataTemplate Diff(const DataTemplateView& higher_dt, const DataTemplateView& lower_dt
+			, const Flag32<DiffFlags> flags = Flag32<DiffFlags>()); //= higher_dt - lower_dt
+		// Merges all layers in a single pass, like chained Merge calls. layers[0] is the lowest one,
+		// the structure of each layer must be based on the structures of the lower ones. Layers without tags are skipped.
+		static DataTemplate MergeLayers(std::span<const DataTemplate* const> layers);
+	};
+
+	// Read-only template over memory it does not own, e.g. a memory mapped file (see ParseDataTemplateView).
+	// The memory must outlive the view.
+	struct DataTemplateView
+	{
+		std::span<const Tag> tags_;
+		std::span<const uint8> data_;
+		std::span<const uint8> strings_; // StringTable::GetData
+		uint32 layout_hash_ = 0; // see DataTemplate::layout_hash_
+
+		DataTemplateView() = default;
+		DataTemplateView(std::span<const Tag> tags, std::span<const uint8> data, std::span<const uint8> strings = {})
+			: tags_(tags), data_(data), strings_(strings) {}
+		DataTemplateView(const DataTemplate& dt) : tags_(dt.tags_.data(), dt.tags_.size()), data_(dt.data_), strings_(dt.GetStrings())
+			, layout_hash_(dt.layout_hash_) {}
+
+		StructID GetStructID() const;
+		uint32 TagNum() const { return static_cast<uint32>(tags_.size()); }
+		// Value of a String tag, either inline or from the table
+		std::string_view GetString(const Tag tag) const;
+		DataTemplate ToTemplate() const;
+
+		std::string ToString() const;
 		void LoadIntoObject(Object* obj) const;
+	};
+
+	namespace details
+	{
+		// Type erased walkers, the typed path (typed_serialization.h) falls back to them
+		bool SaveStructure(const uint8* src, DataTemplate& dst, const Structure& structure, const uint32 nest_level
+			, const Flag32<SaveFlags> flags);
+		uint32 LoadStructure(const DataTemplateView& src, uint8* dst, const Structure& structure, const uint32 tag_index
+			, ObjectFixups* fixups);
+		void LoadObject(const DataTemplateView& src, Object* obj, ObjectFixups* fixups);
+		// Index of the first tag after the value at tag_index and its nested tags
+		uint32 SkipValue(const DataTemplateView& src, const uint32 tag_index);
+		// The pointer stays null until the fixup is resolved
+		void LoadObjectPtr(uint8* dst, const uint8* src, const uint32 src_offset, ObjectFixups* fixups);
+		bool SaveObjectPtr(std::vector<uint8>& dst, const Object* obj, const StructID property_struct_id
+			, const Flag32<SaveFlags> flags);
+		inline bool UsesStringTable(const size_t len, const Flag32<SaveFlags> flags)
+		{
+			return flags[SaveFlags::UseStringTable] || (len > 0xFFFF);
+		}
+		// Appends the value data of a String tag, the table is created when needed
+		void SaveString(DataTemplate& dst, std::string_view str, const bool table_string);
+	}
 
-		static DataTemplate Merge(const DataTemplate& lower_dt, const DataTemplate& higher_dt); // 
-		static DataTemplate Diff(const DataTemplate& higher_dt, const DataTemplate& lower_dt); //= higher_dt - lower_dt
+	enum class EStreamFlags : uint16
+	{
+		CompactTags = 1 << 0,	// see tag_codec.h
+		StringTable = 1 << 1,	// set when the template has a string table
+		LayoutHash = 1 << 2,	// set when the layout hash of the template is known
+	};
+
+	// Binary stream format: the header, then the raw tags block (16 bytes per tag) and the raw data block.
+	// With LayoutHash the header is followed by uint32 DataTemplate::layout_hash_.
+	// With CompactTags the raw data block goes first, followed by the compact tags block.
+	// With StringTable the blocks are followed by uint32 table size and StringTable::GetData.
+	// The blocks are zero padded to 4 bytes, so templates following each other stay aligned.
+	struct DataTemplateHeader
+	{
+		static constexpr uint32 kMagic = 0x54444445; // "EDDT"
+		static constexpr uint16 kVersion = 5;
+		static constexpr uint16 kMinSupportedVersion = kVersion; // no older version was released
+
+		uint32 magic = kMagic;
+		uint16 version = kVersion;
+		uint16 flags = 0;				// EStreamFlags
+		uint32 tags_num = 0;
+		uint32 data_size = 0;
+		uint32 compact_tags_size = 0;	// bytes, CompactTags only
 	};
+	static_assert(sizeof(DataTemplateHeader) == 5 * sizeof(uint32));
+	static_assert(std::has_unique_object_representations_v<DataTemplateHeader>); // written raw, no padding bytes
+	static_assert(sizeof(Tag) % sizeof(uint32) == 0);
+
+	void WriteDataTemplate(std::ostream& os, const DataTemplate& dt, const Flag32<EStreamFlags> flags);
+	// On failure sets failbit of the stream and leaves dt empty
+	bool ReadDataTemplate(std::istream& is, DataTemplate& dt);
+	// Zero-copy read of a template written by WriteDataTemplate without CompactTags, src must be 4 bytes aligned.
+	// Returns false if the block is malformed, compact or misaligned.
+	// offset is moved past the block.
+	bool ParseDataTemplateView(std::span<const uint8> src, uint32& offset, DataTemplateView& view);
 
+	// Binary, a tag is written as 16 raw bytes
 	std::istream& operator>> (std::istream& is, Tag& t);
 	std::ostream& operator<< (std::ostream& os, const Tag& t);
 	std::istream& operator>> (std::istream& is, DataTemplate& dt);
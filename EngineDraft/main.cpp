@@ -1,9 +1,13 @@
 #include "reflection.h"
 #include "data_template.h"
+#include "typed_serialization.h"
+#include "tag_codec.h"
+#include "asset.h"
 
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
 
@@ -41,6 +45,26 @@ reflection::Object* GetObjectFromID_Stub(reflection::ObjectID id)
 	return (reflection::kNullObjectID == id) ? nullptr : reinterpret_cast<reflection::Object*>(id);
 }
 
+// Knows only the added objects, other ids are solved to null
+class StubObjectSolver : public serialization::ObjectSolver
+{
+	std::map<reflection::ObjectID, reflection::Object*> objects_;
+public:
+	void Add(reflection::Object* obj)
+	{
+		objects_[GetObjectID_Stub(obj)] = obj;
+	}
+	reflection::ObjectID IdFromObject(const reflection::Object* obj) override
+	{
+		return GetObjectID_Stub(obj);
+	}
+	reflection::Object* ObjectFromId(reflection::ObjectID id) override
+	{
+		const auto it = objects_.find(id);
+		return (it != objects_.end()) ? it->second : nullptr;
+	}
+};
+
 class ObjSample : public reflection::Object
 {
 public:
@@ -58,19 +82,18 @@ public:
 	}
 
 	IMPLEMENT_VIRTUAL_REFLECTION(ObjSample);
+	IMPLEMENT_STATIC_REGISTRATION(ObjSample, reflection::Object);
 
-	static reflection::Structure& StaticRegisterStructure()
+	static constexpr auto StaticReflectedMembers()
 	{
-		auto& structure = reflection::Structure::CreateStructure(StaticGetReflectionStructureID(), sizeof(ObjSample), reflection::Object::StaticGetReflectionStructureID());
-		DEFINE_PROPERTY(ObjSample, string_);
-		DEFINE_PROPERTY(ObjSample, obj_);
-		DEFINE_PROPERTY(ObjSample, sample_);
-		DEFINE_PROPERTY(ObjSample, vec_);
-		DEFINE_PROPERTY(ObjSample, map_);
-		DEFINE_PROPERTY(ObjSample, arr1_);
-		DEFINE_PROPERTY(ObjSample, arr2_);
-		Assert(structure.Validate());
-		return structure;
+		return std::make_tuple(
+			REFLECTED_MEMBER(ObjSample, string_),
+			REFLECTED_MEMBER(ObjSample, obj_),
+			REFLECTED_MEMBER(ObjSample, sample_),
+			REFLECTED_MEMBER(ObjSample, vec_),
+			REFLECTED_MEMBER(ObjSample, map_),
+			REFLECTED_MEMBER(ObjSample, arr1_),
+			REFLECTED_MEMBER(ObjSample, arr2_));
 	}
 };
 REGISTER_STRUCTURE(ObjSample);
@@ -83,17 +106,33 @@ public:
 	ObjAdvanced() = default;
 
 	IMPLEMENT_VIRTUAL_REFLECTION(ObjAdvanced);
+	IMPLEMENT_STATIC_REGISTRATION(ObjAdvanced, ObjSample);
 
-	static reflection::Structure& StaticRegisterStructure()
+	static constexpr auto StaticReflectedMembers()
 	{
-		auto& structure = reflection::Structure::CreateStructure(StaticGetReflectionStructureID(), sizeof(ObjAdvanced), ObjSample::StaticGetReflectionStructureID());
-		DEFINE_PROPERTY(ObjAdvanced, adv_string_);
-		Assert(structure.Validate());
-		return structure;
+		return std::make_tuple(REFLECTED_MEMBER(ObjAdvanced, adv_string_));
 	}
 };
 REGISTER_STRUCTURE(ObjAdvanced);
 
+class ObjSets : public reflection::Object
+{
+public:
+	std::set<StructSample> set_;
+	std::unordered_set<int32> hashed_;
+
+	IMPLEMENT_VIRTUAL_REFLECTION(ObjSets);
+	IMPLEMENT_STATIC_REGISTRATION(ObjSets, reflection::Object);
+
+	static constexpr auto StaticReflectedMembers()
+	{
+		return std::make_tuple(
+			REFLECTED_MEMBER(ObjSets, set_),
+			REFLECTED_MEMBER(ObjSets, hashed_));
+	}
+};
+REGISTER_STRUCTURE(ObjSets);
+
 void PrintStructure(const reflection::Structure& structure, bool print_label)
 {
 	if (print_label)
@@ -119,8 +158,580 @@ void PrintStructure(const reflection::Structure& structure, bool print_label)
 	}
 }
 
+std::string SaveToString(const reflection::Object& obj)
+{
+	serialization::DataTemplate data_template;
+	data_template.SaveFromObject(&obj, serialization::SaveFlags::None);
+	return data_template.ToString();
+}
+
+// The compiled load gives the same object as the type erased one, also for templates it falls back on
+void TestCompiledLoad()
+{
+	ObjAdvanced obj;
+	obj.string_ = "compiled";
+	obj.sample_.integer_ = 5;
+	obj.vec_.emplace_back(StructSample(7));
+	obj.map_[StructSample(1)] = 2;
+	obj.arr1_[3].integer_ = 11;
+	obj.adv_string_.clear();
+	const auto& structure = reflection::Structure::GetStructure(obj.GetReflectionStructureID());
+
+	for (const auto flags : { serialization::SaveFlags::None, serialization::SaveFlags::SkipNativeDefaultValues })
+	{
+		serialization::DataTemplate data_template;
+		data_template.SaveFromObject(&obj, flags);
+
+		ObjAdvanced compiled_clone;
+		data_template.LoadIntoObject(&compiled_clone);
+		ObjAdvanced dynamic_clone;
+		serialization::details::LoadStructure(data_template
+			, reinterpret_cast<uint8*>(static_cast<reflection::Object*>(&dynamic_clone)), structure, 0, nullptr);
+		Assert(SaveToString(compiled_clone) == SaveToString(dynamic_clone));
+		if (serialization::SaveFlags::None == flags)
+		{
+			Assert(SaveToString(compiled_clone) == SaveToString(obj));
+		}
+	}
+}
+
+// The typed load gives the same object as the type erased one, the pointers are resolved by the same fixups
+void TestTypedLoad()
+{
+	ObjAdvanced obj;
+	obj.string_ = "typed";
+	obj.obj_ = &obj;
+	obj.vec_.emplace_back(StructSample(3));
+	obj.map_[StructSample(2)] = 8;
+	obj.arr2_[1] = &obj;
+	serialization::DataTemplate data_template;
+	data_template.SaveFromObject(&obj, serialization::SaveFlags::None);
+	StubObjectSolver solver;
+	solver.Add(&obj);
+
+	ObjAdvanced typed_clone;
+	serialization::ObjectFixups fixups;
+	serialization::LoadIntoObject(data_template, typed_clone, &fixups);
+	fixups.Resolve(solver);
+	ObjAdvanced dynamic_clone;
+	const std::pair<const serialization::DataTemplate*, reflection::Object*> batch[] = { { &data_template, &dynamic_clone } };
+	serialization::DataTemplate::LoadIntoObjects(batch, &solver);
+
+	Assert(SaveToString(typed_clone) == SaveToString(dynamic_clone));
+	Assert((typed_clone.obj_ == dynamic_clone.obj_) && (typed_clone.arr2_ == dynamic_clone.arr2_));
+}
+
+// Compact tags decode to the saved ones: from the current structures when the layout hash matches, from the cold stream otherwise
+void TestCompactTags()
+{
+	ObjAdvanced obj;
+	obj.string_ = "compact";
+	obj.vec_.emplace_back(StructSample(5));
+	obj.map_[StructSample(1)] = 2;
+	serialization::DataTemplate saved;
+	saved.SaveFromObject(&obj, serialization::SaveFlags::None);
+	auto read_tags = [&saved](const std::vector<uint8>& block, serialization::DataTemplate& read)
+	{
+		read.data_ = saved.data_;
+		uint32 offset = 0;
+		return serialization::ReadCompactTags(block.data(), static_cast<uint32>(block.size()), offset, read) && (offset == block.size());
+	};
+
+	for (const uint32 layout_hash : { saved.layout_hash_, 0u })
+	{
+		serialization::DataTemplate written = saved;
+		written.layout_hash_ = layout_hash;
+		std::vector<uint8> block;
+		serialization::WriteCompactTags(written, block);
+		serialization::DataTemplate read;
+		Assert(read_tags(block, read) && (read.tags_ == saved.tags_));
+		ObjAdvanced loaded;
+		read.LoadIntoObject(&loaded);
+		Assert(SaveToString(loaded) == SaveToString(obj));
+
+		// The cold stream ends the block, it's decoded only for an unknown layout
+		block.back() ^= 0xFF;
+		serialization::DataTemplate damaged;
+		const bool same_tags = read_tags(block, damaged) && (damaged.tags_ == saved.tags_);
+		Assert(same_tags == (0 != layout_hash));
+	}
+}
+
+// Templates of the same shape saved with InternTags share the pooled tags, a change copies them
+void TestInternedTags()
+{
+	serialization::TagSchemaPool& pool = serialization::TagSchemaPool::Get();
+	pool.RemoveUnused();
+	const uint32 pooled = pool.GetNum();
+	{
+		ObjSample a;
+		a.string_ = "a";
+		a.vec_.emplace_back(StructSample(1));
+		ObjSample b = a;
+		b.string_ = "b";
+		b.vec_[0].integer_ = 2;
+		ObjSample c = a;
+		c.vec_.emplace_back(StructSample(3)); // another shape
+		const reflection::Object* const objects[] = { &a, &b, &c };
+		const std::vector<serialization::DataTemplate> saved = serialization::DataTemplate::SaveMany(objects
+			, serialization::SaveFlags::InternTags);
+		serialization::DataTemplate saved_b;
+		saved_b.SaveFromObject(&b, serialization::SaveFlags::InternTags);
+		Assert(saved[0].tags_.IsSharedWith(saved[1].tags_) && saved[0].tags_.IsSharedWith(saved_b.tags_));
+		Assert(!saved[0].tags_.IsSharedWith(saved[2].tags_) && ((pooled + 2) == pool.GetNum()));
+		for (uint32 idx = 0; idx < saved.size(); idx++)
+		{
+			ObjSample loaded;
+			saved[idx].LoadIntoObject(&loaded);
+			Assert(SaveToString(loaded) == SaveToString(*static_cast<const ObjSample*>(objects[idx])));
+		}
+
+		serialization::DataTemplate changed = saved_b;
+		changed.tags_.pop_back();
+		Assert(!changed.tags_.IsSharedWith(saved_b.tags_) && (saved_b.tags_ == saved[1].tags_));
+		pool.RemoveUnused();
+		Assert((pooled + 2) == pool.GetNum());
+	}
+	pool.RemoveUnused();
+	Assert(pooled == pool.GetNum());
+}
+
+// A template written to a stream reads back equal, with raw and with compact tags. A bad header or a too short stream is rejected.
+void TestTemplateStream()
+{
+	ObjAdvanced obj;
+	obj.string_ = "streamed";
+	obj.vec_.emplace_back(StructSample(6));
+	obj.map_[StructSample(7)] = 8;
+	serialization::DataTemplate saved;
+	saved.SaveFromObject(&obj, serialization::SaveFlags::UseStringTable);
+	Assert(!saved.GetStrings().empty() && saved.layout_hash_);
+	auto read = [](const std::string& bytes, serialization::DataTemplate& dt)
+	{
+		std::istringstream stream(bytes);
+		const bool ok = serialization::ReadDataTemplate(stream, dt);
+		Assert(ok != stream.fail());
+		return ok;
+	};
+
+	for (const bool compact_tags : { false, true })
+	{
+		std::ostringstream stream;
+		serialization::WriteDataTemplate(stream, saved, compact_tags ? Flag32<serialization::EStreamFlags>(serialization::EStreamFlags::CompactTags)
+			: Flag32<serialization::EStreamFlags>());
+		const std::string bytes = stream.str();
+		Assert(0 == (bytes.size() % sizeof(uint32)));
+		serialization::DataTemplate read_dt;
+		Assert(read(bytes, read_dt) && (read_dt == saved) && (read_dt.layout_hash_ == saved.layout_hash_));
+		ObjAdvanced loaded;
+		read_dt.LoadIntoObject(&loaded);
+		Assert(SaveToString(loaded) == SaveToString(obj));
+
+		auto rejected = [&](const uint32 offset, const uint32 value)
+		{
+			std::string bad_bytes = bytes;
+			std::memcpy(bad_bytes.data() + offset, &value, sizeof(uint16));
+			serialization::DataTemplate dt;
+			return !read(bad_bytes, dt) && dt.tags_.empty() && dt.data_.empty();
+		};
+		Assert(rejected(offsetof(serialization::DataTemplateHeader, magic), 0));
+		Assert(rejected(offsetof(serialization::DataTemplateHeader, version), serialization::DataTemplateHeader::kVersion + 1));
+		Assert(rejected(offsetof(serialization::DataTemplateHeader, version), serialization::DataTemplateHeader::kMinSupportedVersion - 1));
+		Assert(rejected(offsetof(serialization::DataTemplateHeader, data_size) + sizeof(uint16), 0xFFFF)); // past the end
+		serialization::DataTemplate truncated;
+		Assert(!read(bytes.substr(0, bytes.size() - 1), truncated) && truncated.tags_.empty());
+	}
+}
+
+// Views parsed from the written bytes point into them and load like the templates, compact or misaligned blocks are refused
+void TestTemplateView()
+{
+	ObjAdvanced first_obj;
+	first_obj.string_ = "first";
+	first_obj.map_[StructSample(1)] = 1;
+	ObjAdvanced second_obj;
+	second_obj.string_ = "second";
+	second_obj.vec_.emplace_back(StructSample(2));
+	serialization::DataTemplate first;
+	first.SaveFromObject(&first_obj, serialization::SaveFlags::None);
+	serialization::DataTemplate second;
+	second.SaveFromObject(&second_obj, serialization::SaveFlags::UseStringTable);
+	std::ostringstream stream;
+	serialization::WriteDataTemplate(stream, first, Flag32<serialization::EStreamFlags>());
+	serialization::WriteDataTemplate(stream, second, Flag32<serialization::EStreamFlags>());
+	const std::string bytes = stream.str();
+	std::vector<uint32> aligned((bytes.size() + sizeof(uint32)) / sizeof(uint32)); // one more word, for the misaligned copy
+	std::memcpy(aligned.data(), bytes.data(), bytes.size());
+	const std::span<const uint8> src(reinterpret_cast<const uint8*>(aligned.data()), bytes.size());
+
+	auto in_src = [&src](const void* ptr)
+	{
+		return (ptr >= static_cast<const void*>(src.data())) && (ptr < static_cast<const void*>(src.data() + src.size()));
+	};
+	uint32 offset = 0;
+	for (const auto& [saved, obj] : { std::make_pair(&first, &first_obj), std::make_pair(&second, &second_obj) })
+	{
+		serialization::DataTemplateView view;
+		Assert(serialization::ParseDataTemplateView(src, offset, view));
+		Assert(in_src(view.tags_.data()) && in_src(view.data_.data())); // nothing copied
+		Assert((view.ToTemplate() == *saved) && (view.layout_hash_ == saved->layout_hash_));
+		ObjAdvanced loaded;
+		view.LoadIntoObject(&loaded);
+		Assert(SaveToString(loaded) == SaveToString(*obj));
+	}
+	Assert(offset == src.size());
+
+	serialization::DataTemplateView view;
+	offset = sizeof(uint32);
+	Assert(!serialization::ParseDataTemplateView(src, offset, view) && (sizeof(uint32) == offset));
+	offset = 0;
+	Assert(!serialization::ParseDataTemplateView(src.first(sizeof(serialization::DataTemplateHeader) + sizeof(uint32)), offset, view) && (0 == offset));
+	std::memmove(reinterpret_cast<uint8*>(aligned.data()) + 1, bytes.data(), bytes.size());
+	Assert(!serialization::ParseDataTemplateView(std::span<const uint8>(reinterpret_cast<const uint8*>(aligned.data()) + 1, bytes.size()), offset, view));
+	std::ostringstream compact_stream;
+	serialization::WriteDataTemplate(compact_stream, first, Flag32<serialization::EStreamFlags>(serialization::EStreamFlags::CompactTags));
+	const std::string compact_bytes = compact_stream.str();
+	std::memcpy(aligned.data(), compact_bytes.data(), std::min(compact_bytes.size(), bytes.size()));
+	Assert(!serialization::ParseDataTemplateView(src, offset, view));
+}
+
+// Equal strings are stored once, also by templates sharing a table. Remapped to another table, the templates load the same strings.
+void TestStringTable()
+{
+	serialization::StringTable table;
+	const uint32 offset = table.Add("table");
+	Assert((offset == table.Add("table")) && (offset != table.Add("other")));
+	Assert(("table" == serialization::StringTable::Get(table.GetData(), offset))
+		&& serialization::StringTable::Get(table.GetData(), static_cast<uint32>(table.GetData().size())).empty());
+
+	ObjAdvanced first_obj;
+	first_obj.string_ = "shared text";
+	first_obj.adv_string_ = "shared text";
+	ObjAdvanced second_obj;
+	second_obj.string_ = "second";
+	second_obj.adv_string_ = "shared text";
+	const auto shared_strings = std::make_shared<serialization::StringTable>();
+	serialization::DataTemplate templates[2];
+	for (serialization::DataTemplate& dt : templates)
+	{
+		dt.strings_ = shared_strings;
+	}
+	templates[0].SaveFromObject(&first_obj, serialization::SaveFlags::UseStringTable);
+	templates[1].SaveFromObject(&second_obj, serialization::SaveFlags::UseStringTable);
+	Assert((templates[1].strings_ == shared_strings) && (shared_strings->GetData().size() == (2 * sizeof(uint32) + 11 + 6)));
+
+	serialization::StringTable remapped_strings;
+	remapped_strings.Add("before");
+	std::vector<serialization::DataTemplate> remapped;
+	for (const serialization::DataTemplate& dt : templates)
+	{
+		remapped.push_back(dt);
+		remapped.back().data_ = serialization::RemapTableStrings(dt, remapped_strings);
+	}
+	Assert(remapped_strings.GetData().size() == (3 * sizeof(uint32) + 6 + 11 + 6));
+	const ObjAdvanced* const objects[] = { &first_obj, &second_obj };
+	for (uint32 idx = 0; idx < 2; idx++)
+	{
+		remapped[idx].strings_ = std::make_shared<serialization::StringTable>(std::vector<uint8>(remapped_strings.GetData()));
+		Assert(remapped[idx].data_ != templates[idx].data_);
+		for (const serialization::DataTemplate* dt : { &templates[idx], &remapped[idx] })
+		{
+			ObjAdvanced loaded;
+			dt->LoadIntoObject(&loaded);
+			Assert(SaveToString(loaded) == SaveToString(*objects[idx]));
+		}
+	}
+}
+
+// A removal can leave too many skipped defaults between the merged elements, the merges fill the gap
+void TestVectorEditsGap()
+{
+	auto fill = [](ObjSample& obj)
+	{
+		obj.vec_.resize(300);
+		obj.vec_.front().integer_ = 1;
+		obj.vec_[150].integer_ = 3;
+		obj.vec_.back().integer_ = 2;
+	};
+	ObjSample lower_obj;
+	fill(lower_obj);
+	ObjSample higher_obj;
+	fill(higher_obj);
+	higher_obj.vec_.erase(higher_obj.vec_.begin() + 150); // the elements saved around it are 298 apart then
+
+	serialization::DataTemplate lower;
+	lower.SaveFromObject(&lower_obj, serialization::SaveFlags::SkipNativeDefaultValues);
+	serialization::DataTemplate lower_full;
+	lower_full.SaveFromObject(&lower_obj, serialization::SaveFlags::None);
+	serialization::DataTemplate higher_full;
+	higher_full.SaveFromObject(&higher_obj, serialization::SaveFlags::None);
+	// Equal elements are not in the diff, so nothing is saved between the first and the last one
+	const serialization::DataTemplate diff = serialization::DataTemplate::Diff(higher_full, lower_full
+		, serialization::DiffFlags::VectorEdits);
+
+	const serialization::DataTemplate* const layers[] = { &lower, &diff };
+	const serialization::DataTemplate merged[] = { serialization::DataTemplate::MergeLayers(layers)
+		, serialization::DataTemplate::Merge(lower, diff) };
+	for (const serialization::DataTemplate& merged_dt : merged)
+	{
+		ObjSample merged_obj;
+		merged_dt.LoadIntoObject(&merged_obj);
+		Assert(merged_obj.vec_.size() == higher_obj.vec_.size());
+		Assert(std::equal(merged_obj.vec_.begin(), merged_obj.vec_.end(), higher_obj.vec_.begin()
+			, [](const StructSample& a, const StructSample& b) { return a.integer_ == b.integer_; }));
+	}
+}
+
+// Keys erased since the last save are written by SaveDirty as removed, merges and loads over the last state erase them
+void TestDirtyMapErase()
+{
+	ObjSample obj;
+	obj.map_ = { { StructSample(1), 10 }, { StructSample(2), 20 }, { StructSample(3), 30 } };
+	serialization::DataTemplate last_saved;
+	last_saved.SaveFromObject(&obj, serialization::SaveFlags::SkipNativeDefaultValues);
+
+	serialization::DirtyPropertySet dirty;
+	serialization::EraseReflected(obj, &ObjSample::map_, StructSample(2), dirty);
+	serialization::SetReflected(obj, &ObjSample::string_, std::string("dirty"), dirty);
+	serialization::DataTemplate dirty_dt;
+	dirty_dt.SaveDirty(&obj, dirty, serialization::SaveFlags::None);
+	auto same_as_obj = [&obj](const ObjSample& other)
+	{
+		return (other.string_ == obj.string_) && std::equal(other.map_.begin(), other.map_.end(), obj.map_.begin(), obj.map_.end()
+			, [](const auto& a, const auto& b) { return (a.first.integer_ == b.first.integer_) && (a.second == b.second); });
+	};
+
+	const serialization::DataTemplate* const layers[] = { &last_saved, &dirty_dt };
+	const serialization::DataTemplate merged[] = { serialization::DataTemplate::MergeLayers(layers)
+		, serialization::DataTemplate::Merge(last_saved, dirty_dt) };
+	for (const serialization::DataTemplate& merged_dt : merged)
+	{
+		ObjSample merged_obj;
+		merged_dt.LoadIntoObject(&merged_obj);
+		Assert(same_as_obj(merged_obj));
+	}
+	ObjSample loaded_obj;
+	last_saved.LoadIntoObject(&loaded_obj);
+	dirty_dt.LoadIntoObject(&loaded_obj);
+	Assert(same_as_obj(loaded_obj));
+}
+
+// A map diff holds only the changed entries: a changed value, an erased key or a key added before the others
+void TestMapDiff()
+{
+	ObjSample lower_obj;
+	for (int32 i = 1; i <= 20; i++)
+	{
+		lower_obj.map_[StructSample(i)] = i;
+	}
+	serialization::DataTemplate lower;
+	lower.SaveFromObject(&lower_obj, serialization::SaveFlags::None);
+	auto change = [&](auto&& edit, const uint32 keys, const uint32 removed_keys)
+	{
+		ObjSample higher_obj = lower_obj;
+		edit(higher_obj.map_);
+		serialization::DataTemplate higher;
+		higher.SaveFromObject(&higher_obj, serialization::SaveFlags::None);
+		const serialization::DataTemplate diff = serialization::DataTemplate::Diff(higher, lower);
+		Assert(keys == std::count_if(diff.tags_.begin(), diff.tags_.end(), [](const serialization::Tag tag) { return tag.IsKey(); }));
+		Assert(removed_keys == std::count_if(diff.tags_.begin(), diff.tags_.end(), [](const serialization::Tag tag) { return tag.IsRemovedKey(); }));
+
+		const serialization::DataTemplate* const layers[] = { &lower, &diff };
+		const serialization::DataTemplate merged[] = { serialization::DataTemplate::MergeLayers(layers)
+			, serialization::DataTemplate::Merge(lower, diff) };
+		for (const serialization::DataTemplate& merged_dt : merged)
+		{
+			ObjSample merged_obj;
+			merged_dt.LoadIntoObject(&merged_obj);
+			Assert(SaveToString(merged_obj) == SaveToString(higher_obj));
+		}
+		ObjSample loaded_obj;
+		lower.LoadIntoObject(&loaded_obj);
+		diff.LoadIntoObject(&loaded_obj);
+		Assert(SaveToString(loaded_obj) == SaveToString(higher_obj));
+	};
+	change([](auto& map) { map[StructSample(10)] = 100; }, 1, 0);
+	change([](auto& map) { map.erase(StructSample(10)); }, 1, 1);
+	change([](auto& map) { map[StructSample(0)] = 5; }, 1, 0); // all the other entries move a position
+}
+
+// Set elements are matched by value: a reordered set gives no diff, erased elements are saved as removed and erased on load
+void TestSetErase()
+{
+	ObjSets lower_obj;
+	lower_obj.set_ = { StructSample(1), StructSample(2), StructSample(3), StructSample(4) };
+	for (int32 i = 0; i < 20; i++)
+	{
+		lower_obj.hashed_.insert(i);
+	}
+	ObjSets reordered_obj;
+	reordered_obj.set_ = lower_obj.set_;
+	reordered_obj.hashed_.rehash(256);
+	for (int32 i = 19; i >= 0; i--)
+	{
+		reordered_obj.hashed_.insert(i);
+	}
+	ObjSets higher_obj = reordered_obj;
+	higher_obj.set_.erase(StructSample(2)); // the later elements move a position
+	higher_obj.set_.insert(StructSample(5));
+	higher_obj.hashed_.erase(7);
+
+	serialization::DataTemplate lower;
+	lower.SaveFromObject(&lower_obj, serialization::SaveFlags::None);
+	serialization::DataTemplate reordered;
+	reordered.SaveFromObject(&reordered_obj, serialization::SaveFlags::None);
+	serialization::DataTemplate higher;
+	higher.SaveFromObject(&higher_obj, serialization::SaveFlags::None);
+	Assert(serialization::DataTemplate::Diff(reordered, lower).tags_.empty());
+	const serialization::DataTemplate diff = serialization::DataTemplate::Diff(higher, lower);
+	auto same_as_higher = [&higher_obj](const ObjSets& other)
+	{
+		return (other.hashed_ == higher_obj.hashed_) && std::equal(other.set_.begin(), other.set_.end()
+			, higher_obj.set_.begin(), higher_obj.set_.end(), [](const StructSample& a, const StructSample& b) { return a.integer_ == b.integer_; });
+	};
+
+	const serialization::DataTemplate* const layers[] = { &lower, &diff };
+	const serialization::DataTemplate merged[] = { serialization::DataTemplate::MergeLayers(layers)
+		, serialization::DataTemplate::Merge(lower, diff) };
+	for (const serialization::DataTemplate& merged_dt : merged)
+	{
+		ObjSets merged_obj;
+		merged_dt.LoadIntoObject(&merged_obj);
+		Assert(same_as_higher(merged_obj));
+	}
+	ObjSets loaded_obj;
+	lower.LoadIntoObject(&loaded_obj);
+	diff.LoadIntoObject(&loaded_obj);
+	Assert(same_as_higher(loaded_obj));
+	ObjSets typed_obj = lower_obj;
+	serialization::LoadIntoObject(diff, typed_obj);
+	Assert(same_as_higher(typed_obj));
+}
+
+// The batch refresh skips the templates saved for the current layout, the ones of an unknown layout are migrated
+void TestRefreshSkipsCurrentLayout()
+{
+	ObjSample obj;
+	obj.string_ = "layout";
+	obj.vec_.emplace_back(StructSample(4));
+	const auto struct_id = ObjSample::StaticGetReflectionStructureID();
+	serialization::DataTemplate saved;
+	saved.SaveFromObject(&obj, serialization::SaveFlags::None);
+	Assert(saved.IsLayoutCurrent(struct_id));
+
+	serialization::DataTemplate current = saved;
+	serialization::DataTemplate unknown = saved;
+	unknown.layout_hash_ = 0;
+	const std::pair<serialization::DataTemplate*, reflection::StructID> batch[] = { { &current, struct_id }, { &unknown, struct_id } };
+	serialization::DataTemplate::RefreshManyAfterLayoutChanged(batch);
+	Assert(current.tags_.IsSharedWith(saved.tags_)); // nothing copied
+	Assert(!unknown.tags_.IsSharedWith(saved.tags_) && unknown.IsLayoutCurrent(struct_id));
+	Assert((current.ToString() == saved.ToString()) && (unknown.ToString() == saved.ToString()));
+
+	ObjSample loaded;
+	unknown.LoadIntoObject(&loaded);
+	Assert(SaveToString(loaded) == SaveToString(obj));
+}
+
+// A migration plan replayed on templates of the same shape gives what a refresh of each template gives
+void TestRefreshReplay()
+{
+	const auto struct_id = ObjSample::StaticGetReflectionStructureID();
+	ObjSample objects[4];
+	const char* const strings[] = { "a", "moves the data after it", "", "other shape" };
+	for (uint32 idx = 0; idx < 4; idx++)
+	{
+		objects[idx].string_ = strings[idx];
+		objects[idx].vec_.emplace_back(StructSample(idx));
+		objects[idx].map_[StructSample(idx)] = idx;
+	}
+	objects[3].vec_.emplace_back(StructSample(5)); // the other ones differ only in the data offsets, they share a plan
+
+	std::vector<serialization::DataTemplate> replayed(4);
+	std::vector<serialization::DataTemplate> refreshed(4);
+	std::vector<std::pair<serialization::DataTemplate*, reflection::StructID>> batch;
+	for (uint32 idx = 0; idx < 4; idx++)
+	{
+		replayed[idx].SaveFromObject(&objects[idx], serialization::SaveFlags::None);
+		replayed[idx].layout_hash_ = 0; // made for an unknown layout
+		refreshed[idx] = replayed[idx].Clone();
+		refreshed[idx].RefreshAfterLayoutChanged(struct_id);
+		batch.emplace_back(&replayed[idx], struct_id);
+	}
+	serialization::DataTemplate::RefreshManyAfterLayoutChanged(batch);
+	for (uint32 idx = 0; idx < 4; idx++)
+	{
+		Assert((replayed[idx] == refreshed[idx]) && replayed[idx].IsLayoutCurrent(struct_id));
+		ObjSample loaded;
+		replayed[idx].LoadIntoObject(&loaded);
+		Assert(SaveToString(loaded) == SaveToString(objects[idx]));
+	}
+}
+
+// The least recently used templates are dropped above the budget, reloaded archives drop the templates built from them
+void TestMergedTemplateCache()
+{
+	ObjSample obj;
+	obj.string_ = "cached";
+	serialization::DataTemplate data_template;
+	data_template.SaveFromObject(&obj, serialization::SaveFlags::None);
+	uint32 merges = 0;
+	auto merge = [&]() { merges++; return data_template; };
+	// archive 1 is based on archive 2
+	const asset::MergedTemplateCache::Dependency version_1[] = { { 1, 1 }, { 2, 1 } };
+	const asset::MergedTemplateCache::Dependency version_2[] = { { 1, 1 }, { 2, 2 } };
+
+	asset::MergedTemplateCache cache;
+	const auto first = cache.FindOrMerge({ 1, 1, 0 }, version_1, merge);
+	Assert((first == cache.FindOrMerge({ 1, 1, 0 }, version_1, merge)) && (1 == merges));
+	Assert(first->ToString() == data_template.ToString());
+
+	cache.SetBudget(cache.GetUsedMemory() * 2);
+	cache.FindOrMerge({ 1, 1, 1 }, version_1, merge);
+	cache.FindOrMerge({ 1, 1, 0 }, version_1, merge); // the object 1 is the least recently used now
+	cache.FindOrMerge({ 1, 1, 2 }, version_1, merge);
+	Assert((2 == cache.GetNum()) && (3 == merges));
+	cache.FindOrMerge({ 1, 1, 0 }, version_1, merge);
+	Assert(3 == merges);
+	cache.FindOrMerge({ 1, 1, 1 }, version_1, merge);
+	Assert(4 == merges);
+
+	cache.Invalidate(2, 2);
+	Assert(0 == cache.GetNum());
+	cache.FindOrMerge({ 1, 1, 0 }, version_1, merge);
+	Assert(0 == cache.GetNum());
+	cache.FindOrMerge({ 1, 1, 0 }, version_2, merge);
+	Assert(1 == cache.GetNum());
+	// Reloaded while merging, the result is not cached
+	cache.Clear();
+	cache.FindOrMerge({ 1, 1, 0 }, version_2, [&]()
+	{
+		cache.Invalidate(2, 3);
+		return data_template;
+	});
+	Assert(0 == cache.GetNum());
+	Assert(first->ToString() == data_template.ToString()); // alive after the cache dropped it
+}
+
 int main()
 {
+	reflection::Structure::FreezeRegistry();
+
+	TestCompiledLoad();
+	TestTypedLoad();
+	TestCompactTags();
+	TestInternedTags();
+	TestTemplateStream();
+	TestTemplateView();
+	TestStringTable();
+	TestVectorEditsGap();
+	TestDirtyMapErase();
+	TestMapDiff();
+	TestSetErase();
+	TestMergedTemplateCache();
+	TestRefreshSkipsCurrentLayout();
+	TestRefreshReplay();
+
 	std::ofstream out(fs::path("out.txt"), std::ofstream::out);
 	std::streambuf *coutbuf = std::cout.rdbuf(); //save old buf
 	std::cout.rdbuf(out.rdbuf()); //redirect std::cout to out.txt!
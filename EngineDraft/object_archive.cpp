@@ -1,8 +1,292 @@
 #include "object_archive.h"
+#include "actor.h"
 
 using namespace serialization;
 
-std::vector<game::GameObject*> ObjectArchive::CreateObjects(game::World*)
+namespace
 {
-	return {};
+	// Object ids of an archive to the objects created from it
+	class ArchiveObjectSolver : public ObjectSolver
+	{
+		std::unordered_map<ObjectID, Object*> objects_;
+		std::unordered_map<const Object*, ObjectID> ids_;
+
+	public:
+		void Add(const ObjectID object_id, Object* const obj)
+		{
+			objects_.emplace(object_id, obj);
+			ids_.emplace(obj, object_id);
+		}
+		ObjectID IdFromObject(const Object* obj) override
+		{
+			const auto it = ids_.find(obj);
+			return (it != ids_.end()) ? it->second : kNullObjectID;
+		}
+		Object* ObjectFromId(ObjectID id) override
+		{
+			const auto it = objects_.find(id);
+			return (it != objects_.end()) ? it->second : nullptr;
+		}
+	};
+
+	// Fixed part of a single object in the stream
+	struct SingleObjectRecord
+	{
+		ObjectID object_id = kWrongID;
+		AssetId base_archive_id = kWrongID64;
+		ObjectID id_in_base_archive = kWrongID;
+		uint32 schema_index = 0;
+		uint32 name_size = 0;
+		uint32 data_size = 0;
+		uint32 layout_hash = 0;	// DataTemplate::layout_hash_
+	};
+	static_assert(sizeof(SingleObjectRecord) == 10 * sizeof(uint32));
+	static_assert(std::has_unique_object_representations_v<SingleObjectRecord>); // written raw, no padding bytes
+}
+
+std::vector<game::GameObject*> ObjectArchive::CreateObjects(AssetManager& manager, game::World*)
+{
+	std::vector<std::shared_ptr<const DataTemplate>> templates;
+	std::vector<std::pair<const DataTemplate*, Object*>> batch;
+	std::vector<game::GameObject*> objects;
+	ArchiveObjectSolver solver;
+	for (uint32 idx = 0; idx < data_templates.size(); idx++)
+	{
+		std::shared_ptr<const DataTemplate> merged = GetMergedTemplate(manager, idx);
+		const Structure* const structure = merged ? Structure::TryGetStructure(merged->GetStructID()) : nullptr;
+		Object* const obj = structure ? structure->CreateObject() : nullptr;
+		game::GameObject* const game_object = Cast<game::GameObject>(obj);
+		if (!game_object)
+		{
+			delete obj;
+			continue;
+		}
+		if (!merged->IsLayoutCurrent(structure->id_))
+		{
+			auto refreshed = std::make_shared<DataTemplate>(*merged);
+			refreshed->RefreshAfterLayoutChanged(structure->id_);
+			merged = std::move(refreshed);
+		}
+		batch.emplace_back(merged.get(), obj);
+		templates.emplace_back(std::move(merged)); // alive until loaded
+		objects.push_back(game_object);
+		solver.Add(data_templates[idx].object_id_, obj);
+	}
+	DataTemplate::LoadIntoObjects(batch, &solver);
+	return objects;
+}
+
+uint32 ObjectArchive::FindObject(const ObjectID object_id) const
+{
+	for (uint32 idx = 0; idx < data_templates.size(); idx++)
+	{
+		if (data_templates[idx].object_id_ == object_id)
+			return idx;
+	}
+	return kWrongID;
+}
+
+std::shared_ptr<const DataTemplate> ObjectArchive::GetMergedTemplate(AssetManager& manager, const uint32 object_index)
+{
+	std::vector<MergedTemplateCache::Dependency> dependencies;
+	return GetMergedTemplate(manager, object_index, dependencies);
+}
+
+std::shared_ptr<const DataTemplate> ObjectArchive::GetMergedTemplate(AssetManager& manager, const uint32 object_index
+	, std::vector<MergedTemplateCache::Dependency>& dependencies)
+{
+	if (object_index >= data_templates.size())
+		return nullptr;
+	SingleObjectArchive& single = data_templates[object_index];
+	if (kWrongID64 == single.base_archive_id_)
+	{
+		// Nothing to merge, the diff is the whole template. It's not copied, the pointer shares the ownership of the archive.
+		dependencies.push_back({ asset_id_, version_ });
+		return std::shared_ptr<const DataTemplate>(weak_from_this().lock(), &single.diff_against_base_);
+	}
+
+	const std::shared_ptr<ObjectArchive> base_archive = manager.GetObjectArchive(single.base_archive_id_);
+	const uint32 base_index = base_archive ? base_archive->FindObject(single.id_in_base_archive_) : kWrongID;
+	if (kWrongID == base_index)
+		return nullptr;
+	std::vector<MergedTemplateCache::Dependency> own_dependencies{ { asset_id_, version_ } };
+	const std::shared_ptr<const DataTemplate> base = base_archive->GetMergedTemplate(manager, base_index, own_dependencies);
+	if (!base)
+		return nullptr;
+
+	// The lock is not held while merging, the base archives take their own locks
+	const MergedTemplateCache::Key key{ asset_id_, version_, object_index };
+	std::shared_ptr<const DataTemplate> merged = manager.GetMergedTemplates().FindOrMerge(key, own_dependencies, [&]()
+	{
+		const DataTemplate* const layers[] = { base.get(), &single.diff_against_base_ };
+		return DataTemplate::MergeLayers(layers);
+	});
+	dependencies.insert(dependencies.end(), own_dependencies.begin(), own_dependencies.end());
+	std::lock_guard<std::mutex> lock(memo_mutex_);
+	single.optional_merged_with_base_ = merged;
+	return merged;
+}
+
+std::vector<uint8> ObjectArchive::SingleObjectArchive::RemapStrings(const std::shared_ptr<StringTable>& archive_strings
+	, StringTable& strings) const
+{
+	const DataTemplate& dt = diff_against_base_;
+	if (!dt.strings_ || (dt.strings_ == archive_strings))
+		return {};
+	return RemapTableStrings(dt, strings);
+}
+
+void ObjectArchive::SingleObjectArchive::Save(std::ostream& os, const uint32 schema_index
+	, const std::vector<uint8>& remapped_data) const
+{
+	const std::vector<uint8>& data = remapped_data.empty() ? diff_against_base_.data_ : remapped_data;
+
+	SingleObjectRecord record;
+	record.object_id = object_id_;
+	record.base_archive_id = base_archive_id_;
+	record.id_in_base_archive = id_in_base_archive_;
+	record.schema_index = schema_index;
+	record.name_size = static_cast<uint32>(name_.size());
+	record.data_size = static_cast<uint32>(data.size());
+	record.layout_hash = diff_against_base_.layout_hash_;
+	WriteRaw(os, record);
+	WriteRaw(os, name_.data(), record.name_size);
+	WriteRaw(os, data.data(), record.data_size);
+}
+
+bool ObjectArchive::SingleObjectArchive::Load(std::istream& is, const std::streampos stream_end, const std::vector<TagList>& schemas
+	, const std::shared_ptr<StringTable>& strings)
+{
+	SingleObjectRecord record;
+	if (!ReadRaw(is, record) || (record.schema_index >= schemas.size())
+		|| !FitsInStream<uint8>(is, stream_end, uint64(record.name_size) + record.data_size))
+		return false;
+	object_id_ = record.object_id;
+	base_archive_id_ = record.base_archive_id;
+	id_in_base_archive_ = record.id_in_base_archive;
+	name_.resize(record.name_size);
+	optional_merged_with_base_.reset();
+	diff_against_base_.tags_ = schemas[record.schema_index];
+	diff_against_base_.strings_ = strings;
+	diff_against_base_.layout_hash_ = record.layout_hash;
+	auto& data = diff_against_base_.data_;
+	Assert(data.empty());
+	data.resize(record.data_size);
+	return ReadRaw(is, name_.data(), record.name_size) && ReadRaw(is, data.data(), record.data_size);
+}
+
+std::istream& serialization::operator>> (std::istream& is, ObjectArchive& arch)
+{
+	ObjectArchiveHeader header;
+	const bool valid_header = ReadRaw(is, header) && (ObjectArchiveHeader::kMagic == header.magic)
+		&& (header.version >= ObjectArchiveHeader::kMinSupportedVersion) && (header.version <= ObjectArchiveHeader::kVersion);
+	if (!valid_header)
+	{
+		is.setstate(std::ios::failbit);
+		return is;
+	}
+	arch.flags_ = Flag32<ObjectArchiveFlags>(header.flags);
+
+	// Each schema starts with its size, each object with its record
+	const std::streampos stream_end = GetStreamEnd(is);
+	if (!FitsInStream<uint32>(is, stream_end, header.schemas_num)
+		|| !FitsInStream<SingleObjectRecord>(is, stream_end, header.objects_num))
+	{
+		is.setstate(std::ios::failbit);
+		return is;
+	}
+	std::vector<TagList> schemas(header.schemas_num);
+	for (auto& schema : schemas)
+	{
+		uint32 tags_num = 0;
+		if (!ReadRaw(is, tags_num))
+			return is;
+		if (!FitsInStream<Tag>(is, stream_end, tags_num))
+		{
+			is.setstate(std::ios::failbit);
+			return is;
+		}
+		std::vector<Tag> tags(tags_num);
+		if (!ReadRaw(is, tags.data(), tags_num))
+			return is;
+		schema = TagList(std::move(tags));
+		TagSchemaPool::Get().Intern(schema);
+	}
+
+	arch.strings_.reset();
+	uint32 strings_size = 0;
+	if (!ReadRaw(is, strings_size))
+		return is;
+	if (!FitsInStream<uint8>(is, stream_end, strings_size))
+	{
+		is.setstate(std::ios::failbit);
+		return is;
+	}
+	if (strings_size)
+	{
+		std::vector<uint8> strings(strings_size);
+		if (!ReadRaw(is, strings.data(), strings_size))
+			return is;
+		arch.strings_ = std::make_shared<StringTable>(std::move(strings));
+	}
+
+	Assert(arch.data_templates.empty());
+	arch.data_templates.resize(header.objects_num);
+	for (auto& single_archive : arch.data_templates)
+	{
+		if (!single_archive.Load(is, stream_end, schemas, arch.strings_))
+		{
+			is.setstate(std::ios::failbit);
+			arch.data_templates.clear();
+			return is;
+		}
+	}
+	return is;
 }
+
+std::ostream& serialization::operator<< (std::ostream& os, const ObjectArchive& arch)
+{
+	// Identical tag lists are stored once
+	TagSchemaPool pool;
+	std::vector<TagList> schemas;
+	std::vector<uint32> schema_indices;
+	std::unordered_map<const Tag*, uint32> schema_index_by_storage;
+	for (const auto& single_archive : arch.data_templates)
+	{
+		TagList tags = single_archive.diff_against_base_.tags_;
+		pool.Intern(tags);
+		const auto it = schema_index_by_storage.emplace(tags.data(), static_cast<uint32>(schemas.size()));
+		if (it.second)
+		{
+			schemas.emplace_back(tags);
+		}
+		schema_indices.push_back(it.first->second);
+	}
+
+	// Table strings of all templates are stored once. The archive table is extended by copy, the offsets stay valid.
+	StringTable strings = arch.strings_ ? *arch.strings_ : StringTable();
+	std::vector<std::vector<uint8>> remapped_data;
+	remapped_data.reserve(arch.data_templates.size());
+	for (const auto& single_archive : arch.data_templates)
+	{
+		remapped_data.emplace_back(single_archive.RemapStrings(arch.strings_, strings));
+	}
+
+	ObjectArchiveHeader header;
+	header.flags = arch.flags_.GetRawData();
+	header.schemas_num = static_cast<uint32>(schemas.size());
+	header.objects_num = static_cast<uint32>(arch.data_templates.size());
+	WriteRaw(os, header);
+	for (const auto& schema : schemas)
+	{
+		WriteRaw(os, schema.size());
+		WriteRaw(os, schema.data(), schema.size());
+	}
+	WriteRaw(os, static_cast<uint32>(strings.GetData().size()));
+	WriteRaw(os, strings.GetData().data(), static_cast<uint32>(strings.GetData().size()));
+	for (uint32 i = 0; i < arch.data_templates.size(); i++)
+	{
+		arch.data_templates[i].Save(os, schema_indices[i], remapped_data[i]);
+	}
+	return os;
+}
\ No newline at end of file
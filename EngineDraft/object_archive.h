@@ -29,24 +29,41 @@ namespace serialization
 			ObjectID id_in_base_archive_ = kWrongID;
 
 			DataTemplate diff_against_base_;
-			DataTemplate optional_merged_with_base_;
+			// The last result of ObjectArchive::GetMergedTemplate, keeps it alive after the cache dropped it. Guarded by memo_mutex_.
+			std::shared_ptr<const DataTemplate> optional_merged_with_base_;
 
-			void Save(std::ostream& os) const
-			{
-				os << object_id_ << name_ << base_archive_id_ << id_in_base_archive_ << diff_against_base_;
-			}
-
-			void Load(std::istream& is)
-			{
-				is >> object_id_ >> name_ >> base_archive_id_ >> id_in_base_archive_ >> diff_against_base_;
-			}
+			// Data with the table strings moved to strings. Empty, when the template already uses archive_strings.
+			std::vector<uint8> RemapStrings(const std::shared_ptr<StringTable>& archive_strings, StringTable& strings) const;
+			// The tags are stored in the archive schema table. Not empty remapped_data is written instead of the data.
+			void Save(std::ostream& os, const uint32 schema_index, const std::vector<uint8>& remapped_data) const;
+			// Sizes are checked against stream_end (see GetStreamEnd)
+			bool Load(std::istream& is, const std::streampos stream_end, const std::vector<TagList>& schemas
+				, const std::shared_ptr<StringTable>& strings);
 		};
 
 		Flag32<ObjectArchiveFlags> flags_;
 		std::vector<SingleObjectArchive> data_templates;
+		// Objects are spawned from many threads, GetMergedTemplate memoizes into data_templates
+		std::mutex memo_mutex_;
+		// Optional, shared by the templates saved with SaveFlags::UseStringTable into the archive
+		std::shared_ptr<StringTable> strings_;
+
+		// Adds this archive and all base archives of the object to dependencies
+		std::shared_ptr<const DataTemplate> GetMergedTemplate(AssetManager& manager, const uint32 object_index
+			, std::vector<MergedTemplateCache::Dependency>& dependencies);
 
 	public:
-		std::vector<game::GameObject*> CreateObjects(game::World* owner);
+		// Objects created from the merged templates, the caller owns them. Pointers between objects of the archive
+		// are resolved, the other ones stay null. Objects with a missing base or of an unknown class are skipped.
+		std::vector<game::GameObject*> CreateObjects(AssetManager& manager, game::World* owner);
+
+		// Index in the archive, kWrongID if not found
+		uint32 FindObject(const ObjectID object_id) const;
+		// Template of the object with the templates of its base objects applied, memoized in the AssetManager cache.
+		// Null when a base archive is not loaded (see AssetManager::AddLoadedAsset) or a base object is missing. Thread safe.
+		// Objects without a base share their template with the archive. When the archive is not owned by a shared_ptr,
+		// the template is valid as long as the archive.
+		std::shared_ptr<const DataTemplate> GetMergedTemplate(AssetManager& manager, const uint32 object_index);
 
 		~ObjectArchive() = default;
 
@@ -54,27 +71,26 @@ namespace serialization
 		friend std::ostream& operator<< (std::ostream& os, const ObjectArchive& arch);
 	};
 
-	std::istream& operator>> (std::istream& is, ObjectArchive& arch)
-	{
-		is >> arch.flags_;
-		uint32 dt_num = 0;
-		is >> dt_num;
-		Assert(arch.data_templates.empty());
-		arch.data_templates.resize(dt_num);
-		for (uint32 i = 0; i < dt_num; i++)
-		{
-			arch.data_templates[i].Load(is);
-		}
-		return is;
-	}
-	std::ostream& operator<< (std::ostream& os, const ObjectArchive& arch)
+	// Binary stream format: the header, the schema table (per schema: uint32 tags_num and the raw 16 bytes tags),
+	// the string table (uint32 size and StringTable::GetData),
+	// then per object: SingleObjectRecord, the name and the raw data block
+	struct ObjectArchiveHeader
 	{
-		os << arch.flags_;
-		os << static_cast<uint32>(arch.data_templates.size());
-		for (uint32 i = 0; i < arch.data_templates.size(); i++)
-		{
-			arch.data_templates[i].Save(os);
-		}
-		return os;
-	}
+		static constexpr uint32 kMagic = 0x414F4445; // "EDOA"
+		static constexpr uint16 kVersion = 4;
+		static constexpr uint16 kMinSupportedVersion = kVersion; // no older version was released
+
+		uint32 magic = kMagic;
+		uint16 version = kVersion;
+		uint16 reserved = 0;
+		uint32 flags = 0;			// ObjectArchiveFlags
+		uint32 schemas_num = 0;
+		uint32 objects_num = 0;
+	};
+	static_assert(sizeof(ObjectArchiveHeader) == 5 * sizeof(uint32));
+	static_assert(std::has_unique_object_representations_v<ObjectArchiveHeader>); // written raw, no padding bytes
+
+	// On failure sets failbit of the stream
+	std::istream& operator>> (std::istream& is, ObjectArchive& arch);
+	std::ostream& operator<< (std::ostream& os, const ObjectArchive& arch);
 }
\ No newline at end of file
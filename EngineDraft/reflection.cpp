@@ -1,14 +1,115 @@
 #include "reflection.h"
 #include <sstream>
 #include <iomanip>
+#include <atomic>
+#include <mutex>
 
 REGISTER_STRUCTURE(reflection::Object);
 
 namespace reflection
 {
+	// Filled during static initialization, so it must be constant-initialized and free of constructors.
+	static std::atomic<StructureRegistration*> pending_registrations = nullptr;
+
 	class ReflectionManager
 	{
+		using FrozenTable = PerfectHashTable32<StructureRegistration*, nullptr>;
+
 		std::map<StructID, std::unique_ptr<Structure>> structures_;
+		std::map<StructID, StructureRegistration*> registrations_;
+		// Records for structures created directly, without REGISTER_STRUCTURE
+		std::vector<std::unique_ptr<StructureRegistration>> owned_registrations_;
+
+		// After Freeze lookups of already created structures only touch the current frozen table and need no lock.
+		// New registrations build a new table and publish it. A replaced table is retired, it's freed by a later rebuild
+		// that finds no reader in a lookup, so at most the tables replaced while lookups were running are kept.
+		std::atomic<const FrozenTable*> frozen_table_ = nullptr;
+		std::unique_ptr<FrozenTable> current_frozen_table_;
+		std::vector<std::unique_ptr<FrozenTable>> retired_frozen_tables_;
+		std::atomic<uint32> frozen_table_readers_ = 0;
+		// Recursive: creating a structure may create its super structure
+		std::recursive_mutex mutex_;
+
+		bool DrainPendingRegistrations()
+		{
+			StructureRegistration* registration = pending_registrations.exchange(nullptr, std::memory_order_acq_rel);
+			const bool any = nullptr != registration;
+			for (; registration; registration = registration->next_pending_)
+			{
+				const bool added = registrations_.try_emplace(registration->id_, registration).second;
+				Assert(added);
+			}
+			return any;
+		}
+
+		void RebuildFrozenTable()
+		{
+			std::vector<std::pair<uint32, StructureRegistration*>> entries;
+			entries.reserve(registrations_.size());
+			for (auto& pair : registrations_)
+			{
+				entries.emplace_back(pair.first, pair.second);
+			}
+			auto table = std::make_unique<FrozenTable>();
+			table->Build(entries);
+			// Sequentially consistent with the readers: a reader not counted yet will load the new table
+			frozen_table_.store(table.get());
+			if (current_frozen_table_)
+			{
+				retired_frozen_tables_.emplace_back(std::move(current_frozen_table_));
+			}
+			current_frozen_table_ = std::move(table);
+			if (0 == frozen_table_readers_.load())
+			{
+				retired_frozen_tables_.clear();
+			}
+		}
+
+		void Link(Structure& structure)
+		{
+			if (structure.is_linked_)
+				return;
+			structure.ancestor_ids_.clear();
+			if (kWrongID != structure.super_id_)
+			{
+				Structure* super_struct = FindLocked(structure.super_id_);
+				Assert(super_struct);
+				structure.super_ = super_struct;
+				structure.depth_ = super_struct->depth_ + 1;
+				structure.ancestor_ids_ = super_struct->ancestor_ids_;
+			}
+			structure.ancestor_ids_.push_back(structure.id_);
+			structure.is_linked_ = true;
+		}
+
+		// Creates the structure on first use. Requires mutex_.
+		Structure& Materialize(StructureRegistration& registration)
+		{
+			if (Structure* structure = registration.structure_.load(std::memory_order_acquire))
+				return *structure;
+
+			auto iter = structures_.find(registration.id_);
+			Structure& structure = (structures_.end() != iter) ? *iter->second : registration.register_func_();
+			Assert(structure.id_ == registration.id_);
+			DEBUG_ONLY(if (structure.name_.empty()) structure.name_ = registration.name_);
+			structure.create_object_func_ = registration.create_object_func_;
+			structure.BuildPropertyLookup();
+			Link(structure);
+			registration.structure_.store(&structure, std::memory_order_release);
+			return structure;
+		}
+
+		// Requires mutex_.
+		Structure* FindLocked(const StructID id)
+		{
+			if (DrainPendingRegistrations() && frozen_table_.load(std::memory_order_relaxed))
+			{
+				RebuildFrozenTable(); // slow path, plugins registered after startup
+			}
+			auto iter = registrations_.find(id);
+			return (registrations_.end() == iter) ? nullptr : &Materialize(*iter->second);
+		}
+
 	public:
 		static ReflectionManager& Get()
 		{
@@ -18,8 +119,28 @@ namespace reflection
 
 		Structure* TryGetStructure(const StructID id) 
 		{
-			auto iter = structures_.find(id);
-			return (structures_.end() == iter) ? nullptr : iter->second.get();
+			StructureRegistration* registration = nullptr;
+			frozen_table_readers_.fetch_add(1);
+			const FrozenTable* frozen_table = frozen_table_.load();
+			if (frozen_table)
+			{
+				registration = frozen_table->Find(id);
+			}
+			frozen_table_readers_.fetch_sub(1, std::memory_order_release);
+			if (frozen_table)
+			{
+				if (registration)
+				{
+					if (Structure* structure = registration->structure_.load(std::memory_order_acquire))
+						return structure;
+				}
+				else if (nullptr == pending_registrations.load(std::memory_order_acquire))
+				{
+					return nullptr;
+				}
+			}
+			std::lock_guard<std::recursive_mutex> lock(mutex_);
+			return FindLocked(id);
 		}
 
 		Structure& GetStructure(const StructID id) 
@@ -34,13 +155,45 @@ namespace reflection
 			Assert(nullptr != struct_ptr);
 			const auto id = struct_ptr->id_;
 			Assert(kWrongID != id);
+			std::lock_guard<std::recursive_mutex> lock(mutex_);
 			Assert(structures_.find(struct_ptr->id_) == structures_.end());
 			auto result = structures_.try_emplace(id, std::unique_ptr<Structure>(struct_ptr));
 			Assert(result.second);
+
+			bool table_outdated = DrainPendingRegistrations();
+			if (registrations_.find(id) == registrations_.end())
+			{
+				auto registration = std::make_unique<StructureRegistration>(id, nullptr);
+				registrations_.emplace(id, registration.get());
+				owned_registrations_.emplace_back(std::move(registration));
+				table_outdated = true;
+			}
+			if (table_outdated && frozen_table_.load(std::memory_order_relaxed))
+			{
+				RebuildFrozenTable();
+			}
 			return *(result.first->second);
 		}
+
+		void Freeze()
+		{
+			std::lock_guard<std::recursive_mutex> lock(mutex_);
+			DrainPendingRegistrations();
+			RebuildFrozenTable();
+		}
 	};
 
+	void Structure::DeferRegistration(StructureRegistration& registration)
+	{
+		Assert(nullptr == registration.structure_.load(std::memory_order_relaxed));
+		StructureRegistration* head = pending_registrations.load(std::memory_order_relaxed);
+		do
+		{
+			registration.next_pending_ = head;
+		} while (!pending_registrations.compare_exchange_weak(head, &registration
+			, std::memory_order_release, std::memory_order_relaxed));
+	}
+
 	Structure& Structure::CreateStructure(const StructID id, const uint32 size, const StructID super_id)
 	{
 		return ReflectionManager::Get().RegisterStructure(new Structure(id, size, super_id));
@@ -56,13 +209,52 @@ namespace reflection
 		return ReflectionManager::Get().TryGetStructure(id);
 	}
 
+	void Structure::FreezeRegistry()
+	{
+		ReflectionManager::Get().Freeze();
+	}
+
+	uint32 Structure::GetLayoutHash() const
+	{
+		const uint32 cached_hash = layout_hash_.load(std::memory_order_acquire);
+		if (cached_hash)
+			return cached_hash;
+
+		uint32 hash = HashUint32(size_, HashUint32(id_));
+		if (const Structure* super_struct = TryGetSuperStructure())
+		{
+			hash = HashUint32(super_struct->GetLayoutHash(), hash);
+		}
+		for (PropertyIndex idx = 0; idx < num_properties_; idx++)
+		{
+			const Property& property = properties_[idx];
+			const EPropertyUsage usage = property.GetPropertyUsage();
+			hash = HashUint32(static_cast<uint32>(usage), hash);
+			hash = HashUint32(static_cast<uint32>(property.GetFieldType()), hash);
+			if (EPropertyUsage::Handler == usage)
+				continue;
+			hash = HashUint32(property.GetPropertyID(), hash);
+			hash = HashUint32(property.GetFieldOffset(), hash);
+			switch (property.GetFieldType())
+			{
+			case MemberFieldType::Array:	hash = HashUint32(property.GetArraySize(), hash);		break;
+			case MemberFieldType::ObjectPtr:hash = HashUint32(property.GetOptionalStructID(), hash); break;
+			case MemberFieldType::Struct:
+				hash = HashUint32(GetStructure(property.GetOptionalStructID()).GetLayoutHash(), hash);	break;
+			}
+		}
+		hash = hash ? hash : 1;
+		layout_hash_.store(hash, std::memory_order_release);
+		return hash;
+	}
+
 	bool Structure::Validate() const
 	{
 		if (RepresentsObjectClass() == RepresentNonObjectStructure())
 			return false;
 
 		uint32 prev_index = 0;
-		for (uint32 property_idx = 1; property_idx < properties_.size(); property_idx++)
+		for (uint32 property_idx = 1; property_idx < num_properties_; property_idx++)
 		{
 			const Property& curr = properties_[property_idx];
 			if (EPropertyUsage::Main == curr.GetPropertyUsage())
@@ -72,7 +264,7 @@ namespace reflection
 				if (!proper_order) 
 					return false;
 
-				if(property_idx != NextPropertyIndexOnThisLevel(prev_index))
+				if(property_idx != ComputeNextPropertyIndexOnThisLevel(prev_index))
 					return false;
 
 				prev_index = property_idx;
@@ -81,6 +273,31 @@ namespace reflection
 		return true;
 	}
 
+	void Structure::BuildPropertyLookup()
+	{
+		const uint32 num = GetNumberOfProperties();
+		std::vector<std::pair<uint32, PropertyIndex>> main_entries;
+		next_property_index_on_this_level_.assign(num, kWrongID);
+		owner_main_property_index_.assign(num, kWrongID);
+		PropertyIndex owner_main_index = kWrongID;
+		for (PropertyIndex idx = 0; idx < num; idx++)
+		{
+			const Property& property = properties_[idx];
+			const EPropertyUsage usage = property.GetPropertyUsage();
+			if (EPropertyUsage::Main == usage)
+			{
+				owner_main_index = idx;
+				main_entries.emplace_back(property.GetPropertyID(), idx);
+			}
+			owner_main_property_index_[idx] = owner_main_index;
+			next_property_index_on_this_level_[idx] = (EPropertyUsage::Handler == usage)
+				? (idx + 1)
+				: ComputeNextPropertyIndexOnThisLevel(idx);
+		}
+		main_property_index_by_id_.Build(main_entries);
+		Assert(IsPropertyLookupBuilt());
+	}
+
 	std::string Property::ToString() const
 	{
 		std::stringstream str;
@@ -133,6 +350,7 @@ namespace reflection
 			case MemberFieldType::Vector: return "Vector";
 			case MemberFieldType::Map: return "Map";
 			case MemberFieldType::Array: return "Array";
+			case MemberFieldType::Set: return "Set";
 		}
 		return "error";
 	}
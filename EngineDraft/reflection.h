@@ -4,8 +4,15 @@
 #include <string>
 #include <memory>
 #include <array>
+#include <atomic>
+#include <tuple>
 #include "utils.h"
 
+namespace serialization
+{
+	struct StructureProgram;
+}
+
 namespace reflection
 {
 	enum class MemberFieldType : uint32
@@ -26,6 +33,7 @@ namespace reflection
 		Vector,	// requires one handler and one sub-type 
 		Map,		// requires one handler and two sub-types
 		Array,		// requires one sub-type and size
+		Set,		// requires one handler and one sub-type
 		//WeakPtr, AssetPtr, etc...
 		__NUM
 	};
@@ -64,32 +72,92 @@ namespace reflection
 		Array_Element,
 		Vector_Element,
 		Key,
-		Map_Value
+		Map_Value,
+		Set_Element
 	};
 
 	struct IPropertyHandler
 	{
-		typedef void(*TCreateHandler)(uint8*);
 		virtual ~IPropertyHandler() = default;
 	};
 
+	// Opaque iteration state for node based containers, the handler keeps its native iterator inside (no allocation).
+	struct HandlerCursor
+	{
+		alignas(void*) uint8 storage_[4 * sizeof(void*)];
+		void (*destroy_)(HandlerCursor&) = nullptr;	// set by Begin, checked iterators are not trivial
+
+		void Reset()
+		{
+			if (destroy_)
+			{
+				destroy_(*this);
+				destroy_ = nullptr;
+			}
+		}
+
+		HandlerCursor() = default;
+		HandlerCursor(const HandlerCursor&) = delete;
+		HandlerCursor& operator=(const HandlerCursor&) = delete;
+		~HandlerCursor() { Reset(); }
+	};
+
 	struct IVectorHandler : public IPropertyHandler
 	{
 		virtual uint32 GetSize(const uint8*) const = 0;
 		virtual uint8* GetElement(uint8*, uint32) const = 0; // will resize
 		virtual void SetSize(uint8*, uint32) const = 0;
 		virtual const uint8* GetElement(const uint8*, uint32) const = 0;
+		// Element i is moved from sources[i]. kWrongID, or an index past the size, gives a default element.
+		virtual void Rearrange(uint8*, const std::vector<uint32>& sources) const = 0;
+		// A default element in temporary memory, it must be destroyed with DestroyElementMemory
+		virtual void InitializeElementMemory(std::vector<uint8>& element_mem) const = 0;
+		virtual void DestroyElementMemory(std::vector<uint8>& element_mem) const = 0;
+
+		// Contiguous element storage, valid only for trivially copyable elements
+		virtual bool IsTriviallyCopyable() const = 0;
+		virtual const uint8* GetData(const uint8*) const = 0;
+		virtual uint8* GetData(uint8*) const = 0;
 	};
 
 	struct IMapHandler : public IPropertyHandler
 	{
+		using Cursor = HandlerCursor;
+
 		virtual uint32 GetSize(const uint8*) const = 0;
-		virtual const uint8* GetKey(const uint8* map, uint32 key_index) const = 0;
-		virtual const uint8* GetValue(const uint8* map, uint32) const = 0;
+		// for (handler.Begin(map, cursor); handler.IsValid(map, cursor); handler.Next(cursor))
+		virtual void Begin(const uint8* map, Cursor& cursor) const = 0;
+		virtual bool IsValid(const uint8* map, const Cursor& cursor) const = 0;
+		virtual void Next(Cursor& cursor) const = 0;
+		virtual const uint8* GetKey(const Cursor& cursor) const = 0;
+		virtual const uint8* GetValue(const Cursor& cursor) const = 0;
 
 		//we want no "struct on scope" - this is a workaround
 		virtual void InitializeKeyMemory(std::vector<uint8>& key_mem) const = 0;
 		virtual uint8* Add(uint8* map, std::vector<uint8>& key_mem) const = 0;
+		virtual void Remove(uint8* map, std::vector<uint8>& key_mem) const = 0;
+		// Does Add keep the addresses of the values already in the map?
+		virtual bool HasStableValues() const = 0;
+		// A value loaded before its key can be added, it's moved in together with the key
+		virtual void InitializeValueMemory(std::vector<uint8>& value_mem) const = 0;
+		virtual void Add(uint8* map, std::vector<uint8>& key_mem, std::vector<uint8>& value_mem) const = 0;
+	};
+
+	struct ISetHandler : public IPropertyHandler
+	{
+		using Cursor = HandlerCursor;
+
+		virtual uint32 GetSize(const uint8*) const = 0;
+		// for (handler.Begin(set, cursor); handler.IsValid(set, cursor); handler.Next(cursor))
+		virtual void Begin(const uint8* set, Cursor& cursor) const = 0;
+		virtual bool IsValid(const uint8* set, const Cursor& cursor) const = 0;
+		virtual void Next(Cursor& cursor) const = 0;
+		virtual const uint8* GetElement(const Cursor& cursor) const = 0;
+
+		// Elements are immutable in the set, so they are loaded into temporary memory and moved in
+		virtual void InitializeElementMemory(std::vector<uint8>& element_mem) const = 0;
+		virtual void Add(uint8* set, std::vector<uint8>& element_mem) const = 0;
+		virtual void Remove(uint8* set, std::vector<uint8>& element_mem) const = 0;
 	};
 
 	class Property
@@ -99,41 +167,35 @@ namespace reflection
 		uint8 type_			: 5;	//MemberFieldType
 		uint8 constant_		: 1;	//ConstSpecifier
 		uint8 access_		: 2;	//AccessSpecifier
-		std::array<uint8, 8> handler_data_;
-		static_assert(sizeof(std::array<uint8, 8>) == (sizeof(PropertyID) + sizeof(StructID)));
-
-		PropertyID& PropertyIDRef()
+		union
 		{
-			Assert(kHandlerOffsetValue != offset_);
-			return *reinterpret_cast<PropertyID*>(&handler_data_[0]);
-		}
-		const PropertyID& PropertyIDRef() const
-		{
-			Assert(kHandlerOffsetValue != offset_);
-			return *reinterpret_cast<const PropertyID*>(&handler_data_[0]);
-		}
-		StructID& StructIdOrArraySizeRef()
-		{
-			Assert(kHandlerOffsetValue != offset_);
-			return *reinterpret_cast<StructID*>(&handler_data_[sizeof(PropertyID)]);
-		}
+			struct
+			{
+				PropertyID property_id_;
+				StructID struct_id_or_array_size_;
+			} ids_;
+			const IPropertyHandler* handler_; // static instance, for handler properties
+		};
+		uint32 native_size_ = 0;			// sizeof the native field, 0 for handlers
+		uint8 native_alignment_ = 0;		// alignof the native field, 0 for handlers
+
 		const StructID& StructIdOrArraySizeRef() const
 		{
 			Assert(kHandlerOffsetValue != offset_);
-			return *reinterpret_cast<const StructID*>(&handler_data_[sizeof(PropertyID)]);
+			return ids_.struct_id_or_array_size_;
 		}
 
 		static const uint16 kHandlerOffsetValue = 0xFFFF;
 		static const uint16 kSubtypeOffsetValue = 0xFFFE;
 	public:
-		DEBUG_ONLY(std::string name_);
+		DEBUG_ONLY(const char* name_ = "");
 		std::string GetName() const
 		{
 			DEBUG_ONLY(return name_);
 		}
 		std::string ToString() const;
 
-		EPropertyUsage	GetPropertyUsage()		const 
+		constexpr EPropertyUsage GetPropertyUsage() const 
 		{ 
 			switch (offset_)
 			{
@@ -143,11 +205,17 @@ namespace reflection
 			return EPropertyUsage::Main;
 		}
 		uint32			GetFieldOffset()		const { return offset_; }
-		PropertyID		GetPropertyID()			const { return PropertyIDRef(); }
+		PropertyID		GetPropertyID()			const 
+		{ 
+			Assert(kHandlerOffsetValue != offset_);
+			return ids_.property_id_;
+		}
 		MemberFieldType GetFieldType()			const { return static_cast<MemberFieldType>(type_); }
 		ConstSpecifier	GetConstSpecifier()		const { return static_cast<ConstSpecifier>(constant_); }
 		AccessSpecifier GetAccessSpecifier()	const { return static_cast<AccessSpecifier>(access_); }
 		uint8			GetFlags()				const { return flags_; }
+		uint32			GetNativeSize()			const { return native_size_; }
+		uint32			GetNativeAlignment()	const { return native_alignment_; }
 		uint32			GetArraySize()			const 
 		{ 
 			Assert(MemberFieldType::Array == GetFieldType()); 
@@ -166,63 +234,91 @@ namespace reflection
 		{
 			Assert(EPropertyUsage::Handler == GetPropertyUsage());
 			Assert(MemberFieldType::Map == GetFieldType());
-			return *reinterpret_cast<const IMapHandler*>(handler_data_.data());
+			return *static_cast<const IMapHandler*>(handler_);
 		}
 		const IVectorHandler&	GetVectorHandler()			const
 		{
 			Assert(EPropertyUsage::Handler == GetPropertyUsage());
 			Assert(MemberFieldType::Vector == GetFieldType());
-			return *reinterpret_cast<const IVectorHandler*>(handler_data_.data());
+			return *static_cast<const IVectorHandler*>(handler_);
+		}
+		const ISetHandler&	GetSetHandler()			const
+		{
+			Assert(EPropertyUsage::Handler == GetPropertyUsage());
+			Assert(MemberFieldType::Set == GetFieldType());
+			return *static_cast<const ISetHandler*>(handler_);
 		}
 
 	public:
-		Property(uint16 offset, MemberFieldType type, ConstSpecifier constant, AccessSpecifier access
-			, PropertyID property_id, uint8 flags, StructID optional_struct_id_or_num = kWrongID)
+		// All constructors are constexpr, so property tables can be generated at compile time
+		constexpr Property()
+			: type_(0)
+			, constant_(0)
+			, access_(0)
+			, ids_{ kWrongID, kWrongID }
+		{}
+
+		constexpr Property(uint16 offset, MemberFieldType type, ConstSpecifier constant, AccessSpecifier access
+			, PropertyID property_id, uint8 flags, uint32 native_size, uint32 native_alignment
+			, StructID optional_struct_id_or_num = kWrongID)
 			: offset_(offset)
 			, flags_(flags)
 			, type_(static_cast<uint8>(type))
 			, constant_(static_cast<uint8>(constant))
 			, access_(static_cast<uint8>(access))
+			, ids_{ property_id, optional_struct_id_or_num }
+			, native_size_(native_size)
+			, native_alignment_(static_cast<uint8>(native_alignment))
 		{
-			PropertyIDRef() = property_id;
-			StructIdOrArraySizeRef() = optional_struct_id_or_num;
+			Assert(FitsInBits(native_alignment, 8));
 			Assert(EPropertyUsage::Main == GetPropertyUsage());
 		}
 
-		Property(MemberFieldType type, PropertyID property_id, StructID optional_struct_id_or_num = kWrongID)
+		constexpr Property(MemberFieldType type, PropertyID property_id, uint32 native_size, uint32 native_alignment
+			, StructID optional_struct_id_or_num = kWrongID)
 			: offset_(kSubtypeOffsetValue)
 			, type_(static_cast<uint8>(type))
 			, constant_(0) 
 			, access_(0)
+			, ids_{ property_id, optional_struct_id_or_num }
+			, native_size_(native_size)
+			, native_alignment_(static_cast<uint8>(native_alignment))
 		{
-			PropertyIDRef() = property_id;
-			StructIdOrArraySizeRef() = optional_struct_id_or_num;
+			Assert(FitsInBits(native_alignment, 8));
 			Assert(EPropertyUsage::SubType == GetPropertyUsage());
 		}
 
-		Property(MemberFieldType type, IPropertyHandler::TCreateHandler create_func)
-			: type_(static_cast<uint8>(type))
+		constexpr Property(MemberFieldType type, const IPropertyHandler* handler)
+			: offset_(kHandlerOffsetValue)
+			, type_(static_cast<uint8>(type))
 			, constant_(0)
 			, access_(0)
-			, offset_(kHandlerOffsetValue)
-		{
-			create_func(handler_data_.data());
-		}
-
-		Property(const Property& other) = default;
-		Property& operator=(const Property& other) = default;
-		Property(Property&& other) = default;
-		Property& operator=(Property&& other) = default;
-		~Property()
-		{
-			if (EPropertyUsage::Handler == GetPropertyUsage())
-			{
-				reinterpret_cast<IPropertyHandler*>(handler_data_.data())->~IPropertyHandler();
-			}
-		}
+			, handler_(handler)
+		{}
 	};
 
 	class Object;
+	struct Structure;
+
+	// Static registration record. It is linked during static initialization without touching the registry,
+	// register_func_ runs when the structure is looked up for the first time.
+	struct StructureRegistration
+	{
+		using TRegisterFunc = Structure& (*)();
+		using TCreateObjectFunc = Object* (*)();
+
+		const StructID id_;
+		const TRegisterFunc register_func_;
+		const TCreateObjectFunc create_object_func_;	// null for structures that are not objects
+		DEBUG_ONLY(const char* name_ = "");
+		std::atomic<Structure*> structure_ = nullptr;
+		StructureRegistration* next_pending_ = nullptr;
+
+		StructureRegistration(const StructID id, const TRegisterFunc register_func, const TCreateObjectFunc create_object_func = nullptr)
+			: id_(id), register_func_(register_func), create_object_func_(create_object_func)
+		{}
+	};
+
 	struct Structure
 	{
 		const StructID id_;
@@ -230,7 +326,52 @@ namespace reflection
 		const StructID super_id_;
 
 	private:
-		std::vector<Property> properties_; //sorted by offset of main prop
+		// Either a static table generated at compile time, or owned_properties_
+		const Property* properties_ = nullptr; //sorted by offset of main prop
+		uint32 num_properties_ = 0;
+		std::vector<Property> owned_properties_;
+
+		// Lookup tables, built once by BuildPropertyLookup after all properties were added
+		PerfectHashTable32<PropertyIndex, kWrongID> main_property_index_by_id_;
+		std::vector<PropertyIndex> next_property_index_on_this_level_;
+		std::vector<PropertyIndex> owner_main_property_index_;
+
+		PropertyIndex ComputeNextPropertyIndexOnThisLevel(PropertyIndex idx) const
+		{
+			uint32 properties_to_consume = 1;
+			while (properties_to_consume)
+			{
+				properties_to_consume--;
+				const auto& prop = properties_[idx];
+				switch (prop.GetFieldType())
+				{
+				case MemberFieldType::Array:			properties_to_consume += 1; break;
+				case MemberFieldType::Vector:	idx++;	properties_to_consume += 1; break;
+				case MemberFieldType::Map:		idx++;	properties_to_consume += 2; break;
+				case MemberFieldType::Set:		idx++;	properties_to_consume += 1; break;
+				}
+				idx++;
+			}
+			return idx;
+		}
+
+		// Hierarchy cache, filled when the structure is linked by the registry
+		bool is_linked_ = false;
+		uint32 depth_ = 0;							// 0 for root structures
+		const Structure* super_ = nullptr;
+		std::vector<StructID> ancestor_ids_;		// root first, ancestor_ids_[depth_] == id_
+		friend class ReflectionManager;
+
+		StructureRegistration::TCreateObjectFunc create_object_func_ = nullptr;
+
+		// Flattened serialization program, compiled lazily and owned by the serialization module
+		mutable std::atomic<const serialization::StructureProgram*> serialization_program_ = nullptr;
+		mutable std::atomic<uint32> layout_hash_ = 0;	// 0 - not computed yet
+
+		bool IsPropertyLookupBuilt() const
+		{
+			return next_property_index_on_this_level_.size() == num_properties_;
+		}
 
 		Structure(const StructID id, const uint32 size, const StructID super_id = kWrongID)
 			: id_(id), size_(size), super_id_(super_id)
@@ -246,45 +387,84 @@ namespace reflection
 		static Structure& CreateStructure(const StructID id, const uint32 size, const StructID super_id = kWrongID);
 		static const Structure& GetStructure(const StructID id);
 		static const Structure* TryGetStructure(const StructID id);
+		// Call once static registration is done. Afterwards lookups of already created structures are lock-free O(1).
+		static void FreezeRegistry();
+		// The structure is created on its first lookup
+		static void DeferRegistration(StructureRegistration& registration);
 
 		bool IsBasedOn(const StructID id) const
 		{
-			return (id_ == id)
-				? true
-				: ((super_id_ != kWrongID) ? GetStructure(super_id_).IsBasedOn(id) : false);
+			if (!is_linked_)
+			{
+				return (id_ == id)
+					? true
+					: ((super_id_ != kWrongID) ? GetStructure(super_id_).IsBasedOn(id) : false);
+			}
+			const Structure* base = TryGetStructure(id);
+			return base && IsBasedOn(*base);
+		}
+		bool IsBasedOn(const Structure& base) const
+		{
+			if (!is_linked_ || !base.is_linked_)
+				return IsBasedOn(base.id_);
+			return (base.depth_ <= depth_) && (ancestor_ids_[base.depth_] == base.id_);
+		}
+		const serialization::StructureProgram* GetSerializationProgram() const
+		{
+			return serialization_program_.load(std::memory_order_acquire);
+		}
+		// Returns the published program, it can come from a concurrent call
+		const serialization::StructureProgram* PublishSerializationProgram(const serialization::StructureProgram* program) const
+		{
+			const serialization::StructureProgram* expected = nullptr;
+			return serialization_program_.compare_exchange_strong(expected, program, std::memory_order_acq_rel)
+				? program : expected;
+		}
+		// Stable hash of the properties (ids, types, sub-types, offsets), nested structures and the super chain
+		uint32 GetLayoutHash() const;
+		// New default constructed object, null for structures registered without REGISTER_STRUCTURE or not objects
+		Object* CreateObject() const
+		{
+			return create_object_func_ ? create_object_func_() : nullptr;
 		}
 		const Structure* TryGetSuperStructure() const
 		{
+			if (is_linked_)
+				return super_;
 			return (kWrongID == super_id_) ? nullptr : TryGetStructure(super_id_);
 		}
+		uint32 GetDepth() const
+		{
+			Assert(is_linked_);
+			return depth_;
+		}
 
 	public: //ACCESS PROPERTIES
 		uint32 GetNumberOfProperties() const
 		{
-			return properties_.size();
+			return num_properties_;
 		}
 
 		void AddProperty(Property&& property)
 		{
-			properties_.emplace_back(property);
+			Assert((0 == num_properties_) || (properties_ == owned_properties_.data()));
+			owned_properties_.emplace_back(property);
+			properties_ = owned_properties_.data();
+			num_properties_ = static_cast<uint32>(owned_properties_.size());
+		}
+
+		// The table must outlive the structure (static storage)
+		void SetStaticProperties(const Property* properties, const uint32 num)
+		{
+			Assert(0 == num_properties_);
+			properties_ = properties;
+			num_properties_ = num;
 		}
 
 		PropertyIndex NextPropertyIndexOnThisLevel(PropertyIndex idx) const
 		{
-			uint32 properties_to_consume = 1;
-			while (properties_to_consume)
-			{
-				properties_to_consume--;
-				const auto& prop = properties_[idx];
-				switch (prop.GetFieldType())
-				{
-				case MemberFieldType::Array:			properties_to_consume += 1; break;
-				case MemberFieldType::Vector:	idx++;	properties_to_consume += 1; break;
-				case MemberFieldType::Map:		idx++;	properties_to_consume += 2; break;
-				}
-				idx++;
-			}
-			return idx;
+			Assert(IsPropertyLookupBuilt());
+			return next_property_index_on_this_level_[idx];
 		}
 
 		const Property& GetProperty(const PropertyIndex index) const
@@ -295,19 +475,22 @@ namespace reflection
 		const Property& GetHandlerProperty(const PropertyIndex index) const
 		{
 			const Property& p = GetProperty(index);
-			Assert((MemberFieldType::Vector == p.GetFieldType()) || (MemberFieldType::Map == p.GetFieldType()));
+			Assert((MemberFieldType::Vector == p.GetFieldType()) || (MemberFieldType::Map == p.GetFieldType())
+				|| (MemberFieldType::Set == p.GetFieldType()));
 			return GetProperty(index + 1);
 		}
 
 		PropertyIndex GetMainPropertyIndex(const PropertyID property_id) const
 		{
-			for (uint32 idx = 0; idx < properties_.size(); idx++)
-			{
-				const auto& p = properties_[idx];
-				if (EPropertyUsage::Main == p.GetPropertyUsage() && property_id == p.GetPropertyID())
-					return idx;
-			}
-			return kWrongID;
+			Assert(IsPropertyLookupBuilt());
+			return main_property_index_by_id_.Find(property_id);
+		}
+
+		// Index of the main property, that the (sub-)property belongs to
+		PropertyIndex GetOwnerMainPropertyIndex(const PropertyIndex index) const
+		{
+			Assert(IsPropertyLookupBuilt());
+			return owner_main_property_index_[index];
 		}
 
 		PropertyIndex GetSubPropertyIndex(const PropertyIndex index, const ESubType sub_type) const
@@ -326,7 +509,10 @@ namespace reflection
 					return index + 2;
 				case ESubType::Map_Value:
 					Assert(MemberFieldType::Map == p.GetFieldType());
-					return NextPropertyIndexOnThisLevel(index + 2);
+					return next_property_index_on_this_level_[index + 2];
+				case ESubType::Set_Element:
+					Assert(MemberFieldType::Set == p.GetFieldType());
+					return index + 2;
 			}
 			Assert(false);
 			return kWrongID;
@@ -336,28 +522,8 @@ namespace reflection
 		uint32 GetNativeFieldSize(const PropertyIndex property_index) const
 		{
 			const auto& property = properties_[property_index];
-			switch (property.GetFieldType())
-			{
-			case MemberFieldType::Int8:		return sizeof(int8);
-			case MemberFieldType::Int16:	return sizeof(int16);
-			case MemberFieldType::Int32:	return sizeof(int32);
-			case MemberFieldType::Int64:	return sizeof(int64);
-			case MemberFieldType::UInt8:	return sizeof(uint8);
-			case MemberFieldType::UInt16:	return sizeof(uint16);
-			case MemberFieldType::UInt32:	return sizeof(uint32);
-			case MemberFieldType::UInt64:	return sizeof(uint64);
-			case MemberFieldType::Float:	return sizeof(float);
-			case MemberFieldType::Double:	return sizeof(double);
-			case MemberFieldType::ObjectPtr:return sizeof(Object*);
-
-			case MemberFieldType::String:	return sizeof(std::string);
-			case MemberFieldType::Vector:	return sizeof(std::vector<int32>);
-			case MemberFieldType::Map:		return sizeof(std::map<int32, int32>);
-			case MemberFieldType::Struct:	return Structure::GetStructure(property.GetOptionalStructID()).size_;
-			case MemberFieldType::Array:	return property.GetArraySize() * GetNativeFieldSize(GetSubPropertyIndex(property_index, ESubType::Array_Element));
-			}
-			Assert(false);
-			return 0;
+			Assert(EPropertyUsage::Handler != property.GetPropertyUsage());
+			return property.GetNativeSize();
 		}
 
 		bool RepresentsObjectClass() const
@@ -368,16 +534,19 @@ namespace reflection
 		bool RepresentNonObjectStructure() const
 		{
 			return kWrongID == super_id_
-				&& !properties_.empty();
+				&& (0 != num_properties_);
 		}
 
 		bool Validate() const;
+
+		// Called once, when the structure is fully registered.
+		void BuildPropertyLookup();
 	};
 
 	class Object
 	{
 	public: 
-		static StructID StaticGetReflectionStructureID()
+		static constexpr StructID StaticGetReflectionStructureID()
 		{ 
 			return HashString32("Object");
 		}
@@ -395,22 +564,50 @@ namespace reflection
 		virtual ~Object() = default;
 	};
 
+	// Returns nullptr if the object is not a C.
+	template<class C> C* Cast(Object* obj)
+	{
+		if (!obj)
+			return nullptr;
+		const Structure& structure = Structure::GetStructure(obj->GetReflectionStructureID());
+		return structure.IsBasedOn(C::StaticGetReflectionStructureID()) ? static_cast<C*>(obj) : nullptr;
+	}
+
+	template<class C> const C* Cast(const Object* obj)
+	{
+		return Cast<C>(const_cast<Object*>(obj));
+	}
+
 	namespace details
 	{
+		template<class C> Object* CreateObject()
+		{
+			return new C();
+		}
+
+		template<class C> constexpr StructureRegistration::TCreateObjectFunc GetCreateObjectFunc()
+		{
+			if constexpr (std::is_base_of<Object, C>::value && std::is_default_constructible<C>::value && !std::is_abstract<C>::value)
+				return &CreateObject<C>;
+			else
+				return nullptr;
+		}
+
 		template<class C> struct RegisterStruct
 		{
+			StructureRegistration registration_;
+
 			RegisterStruct(DEBUG_ONLY(const char* name))
+				: registration_(C::StaticGetReflectionStructureID(), &C::StaticRegisterStructure, GetCreateObjectFunc<C>())
 			{
-				C::StaticRegisterStructure()DEBUG_ONLY(.name_ = name);
+				DEBUG_ONLY(registration_.name_ = name);
+				Structure::DeferRegistration(registration_);
 			}
 		};
 
 		template<typename V> struct VectorHandler : public IVectorHandler
 		{
-			static void CreateHandler(uint8* ptr)
-			{
-				new (ptr) VectorHandler<V>();
-			}
+			static const VectorHandler<V> instance;
 
 			static const V& GetVector(const uint8* vec_ptr)
 			{
@@ -449,44 +646,104 @@ namespace reflection
 				return reinterpret_cast<const uint8*>(&(GetVector(vec_ptr)[element_index]));
 			}
 
+			void Rearrange(uint8* vec_ptr, const std::vector<uint32>& sources) const override
+			{
+				auto& vec = GetVector(vec_ptr);
+				V rearranged(sources.size());
+				for (uint32 idx = 0; idx < sources.size(); idx++)
+				{
+					if (sources[idx] < vec.size())
+					{
+						rearranged[idx] = std::move(vec[sources[idx]]);
+					}
+				}
+				vec.swap(rearranged);
+			}
+
+			void InitializeElementMemory(std::vector<uint8>& element_mem) const override
+			{
+				using TElement = typename V::value_type;
+				element_mem.resize(sizeof(TElement));
+				new (element_mem.data()) TElement();
+			}
+
+			void DestroyElementMemory(std::vector<uint8>& element_mem) const override
+			{
+				using TElement = typename V::value_type;
+				reinterpret_cast<TElement*>(element_mem.data())->~TElement();
+				element_mem.clear();
+			}
+
+			bool IsTriviallyCopyable() const override
+			{
+				return std::is_trivially_copyable<typename V::value_type>::value;
+			}
+
+			const uint8* GetData(const uint8* vec_ptr) const override
+			{
+				Assert(IsTriviallyCopyable());
+				return reinterpret_cast<const uint8*>(GetVector(vec_ptr).data());
+			}
+
+			uint8* GetData(uint8* vec_ptr) const override
+			{
+				Assert(IsTriviallyCopyable());
+				return reinterpret_cast<uint8*>(GetVector(vec_ptr).data());
+			}
+
 			virtual ~VectorHandler() = default;
 		};
+		template<typename V> const VectorHandler<V> VectorHandler<V>::instance;
 
 		template<class M> struct MapHandler : public IMapHandler
 		{
-			static void CreateHandler(uint8* ptr)
-			{
-				new (ptr) MapHandler<M>();
-			}
+			static const MapHandler<M> instance;
+
+			using TConstIter = typename M::const_iterator;
+			static_assert(sizeof(TConstIter) <= sizeof(Cursor::storage_), "Cursor storage is too small");
 
-			static auto GetCIter(const uint8* map_ptr, uint32 idx)
+			static const M& GetMap(const uint8* map_ptr)
 			{
 				Assert(map_ptr);
-				auto it = reinterpret_cast<const M*>(map_ptr)->begin();
-				std::advance(it, idx);
-				return it;
+				return *reinterpret_cast<const M*>(map_ptr);
 			}
 
-			static auto GetIter(uint8* map_ptr, uint32 idx)
+			static const TConstIter& GetIter(const Cursor& cursor)
 			{
-				Assert(map_ptr);
-				auto it = reinterpret_cast<M*>(map_ptr)->begin();
-				std::advance(it, idx);
-				return it;
+				return *reinterpret_cast<const TConstIter*>(cursor.storage_);
 			}
 
 			uint32 GetSize(const uint8* map_ptr) const override
 			{
-				return reinterpret_cast<const M*>(map_ptr)->size();
+				return GetMap(map_ptr).size();
 			}
 
-			const uint8* GetKey(const uint8* map_ptr, uint32 index) const override
+			static void DestroyIter(Cursor& cursor)
+			{
+				reinterpret_cast<TConstIter*>(cursor.storage_)->~TConstIter();
+			}
+
+			void Begin(const uint8* map_ptr, Cursor& cursor) const override
+			{
+				cursor.Reset();
+				new (cursor.storage_) TConstIter(GetMap(map_ptr).begin());
+				cursor.destroy_ = &DestroyIter;
+			}
+			bool IsValid(const uint8* map_ptr, const Cursor& cursor) const override
+			{
+				return GetIter(cursor) != GetMap(map_ptr).end();
+			}
+			void Next(Cursor& cursor) const override
+			{
+				++(*reinterpret_cast<TConstIter*>(cursor.storage_));
+			}
+			const uint8* GetKey(const Cursor& cursor) const override
 			{ 
-				return reinterpret_cast<const uint8*>(&GetCIter(map_ptr, index)->first);
+				return reinterpret_cast<const uint8*>(&GetIter(cursor)->first);
 			}
-			const uint8* GetValue(const uint8* map_ptr, uint32 index) const override
+			const uint8* GetValue(const Cursor& cursor) const override
 			{ 
-				return reinterpret_cast<const uint8*>(&GetCIter(map_ptr, index)->second);
+				return reinterpret_cast<const uint8*>(&GetIter(cursor)->second);
 			}
 
 			virtual void InitializeKeyMemory(std::vector<uint8>& key_mem) const override
@@ -507,10 +764,114 @@ namespace reflection
 
 				return reinterpret_cast<uint8*>(&value_ref);
 			}
+			virtual void Remove(uint8* map_ptr, std::vector<uint8>& key_mem) const override
+			{
+				using TKey = M::key_type;
+				TKey* key_ptr = reinterpret_cast<TKey*>(key_mem.data());
+				reinterpret_cast<M*>(map_ptr)->erase(*key_ptr);
+				key_ptr->~TKey();
+				key_mem.clear();
+			}
+			virtual bool HasStableValues() const override
+			{
+				return !is_flat_map<M>::value;
+			}
+			virtual void InitializeValueMemory(std::vector<uint8>& value_mem) const override
+			{
+				value_mem.resize(sizeof(M::mapped_type));
+				new (value_mem.data()) M::mapped_type();
+			}
+			virtual void Add(uint8* map_ptr, std::vector<uint8>& key_mem, std::vector<uint8>& value_mem) const override
+			{
+				using TKey = M::key_type;
+				using TValue = M::mapped_type;
+				TKey* key_ptr = reinterpret_cast<TKey*>(key_mem.data());
+				TValue* value_ptr = reinterpret_cast<TValue*>(value_mem.data());
 
+				auto& map_ref = *reinterpret_cast<M*>(map_ptr);
+				map_ref[*key_ptr] = std::move(*value_ptr);
+
+				key_ptr->~TKey();
+				key_mem.clear();
+				value_ptr->~TValue();
+				value_mem.clear();
+			}
 
 			virtual ~MapHandler() = default;
 		};
+		template<class M> const MapHandler<M> MapHandler<M>::instance;
+
+		template<class S> struct SetHandler : public ISetHandler
+		{
+			static const SetHandler<S> instance;
+
+			using TConstIter = typename S::const_iterator;
+			using TElement = typename S::key_type;
+			static_assert(sizeof(TConstIter) <= sizeof(Cursor::storage_), "Cursor storage is too small");
+
+			static const S& GetSet(const uint8* set_ptr)
+			{
+				Assert(set_ptr);
+				return *reinterpret_cast<const S*>(set_ptr);
+			}
+
+			static const TConstIter& GetIter(const Cursor& cursor)
+			{
+				return *reinterpret_cast<const TConstIter*>(cursor.storage_);
+			}
+
+			static void DestroyIter(Cursor& cursor)
+			{
+				reinterpret_cast<TConstIter*>(cursor.storage_)->~TConstIter();
+			}
+
+			uint32 GetSize(const uint8* set_ptr) const override
+			{
+				return GetSet(set_ptr).size();
+			}
+
+			void Begin(const uint8* set_ptr, Cursor& cursor) const override
+			{
+				cursor.Reset();
+				new (cursor.storage_) TConstIter(GetSet(set_ptr).begin());
+				cursor.destroy_ = &DestroyIter;
+			}
+			bool IsValid(const uint8* set_ptr, const Cursor& cursor) const override
+			{
+				return GetIter(cursor) != GetSet(set_ptr).end();
+			}
+			void Next(Cursor& cursor) const override
+			{
+				++(*reinterpret_cast<TConstIter*>(cursor.storage_));
+			}
+			const uint8* GetElement(const Cursor& cursor) const override
+			{
+				return reinterpret_cast<const uint8*>(&*GetIter(cursor));
+			}
+
+			void InitializeElementMemory(std::vector<uint8>& element_mem) const override
+			{
+				element_mem.resize(sizeof(TElement));
+				new (element_mem.data()) TElement();
+			}
+			void Add(uint8* set_ptr, std::vector<uint8>& element_mem) const override
+			{
+				TElement* element_ptr = reinterpret_cast<TElement*>(element_mem.data());
+				reinterpret_cast<S*>(set_ptr)->insert(std::move(*element_ptr));
+				element_ptr->~TElement();
+				element_mem.clear();
+			}
+			void Remove(uint8* set_ptr, std::vector<uint8>& element_mem) const override
+			{
+				TElement* element_ptr = reinterpret_cast<TElement*>(element_mem.data());
+				reinterpret_cast<S*>(set_ptr)->erase(*element_ptr);
+				element_ptr->~TElement();
+				element_mem.clear();
+			}
+
+			virtual ~SetHandler() = default;
+		};
+		template<class S> const SetHandler<S> SetHandler<S>::instance;
 
 		template<typename M> constexpr MemberFieldType GetMemberType()
 		{
@@ -526,6 +887,8 @@ namespace reflection
 					return MemberFieldType::Vector;
 				else if constexpr (is_map<M>::value)
 					return MemberFieldType::Map;
+				else if constexpr (is_set<M>::value)
+					return MemberFieldType::Set;
 				else
 					return MemberFieldType::Struct;
 			}
@@ -542,7 +905,7 @@ namespace reflection
 		template<> constexpr MemberFieldType GetMemberType<double>() { return MemberFieldType::Double; }
 		template<> constexpr MemberFieldType GetMemberType<std::string>() { return MemberFieldType::String; }
 
-		template<typename M> StructID GetArraySizeOrStructID()
+		template<typename M> constexpr StructID GetArraySizeOrStructID()
 		{
 			StructID struct_id_or_array_size = kWrongID;
 			const constexpr MemberFieldType member_field_type = GetMemberType<M>();
@@ -560,14 +923,17 @@ namespace reflection
 
 		template<typename V> void CreateVectorHandlerProperty(Structure& structure)
 		{
-			static_assert(sizeof(VectorHandler<V>) <= 8);
-			structure.AddProperty(Property(MemberFieldType::Vector, VectorHandler<V>::CreateHandler));
+			structure.AddProperty(Property(MemberFieldType::Vector, &VectorHandler<V>::instance));
 		}
 
 		template<typename M> void CreateMapHandlerProperty(Structure& structure)
 		{
-			static_assert(sizeof(MapHandler<M>) <= 8);
-			structure.AddProperty(Property(MemberFieldType::Map, MapHandler<M>::CreateHandler));
+			structure.AddProperty(Property(MemberFieldType::Map, &MapHandler<M>::instance));
+		}
+
+		template<typename S> void CreateSetHandlerProperty(Structure& structure)
+		{
+			structure.AddProperty(Property(MemberFieldType::Set, &SetHandler<S>::instance));
 		}
 
 		template<typename M> void CreateSubTypePropertyOptional(Structure& structure, PropertyID property_id)
@@ -588,6 +954,11 @@ namespace reflection
 				CreateSubTypeProperty<M::key_type>(structure, property_id);
 				CreateSubTypeProperty<M::mapped_type>(structure, property_id);
 			}
+			else if constexpr(member_field_type == MemberFieldType::Set)
+			{
+				CreateSetHandlerProperty<M>(structure);
+				CreateSubTypeProperty<M::key_type>(structure, property_id);
+			}
 			else
 			{
 				UNREFERENCED_PARAMETER(structure);
@@ -598,22 +969,144 @@ namespace reflection
 		template<typename MOrg> void CreateSubTypeProperty(Structure& structure, PropertyID property_id)
 		{
 			using M = std::remove_cv<MOrg>::type;
-			structure.AddProperty(Property(GetMemberType<M>(), property_id, GetArraySizeOrStructID<M>()));
+			structure.AddProperty(Property(GetMemberType<M>(), property_id, sizeof(M), alignof(M)
+				, GetArraySizeOrStructID<M>()));
 			CreateSubTypePropertyOptional<M>(structure, property_id);
 		}
 
-		template<typename MOrg> void CreateProperty(Structure& structure, const char* name, uint16 offset, uint8 flags)
+		template<typename MOrg> void CreateProperty(Structure& structure, const char* name, PropertyID property_id
+			, uint16 offset, uint8 flags)
 		{
 			using M = std::remove_cv<MOrg>::type;
-			const PropertyID property_id = HashString32(name);
+			Assert(HashString32(name) == property_id);
 			Property p(offset, GetMemberType<M>()
 				, std::is_const<M>::value ? ConstSpecifier::Const : ConstSpecifier::NotConst
-				, AccessSpecifier::Public, property_id, flags, GetArraySizeOrStructID<M>());
+				, AccessSpecifier::Public, property_id, flags, sizeof(M), alignof(M), GetArraySizeOrStructID<M>());
 			DEBUG_ONLY(p.name_ = name);
 			structure.AddProperty(std::move(p));
 
 			CreateSubTypePropertyOptional<M>(structure, property_id);
 		}
+
+#pragma region Compile time property tables
+		// Describes a single reflected member, see REFLECTED_MEMBER
+		template<typename MOrg, uint16 kOffset, PropertyID kPropertyID> struct MemberDescriptor
+		{
+			using Type = typename std::remove_cv<MOrg>::type;
+			static constexpr uint16 offset = kOffset;
+			static constexpr PropertyID property_id = kPropertyID;
+			const char* name;
+		};
+
+		// Number of properties (main, handlers and sub-types) that describe a member of type M
+		template<typename M> constexpr uint32 GetNumberOfPropertiesForType()
+		{
+			const constexpr MemberFieldType member_field_type = GetMemberType<M>();
+			if constexpr(member_field_type == MemberFieldType::Array)
+				return 1 + GetNumberOfPropertiesForType<std::remove_cv_t<typename array_element<M>::type>>();
+			else if constexpr(member_field_type == MemberFieldType::Vector)
+				return 2 + GetNumberOfPropertiesForType<typename M::value_type>();
+			else if constexpr(member_field_type == MemberFieldType::Map)
+				return 2 + GetNumberOfPropertiesForType<typename M::key_type>() 
+					+ GetNumberOfPropertiesForType<typename M::mapped_type>();
+			else if constexpr(member_field_type == MemberFieldType::Set)
+				return 2 + GetNumberOfPropertiesForType<typename M::key_type>();
+			else
+				return 1;
+		}
+
+		template<typename MOrg, size_t N> constexpr void FillSubTypeProperty(std::array<Property, N>& table
+			, uint32& idx, const PropertyID property_id);
+
+		// Mirrors CreateSubTypePropertyOptional
+		template<typename M, size_t N> constexpr void FillSubTypeProperties(std::array<Property, N>& table
+			, uint32& idx, const PropertyID property_id)
+		{
+			const constexpr MemberFieldType member_field_type = GetMemberType<M>();
+			if constexpr(member_field_type == MemberFieldType::Array)
+			{
+				FillSubTypeProperty<typename array_element<M>::type>(table, idx, property_id);
+			}
+			else if constexpr(member_field_type == MemberFieldType::Vector)
+			{
+				table[idx++] = Property(MemberFieldType::Vector, &VectorHandler<M>::instance);
+				FillSubTypeProperty<typename M::value_type>(table, idx, property_id);
+			}
+			else if constexpr(member_field_type == MemberFieldType::Map)
+			{
+				table[idx++] = Property(MemberFieldType::Map, &MapHandler<M>::instance);
+				FillSubTypeProperty<typename M::key_type>(table, idx, property_id);
+				FillSubTypeProperty<typename M::mapped_type>(table, idx, property_id);
+			}
+			else if constexpr(member_field_type == MemberFieldType::Set)
+			{
+				table[idx++] = Property(MemberFieldType::Set, &SetHandler<M>::instance);
+				FillSubTypeProperty<typename M::key_type>(table, idx, property_id);
+			}
+		}
+
+		// Mirrors CreateSubTypeProperty
+		template<typename MOrg, size_t N> constexpr void FillSubTypeProperty(std::array<Property, N>& table
+			, uint32& idx, const PropertyID property_id)
+		{
+			using M = typename std::remove_cv<MOrg>::type;
+			table[idx++] = Property(GetMemberType<M>(), property_id, sizeof(M), alignof(M), GetArraySizeOrStructID<M>());
+			FillSubTypeProperties<M>(table, idx, property_id);
+		}
+
+		// Mirrors CreateProperty
+		template<typename Descriptor, size_t N> constexpr void FillMemberProperties(std::array<Property, N>& table
+			, uint32& idx, const Descriptor& descriptor)
+		{
+			using M = typename Descriptor::Type;
+			Property p(Descriptor::offset, GetMemberType<M>()
+				, std::is_const<M>::value ? ConstSpecifier::Const : ConstSpecifier::NotConst
+				, AccessSpecifier::Public, Descriptor::property_id, 0, sizeof(M), alignof(M), GetArraySizeOrStructID<M>());
+			DEBUG_ONLY(p.name_ = descriptor.name);
+			table[idx++] = p;
+			FillSubTypeProperties<M>(table, idx, Descriptor::property_id);
+		}
+
+		template<class C> constexpr uint32 GetNumberOfProperties()
+		{
+			return std::apply([](const auto&... descriptors)
+			{
+				return (0u + ... + GetNumberOfPropertiesForType<typename std::decay_t<decltype(descriptors)>::Type>());
+			}, C::StaticReflectedMembers());
+		}
+
+		template<class C> constexpr std::array<Property, GetNumberOfProperties<C>()> BuildPropertyTable()
+		{
+			std::array<Property, GetNumberOfProperties<C>()> table{};
+			uint32 idx = 0;
+			std::apply([&table, &idx](const auto&... descriptors)
+			{
+				(FillMemberProperties(table, idx, descriptors), ...);
+			}, C::StaticReflectedMembers());
+			return table;
+		}
+
+		// Read-only property table of C, generated at compile time from C::StaticReflectedMembers()
+		template<class C> struct StaticPropertyTable
+		{
+			static constexpr std::array<Property, GetNumberOfProperties<C>()> properties = BuildPropertyTable<C>();
+		};
+
+		template<class C> Structure& CreateStructureFromMembers()
+		{
+			using Super = typename C::ReflectionSuper;
+			StructID super_id = kWrongID;
+			if constexpr(!std::is_void<Super>::value)
+			{
+				super_id = Super::StaticGetReflectionStructureID();
+			}
+			auto& structure = Structure::CreateStructure(C::StaticGetReflectionStructureID(), sizeof(C), super_id);
+			const auto& table = StaticPropertyTable<C>::properties;
+			structure.SetStaticProperties(table.data(), static_cast<uint32>(table.size()));
+			Assert(structure.Validate());
+			return structure;
+		}
+#pragma endregion
 	};
 
 	const char* ToStr(MemberFieldType e);
@@ -625,12 +1118,12 @@ namespace reflection
 	const char* ToStr(EPropertyUsage e);
 }
 
-#define IMPLEMENT_VIRTUAL_REFLECTION(name) public: static reflection::StructID StaticGetReflectionStructureID() \
+#define IMPLEMENT_VIRTUAL_REFLECTION(name) public: static constexpr reflection::StructID StaticGetReflectionStructureID() \
 	{ return HashString32(#name); } \
 	reflection::StructID GetReflectionStructureID() const override \
 	{ return StaticGetReflectionStructureID(); }
 
-#define IMPLEMENT_STATIC_REFLECTION(name) public: static reflection::StructID StaticGetReflectionStructureID() \
+#define IMPLEMENT_STATIC_REFLECTION(name) public: static constexpr reflection::StructID StaticGetReflectionStructureID() \
 	{ return HashString32(#name); } \
 	static const reflection::Structure& StaticGetReflectionStructure() \
 	{ return reflection::Structure::GetStructure(StaticGetReflectionStructureID()); }
@@ -639,4 +1132,17 @@ namespace reflection
 	DEBUG_ONLY((#name));
 
 #define DEFINE_PROPERTY(struct_name, field_name) reflection::details::CreateProperty<decltype(field_name)>(structure, \
-	#field_name, offsetof(struct_name, field_name), 0)
\ No newline at end of file
+	#field_name, std::integral_constant<reflection::PropertyID, HashString32(#field_name)>::value \
+	, offsetof(struct_name, field_name), 0)
+
+// Compile time path. The class lists its members in a constexpr function:
+//	static constexpr auto StaticReflectedMembers()
+//	{ return std::make_tuple(REFLECTED_MEMBER(MyClass, a_), REFLECTED_MEMBER(MyClass, b_)); }
+// and uses IMPLEMENT_STATIC_REGISTRATION instead of writing StaticRegisterStructure by hand.
+#define REFLECTED_MEMBER(struct_name, field_name) reflection::details::MemberDescriptor< \
+	decltype(struct_name::field_name), offsetof(struct_name, field_name), HashString32(#field_name)>{ #field_name }
+
+// super is void for non-object structures
+#define IMPLEMENT_STATIC_REGISTRATION(name, super) public: using ReflectionSuper = super; \
+	static reflection::Structure& StaticRegisterStructure() \
+	{ return reflection::details::CreateStructureFromMembers<name>(); }
\ No newline at end of file
@@ -0,0 +1,313 @@
+#include "tag_codec.h"
+#include <cstring>
+
+namespace
+{
+	using namespace reflection;
+	using namespace serialization;
+
+	// Tag fields stored in the hot stream
+	struct HotTag
+	{
+		PropertyIndex property_index = 0;
+		uint32 byte_offset = 0;
+		uint32 nest_level = 0;
+		uint32 element_index = 0;
+		uint32 is_key = 0;
+		uint32 flags = 0;
+		bool super_struct = false;
+	};
+
+	constexpr uint8 kSamePropertyIdBit = 0x80; // cold stream, the property id of the previous tag is reused
+	constexpr uint32 kNestDeltaEscape = 0xF;
+
+	uint32 ZigZag(const int32 value)
+	{
+		return (static_cast<uint32>(value) << 1) ^ static_cast<uint32>(value >> 31);
+	}
+
+	int32 UnZigZag(const uint32 value)
+	{
+		return static_cast<int32>(value >> 1) ^ -static_cast<int32>(value & 1);
+	}
+
+	void WriteVarint(std::vector<uint8>& dst, uint32 value)
+	{
+		while (value >= 0x80)
+		{
+			dst.push_back(static_cast<uint8>(value | 0x80));
+			value >>= 7;
+		}
+		dst.push_back(static_cast<uint8>(value));
+	}
+
+	void WriteUInt32(std::vector<uint8>& dst, const uint32 value)
+	{
+		const uint32 dst_offset = dst.size();
+		dst.resize(dst_offset + sizeof(uint32));
+		std::memcpy(dst.data() + dst_offset, &value, sizeof(uint32));
+	}
+
+	// Bounds checked reader, any read past the end marks it as failed
+	struct ByteReader
+	{
+		const uint8* data_;
+		uint32 size_;
+		uint32 offset_;
+		bool failed_ = false;
+
+		bool CanRead(const uint32 num)
+		{
+			failed_ |= (num > size_) || (offset_ > size_ - num);
+			return !failed_;
+		}
+
+		uint8 ReadByte()
+		{
+			return CanRead(1) ? data_[offset_++] : 0;
+		}
+
+		uint32 ReadUInt32()
+		{
+			uint32 value = 0;
+			if (CanRead(sizeof(uint32)))
+			{
+				std::memcpy(&value, data_ + offset_, sizeof(uint32));
+				offset_ += sizeof(uint32);
+			}
+			return value;
+		}
+
+		uint32 ReadVarint()
+		{
+			uint32 value = 0;
+			for (uint32 shift = 0; shift < 35; shift += 7)
+			{
+				const uint8 byte = ReadByte();
+				value |= static_cast<uint32>(byte & 0x7F) << shift;
+				if (0 == (byte & 0x80))
+					return value;
+			}
+			failed_ = true;
+			return 0;
+		}
+	};
+
+	uint32 GetRootLayoutHash(const DataTemplate& dt)
+	{
+		const StructID struct_id = dt.GetStructID();
+		const Structure* structure = (kWrongID != struct_id) ? Structure::TryGetStructure(struct_id) : nullptr;
+		return structure ? structure->GetLayoutHash() : 0;
+	}
+
+	const Structure* TryGetStructureAt(const std::vector<uint8>& data, const uint32 offset)
+	{
+		if (offset + sizeof(StructID) > data.size())
+			return nullptr;
+		StructID struct_id = kWrongID;
+		std::memcpy(&struct_id, data.data() + offset, sizeof(StructID));
+		return Structure::TryGetStructure(struct_id);
+	}
+
+	// Rebuilds the redundant fields from the current structures. Fails if the tags do not fit them.
+	bool RestoreFromStructures(const std::vector<HotTag>& hot_tags, const std::vector<uint8>& data, TagList& dst)
+	{
+		std::vector<const Structure*> owners; // by nest level
+		owners.push_back(TryGetStructureAt(data, 0));
+		for (const HotTag& hot : hot_tags)
+		{
+			if ((hot.nest_level >= owners.size()) || !owners[hot.nest_level])
+				return false;
+			const Structure& owner = *owners[hot.nest_level];
+			owners.resize(hot.nest_level + 1);
+			if (hot.super_struct)
+			{
+				const Structure* super_struct = TryGetStructureAt(data, hot.byte_offset);
+				if (!super_struct || (super_struct->id_ != owner.super_id_))
+					return false;
+				dst.emplace_back(Tag(kSuperStructPropertyID, kSuperStructPropertyIndex, 0, MemberFieldType::Struct
+					, hot.byte_offset, hot.nest_level, hot.element_index, hot.is_key, hot.flags));
+				owners.push_back(super_struct);
+				continue;
+			}
+
+			if (hot.property_index >= owner.GetNumberOfProperties())
+				return false;
+			const Property& property = owner.GetProperty(hot.property_index);
+			if (EPropertyUsage::Handler == property.GetPropertyUsage())
+				return false;
+			const uint32 sub_property_offset = hot.property_index - owner.GetOwnerMainPropertyIndex(hot.property_index);
+			if (!FitsInBits(sub_property_offset, 5))
+				return false;
+			const Structure* inner_owner = &owner; // containers keep their elements in the same structure
+			if (MemberFieldType::Struct == property.GetFieldType())
+			{
+				inner_owner = TryGetStructureAt(data, hot.byte_offset);
+				if (!inner_owner || (inner_owner->id_ != property.GetOptionalStructID()))
+					return false;
+			}
+			dst.emplace_back(Tag(property.GetPropertyID(), hot.property_index, sub_property_offset, property.GetFieldType()
+				, hot.byte_offset, hot.nest_level, hot.element_index, hot.is_key, hot.flags));
+			owners.push_back(inner_owner);
+		}
+		return true;
+	}
+
+	bool RestoreFromColdStream(const std::vector<HotTag>& hot_tags, ByteReader& cold, TagList& dst)
+	{
+		PropertyID property_id = kWrongID;
+		for (const HotTag& hot : hot_tags)
+		{
+			if (hot.super_struct)
+			{
+				dst.emplace_back(Tag(kSuperStructPropertyID, kSuperStructPropertyIndex, 0, MemberFieldType::Struct
+					, hot.byte_offset, hot.nest_level, hot.element_index, hot.is_key, hot.flags));
+				continue;
+			}
+			const uint8 type_byte = cold.ReadByte();
+			const uint8 sub_property_offset = cold.ReadByte();
+			if (0 == (type_byte & kSamePropertyIdBit))
+			{
+				property_id = cold.ReadUInt32();
+			}
+			const uint32 type = type_byte & ~kSamePropertyIdBit;
+			const bool valid = !cold.failed_ && (type < static_cast<uint32>(MemberFieldType::__NUM))
+				&& FitsInBits(sub_property_offset, 5) && (kSuperStructPropertyID != property_id);
+			if (!valid)
+				return false;
+			dst.emplace_back(Tag(property_id, hot.property_index, sub_property_offset, static_cast<MemberFieldType>(type)
+				, hot.byte_offset, hot.nest_level, hot.element_index, hot.is_key, hot.flags));
+		}
+		return true;
+	}
+}
+
+void serialization::WriteCompactTags(const DataTemplate& src, std::vector<uint8>& dst)
+{
+	std::vector<uint8> hot;
+	std::vector<uint8> cold;
+	hot.reserve(src.TagNum() * 3);
+	cold.reserve(src.TagNum() * 2);
+
+	PropertyIndex prev_property_index = 0;
+	PropertyID prev_property_id = kWrongID;
+	uint32 prev_byte_offset = 0;
+	uint32 prev_nest_level = 0;
+	for (const Tag& tag : src.tags_)
+	{
+		const bool super_struct = kSuperStructPropertyIndex == tag.GetPropertyIndex();
+		const uint32 nest_delta = ZigZag(static_cast<int32>(tag.GetNestLevel() - prev_nest_level));
+		uint8 header = 0;
+		header |= tag.IsKey() ? static_cast<uint8>(ECompactTagHeader::IsKey) : 0;
+		header |= tag.GetElementIndex() ? static_cast<uint8>(ECompactTagHeader::HasElementIndex) : 0;
+		header |= tag.GetFlags() ? static_cast<uint8>(ECompactTagHeader::HasFlags) : 0;
+		header |= super_struct ? static_cast<uint8>(ECompactTagHeader::SuperStruct) : 0;
+		header |= static_cast<uint8>(std::min<uint32>(nest_delta, kNestDeltaEscape) << 4);
+		hot.push_back(header);
+		if (nest_delta >= kNestDeltaEscape)
+		{
+			WriteVarint(hot, nest_delta);
+		}
+		if (!super_struct)
+		{
+			WriteVarint(hot, ZigZag(static_cast<int32>(tag.GetPropertyIndex() - prev_property_index)));
+			prev_property_index = tag.GetPropertyIndex();
+		}
+		WriteVarint(hot, ZigZag(static_cast<int32>(tag.GetDataOffset() - prev_byte_offset)));
+		if (tag.GetElementIndex())
+		{
+			WriteVarint(hot, tag.GetElementIndex());
+		}
+		if (tag.GetFlags())
+		{
+			hot.push_back(static_cast<uint8>(tag.GetFlags()));
+		}
+		prev_byte_offset = tag.GetDataOffset();
+		prev_nest_level = tag.GetNestLevel();
+
+		if (!super_struct)
+		{
+			const bool same_property_id = tag.GetPropertyID() == prev_property_id;
+			cold.push_back(static_cast<uint8>(tag.GetFieldType()) | (same_property_id ? kSamePropertyIdBit : 0));
+			cold.push_back(static_cast<uint8>(tag.GetSubPropertyOffset()));
+			if (!same_property_id)
+			{
+				WriteUInt32(cold, tag.GetPropertyID());
+			}
+			prev_property_id = tag.GetPropertyID();
+		}
+	}
+
+	WriteVarint(dst, src.TagNum());
+	WriteUInt32(dst, src.layout_hash_); // 0 when unknown, the tags may be older than the structure, the cold stream is used then
+	WriteVarint(dst, hot.size());
+	dst.insert(dst.end(), hot.begin(), hot.end());
+	WriteVarint(dst, cold.size());
+	dst.insert(dst.end(), cold.begin(), cold.end());
+}
+
+bool serialization::ReadCompactTags(const uint8* src, const uint32 src_size, uint32& offset, DataTemplate& dst)
+{
+	Assert(dst.tags_.empty());
+	ByteReader reader{ src, src_size, offset };
+	const uint32 tags_num = reader.ReadVarint();
+	const uint32 layout_hash = reader.ReadUInt32();
+	const uint32 hot_size = reader.ReadVarint();
+	if (!reader.CanRead(hot_size) || (tags_num > hot_size / 2)) // at least 2 bytes per tag
+		return false;
+	ByteReader hot{ src, reader.offset_ + hot_size, reader.offset_ };
+	reader.offset_ += hot_size;
+	const uint32 cold_size = reader.ReadVarint();
+	if (!reader.CanRead(cold_size))
+		return false;
+	ByteReader cold{ src, reader.offset_ + cold_size, reader.offset_ };
+	reader.offset_ += cold_size;
+
+	std::vector<HotTag> hot_tags(tags_num);
+	PropertyIndex property_index = 0;
+	uint32 byte_offset = 0;
+	uint32 nest_level = 0;
+	for (HotTag& hot_tag : hot_tags)
+	{
+		const uint8 header = hot.ReadByte();
+		uint32 nest_delta = header >> 4;
+		if (kNestDeltaEscape == nest_delta)
+		{
+			nest_delta = hot.ReadVarint();
+		}
+		nest_level += UnZigZag(nest_delta);
+		hot_tag.super_struct = 0 != (header & static_cast<uint8>(ECompactTagHeader::SuperStruct));
+		if (!hot_tag.super_struct)
+		{
+			property_index += UnZigZag(hot.ReadVarint());
+		}
+		byte_offset += UnZigZag(hot.ReadVarint());
+		hot_tag.property_index = hot_tag.super_struct ? kSuperStructPropertyIndex : property_index;
+		hot_tag.byte_offset = byte_offset;
+		hot_tag.nest_level = nest_level;
+		hot_tag.is_key = (header & static_cast<uint8>(ECompactTagHeader::IsKey)) ? 1 : 0;
+		hot_tag.element_index = (header & static_cast<uint8>(ECompactTagHeader::HasElementIndex)) ? hot.ReadVarint() : 0;
+		hot_tag.flags = (header & static_cast<uint8>(ECompactTagHeader::HasFlags)) ? hot.ReadByte() : 0;
+		const bool valid = !hot.failed_ && (byte_offset <= dst.data_.size()) && FitsInBits(nest_level, 7)
+			&& FitsInBits(hot_tag.element_index, 8) && (hot_tag.super_struct || FitsInBits(property_index, 14))
+			&& (kSuperStructPropertyIndex != hot_tag.property_index || hot_tag.super_struct);
+		if (!valid)
+			return false;
+	}
+	if (hot.offset_ != hot.size_)
+		return false;
+
+	dst.tags_.reserve(tags_num);
+	const bool same_layout = (0 != layout_hash) && (GetRootLayoutHash(dst) == layout_hash);
+	if (!same_layout || !RestoreFromStructures(hot_tags, dst.data_, dst.tags_))
+	{
+		dst.tags_.clear();
+		if (!RestoreFromColdStream(hot_tags, cold, dst.tags_) || (cold.offset_ != cold.size_))
+		{
+			dst.tags_.clear();
+			return false;
+		}
+	}
+	offset = reader.offset_;
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+#include "data_template.h"
+
+// Compact serialized form of DataTemplate::tags_ (about 3 bytes per tag instead of 16).
+// Block: varint tags_num, uint32 layout hash of the root structure, varint hot_size, hot stream,
+//	varint cold_size, cold stream.
+// Hot stream, per tag: header byte (ECompactTagHeader, zigzag nest level delta in the high nibble),
+//	zigzag varint property index delta (not for super tags), zigzag varint byte offset delta,
+//	optional varint element index, optional flags byte.
+// Cold stream holds the redundant fields (property id, type, sub property offset). They are only decoded
+//	when the layout hash differs from the current structure, otherwise they are taken from the structures.
+namespace serialization
+{
+	enum class ECompactTagHeader : uint8
+	{
+		IsKey = 1 << 0,
+		HasElementIndex = 1 << 1,
+		HasFlags = 1 << 2,
+		SuperStruct = 1 << 3,
+	};
+
+	void WriteCompactTags(const DataTemplate& src, std::vector<uint8>& dst);
+	// dst.data_ must be already loaded. Returns false if the block is malformed. offset is moved past the block.
+	bool ReadCompactTags(const uint8* src, const uint32 src_size, uint32& offset, DataTemplate& dst);
+}
\ No newline at end of file
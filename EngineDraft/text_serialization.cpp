@@ -5,6 +5,11 @@
 #include "rapidjson/prettywriter.h"
 
 std::string serialization::DataTemplate::ToString() const
+{
+	return DataTemplateView(*this).ToString();
+}
+
+std::string serialization::DataTemplateView::ToString() const
 {
 	rapidjson::StringBuffer sb;
 	rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(sb);
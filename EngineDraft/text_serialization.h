@@ -30,20 +30,23 @@ namespace serialization
 	{
 		int32 indent = 0;
 
-		template <typename Writer> void SaveTag(Writer& writer, const Tag tag, const Property& property);
+		template <typename Writer> void SaveTag(Writer& writer, const Tag tag, const Property& property, const uint32 element_index);
 
 		template <typename Writer> uint32 SaveStruct(Writer& writer, const Structure& structure
-			, const DataTemplate& data_template, uint32 tag_index);
+			, const DataTemplateView& data_template, uint32 tag_index);
 
-		template <typename Writer> uint32 SaveValue(Writer& writer, const Structure& structure, const DataTemplate& data_template, uint32 tag_index);
+		// element_index is the decoded index of a container element
+		template <typename Writer> uint32 SaveValue(Writer& writer, const Structure& structure, const DataTemplateView& data_template, uint32 tag_index
+			, const uint32 element_index = 0);
 
-		template <typename Writer> uint32 SaveMany(Writer& writer, const Structure& structure, const DataTemplate& data_template, uint32 tag_index);
-		template <typename Writer> uint32 SaveMap(Writer& writer, const Structure& structure, const DataTemplate& data_template, uint32 tag_index);
+		template <typename Writer> uint32 SaveMany(Writer& writer, const Structure& structure, const DataTemplateView& data_template, uint32 tag_index);
+		template <typename Writer> void SavePackedVector(Writer& writer, const DataTemplateView& data_template, const Tag tag);
+		template <typename Writer> uint32 SaveMap(Writer& writer, const Structure& structure, const DataTemplateView& data_template, uint32 tag_index);
 
 		template <typename Writer> void SaveObj(Writer& writer, const uint8* const data, const uint32 offset);
 		template <typename Writer> void SaveTagSuperStruct(Writer& writer, const Tag tag);
 	public:
-		template <typename Writer> void Save(Writer& writer, const DataTemplate& data_template);
+		template <typename Writer> void Save(Writer& writer, const DataTemplateView& data_template);
 	};
 
 	template <typename Writer> void JsonDataStorage::SaveTagSuperStruct(Writer& writer, const Tag tag)
@@ -60,7 +63,7 @@ namespace serialization
 		writer.String(str.str());
 	}
 
-	template <typename Writer> void JsonDataStorage::SaveTag(Writer& writer, const Tag tag, const Property& property)
+	template <typename Writer> void JsonDataStorage::SaveTag(Writer& writer, const Tag tag, const Property& property, const uint32 element_index)
 	{
 		Assert(property.GetPropertyUsage() == EPropertyUsage::Main || property.GetPropertyUsage() == EPropertyUsage::SubType);
 
@@ -70,8 +73,12 @@ namespace serialization
 			<< " property_name: '" << property.GetName()
 			<< "' property_type: " << ToStr(property.GetFieldType())
 			<< " nest_level: " << tag.GetNestLevel()
-			<< " element_index: " << tag.GetElementIndex()
+			<< " element_index: " << element_index
 			<< " is_key: "<< tag.IsKey();
+		if (tag.IsRemovedKey())
+		{
+			str << " removed_key: 1";
+		}
 		writer.String(str.str());
 
 		/*
@@ -101,61 +108,111 @@ namespace serialization
 		const uint8* const ptr = data + offset;
 		return *reinterpret_cast<const std::remove_cv<M>::type*>(ptr);
 	}
-	template<typename M> static const M* GetConstPtr(const uint8* const data, const uint32 offset)
-	{
-		const uint8* const ptr = data + offset;
-		return reinterpret_cast<const std::remove_cv<M>::type*>(ptr);
-	}
 
-	template <typename Writer> uint32 JsonDataStorage::SaveMany(Writer& writer, const Structure& structure, const DataTemplate& data_template, uint32 tag_index)
+	template <typename Writer> uint32 JsonDataStorage::SaveMany(Writer& writer, const Structure& structure, const DataTemplateView& data_template, uint32 tag_index)
 	{
 		const Tag tag = data_template.tags_[tag_index - 1];
 		const auto& upper_property = structure.GetProperty(tag.GetPropertyIndex());
-		Assert(upper_property.GetFieldType() == MemberFieldType::Array || upper_property.GetFieldType() == MemberFieldType::Vector);
-		if (upper_property.GetFieldType() == MemberFieldType::Vector)
+		Assert(upper_property.GetFieldType() == MemberFieldType::Array || upper_property.GetFieldType() == MemberFieldType::Vector
+			|| upper_property.GetFieldType() == MemberFieldType::Set);
+		if (upper_property.GetFieldType() != MemberFieldType::Array)
 		{
 			writer.Key("length");
-			writer.Uint(GetConstRef<uint16>(data_template.data_.data(), tag.GetDataOffset()));
+			writer.Uint(ReadLength(data_template.data_.data(), tag.GetDataOffset()));
+			if (tag.IsPackedVector())
+			{
+				SavePackedVector<Writer>(writer, data_template, tag);
+				return tag_index;
+			}
+			if (tag.IsVectorEdits())
+			{
+				// source index of each element, -1 for a new one
+				writer.Key("sources");
+				writer.StartArray();
+				for (const uint32 source : ReadVectorEdits(data_template.data_.data(), tag.GetDataOffset()))
+				{
+					writer.Int64((kWrongID == source) ? -1 : static_cast<int64>(source));
+				}
+				writer.EndArray();
+			}
 		}
 
-		const uint32 inner_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex()
-			, (upper_property.GetFieldType() == MemberFieldType::Array) ? ESubType::Array_Element : ESubType::Vector_Element);
+		ESubType element_sub_type = ESubType::Vector_Element;
+		if (upper_property.GetFieldType() == MemberFieldType::Array)
+			element_sub_type = ESubType::Array_Element;
+		else if (upper_property.GetFieldType() == MemberFieldType::Set)
+			element_sub_type = ESubType::Set_Element;
+		const uint32 inner_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), element_sub_type);
+		uint32 element_index = 0;
 		while (tag_index < data_template.TagNum())
 		{
 			const Tag inner_tag = data_template.tags_[tag_index];
-			if (upper_property.GetFieldType() == MemberFieldType::Array)
-			{
-				Assert(inner_tag.GetElementIndex() < upper_property.GetArraySize());
-			}
 			const bool expected_property_idx = inner_tag.GetPropertyIndex() == inner_property_index;//error
 			const bool expected_nest_idx = inner_tag.GetNestLevel() == tag.GetNestLevel() + 1;
 			Assert(expected_property_idx == expected_nest_idx);
 			if (!expected_property_idx || !expected_nest_idx)
 				break;
-			tag_index = SaveValue<Writer>(writer, structure, data_template, tag_index);
+			element_index = DecodeElementIndex(inner_tag.GetElementIndex(), element_index);
+			if (upper_property.GetFieldType() == MemberFieldType::Array)
+			{
+				Assert(element_index < upper_property.GetArraySize());
+			}
+			tag_index = SaveValue<Writer>(writer, structure, data_template, tag_index, element_index);
 		}
 		return tag_index;
 	}
 
-	template <typename Writer> uint32 JsonDataStorage::SaveMap(Writer& writer, const Structure& structure, const DataTemplate& data_template, uint32 tag_index)
+	template <typename Writer> void JsonDataStorage::SavePackedVector(Writer& writer, const DataTemplateView& data_template, const Tag tag)
+	{
+		const uint8* const data = data_template.data_.data();
+		const uint32 len = ReadLength(data, tag.GetDataOffset());
+		const auto element_type = static_cast<MemberFieldType>(GetConstRef<uint8>(data, tag.GetDataOffset() + GetLengthSize(len)));
+		const uint32 element_size = GetPackedElementSize(element_type);
+		writer.Key("element_type");
+		writer.String(ToStr(element_type));
+		writer.Key("values");
+		writer.StartArray();
+		for (uint32 i = 0; i < len; i++)
+		{
+			const uint32 offset = tag.GetDataOffset() + GetPackedVectorHeaderSize(len) + i * element_size;
+			switch (element_type)
+			{
+				case MemberFieldType::Int8:		writer.Int(GetConstRef<int8>(data, offset)); break;
+				case MemberFieldType::Int16:	writer.Int(GetConstRef<int16>(data, offset)); break;
+				case MemberFieldType::Int32:	writer.Int(GetConstRef<int32>(data, offset)); break;
+				case MemberFieldType::Int64:	writer.Int64(GetConstRef<int64>(data, offset)); break;
+				case MemberFieldType::UInt8:	writer.Uint(GetConstRef<uint8>(data, offset)); break;
+				case MemberFieldType::UInt16:	writer.Uint(GetConstRef<uint16>(data, offset)); break;
+				case MemberFieldType::UInt32:	writer.Uint(GetConstRef<uint32>(data, offset)); break;
+				case MemberFieldType::UInt64:	writer.Uint64(GetConstRef<uint64>(data, offset)); break;
+				case MemberFieldType::Float:	writer.Double(GetConstRef<float>(data, offset)); break;
+				case MemberFieldType::Double:	writer.Double(GetConstRef<double>(data, offset)); break;
+			}
+		}
+		writer.EndArray();
+	}
+
+	template <typename Writer> uint32 JsonDataStorage::SaveMap(Writer& writer, const Structure& structure, const DataTemplateView& data_template, uint32 tag_index)
 	{
 		const Tag tag = data_template.tags_[tag_index - 1];
 		const uint32 key_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Key);
 		const uint32 value_property_index = structure.GetSubPropertyIndex(tag.GetPropertyIndex(), ESubType::Map_Value);
-		const uint32 map_size = GetConstRef<uint16>(data_template.data_.data(), tag.GetDataOffset()); //number of keys
+		const uint32 map_size = ReadLength(data_template.data_.data(), tag.GetDataOffset()); //number of keys
 
 		writer.Key("length");
 		writer.Uint(map_size);
 
+		uint32 element_index = 0;
 		while (tag_index < data_template.TagNum())
 		{
 			const Tag inner_tag = data_template.tags_[tag_index];
 			if (inner_tag.GetNestLevel() != tag.GetNestLevel() + 1)
 				break;
-			Assert(inner_tag.GetElementIndex() < map_size);
+			element_index = DecodeElementIndex(inner_tag.GetElementIndex(), element_index);
+			Assert(element_index < map_size);
 			Assert(!!inner_tag.IsKey() == (inner_tag.GetPropertyIndex() == key_property_index));
 			Assert(!!inner_tag.IsKey() != (inner_tag.GetPropertyIndex() == value_property_index));
-			tag_index = SaveValue<Writer>(writer, structure, data_template, tag_index);
+			tag_index = SaveValue<Writer>(writer, structure, data_template, tag_index, element_index);
 		}
 		return tag_index;
 	}
@@ -168,19 +225,21 @@ namespace serialization
 		writer.Uint64(GetConstRef<ObjectID>(data, offset + sizeof(StructID)));
 	}
 
-	template <typename Writer> uint32 JsonDataStorage::SaveValue(Writer& writer, const Structure& structure, const DataTemplate& data_template, uint32 tag_index)
+	template <typename Writer> uint32 JsonDataStorage::SaveValue(Writer& writer, const Structure& structure, const DataTemplateView& data_template, uint32 tag_index
+		, const uint32 element_index)
 	{
 		const IncreaseIndentOnScope<Writer> intend(writer);
 
 		const Tag tag = data_template.tags_[tag_index];
 		tag_index++;
 		const auto& property = structure.GetProperty(tag.GetPropertyIndex());
-		SaveTag<Writer>(writer, tag, property);
+		SaveTag<Writer>(writer, tag, property, element_index);
 
 		switch (property.GetFieldType())
 		{
 			case MemberFieldType::Array:
-			case MemberFieldType::Vector:	tag_index = SaveMany<Writer>(writer, structure, data_template, tag_index); break;
+			case MemberFieldType::Vector:
+			case MemberFieldType::Set:		tag_index = SaveMany<Writer>(writer, structure, data_template, tag_index); break;
 			case MemberFieldType::Map:		tag_index = SaveMap <Writer>(writer, structure, data_template, tag_index); break;
 			case MemberFieldType::Struct:	tag_index = SaveStruct<Writer>(writer, Structure::GetStructure(property.GetOptionalStructID()), data_template, tag_index); break;
 			case MemberFieldType::ObjectPtr:SaveObj(writer, data_template.data_.data(), tag.GetDataOffset()); break;
@@ -199,13 +258,17 @@ namespace serialization
 			case MemberFieldType::UInt64:	writer.Uint64(GetConstRef<uint64>(data_template.data_.data(), tag.GetDataOffset())); break;
 			case MemberFieldType::Float:	writer.Double(GetConstRef<float>(data_template.data_.data(), tag.GetDataOffset())); break;
 			case MemberFieldType::Double:	writer.Double(GetConstRef<double>(data_template.data_.data(), tag.GetDataOffset())); break;
-			case MemberFieldType::String:	writer.String(GetConstPtr<char>(data_template.data_.data(), tag.GetDataOffset() + sizeof(uint16))
-				, GetConstRef<int16>(data_template.data_.data(), tag.GetDataOffset())); break;
+			case MemberFieldType::String:
+			{
+				const std::string_view str = data_template.GetString(tag);
+				writer.String(str.data(), static_cast<uint32>(str.size()));
+				break;
+			}
 		}
 		return tag_index;
 	}
 
-	template <typename Writer> uint32 JsonDataStorage::SaveStruct(Writer& writer, const Structure& structure, const DataTemplate& data_template, uint32 tag_index)
+	template <typename Writer> uint32 JsonDataStorage::SaveStruct(Writer& writer, const Structure& structure, const DataTemplateView& data_template, uint32 tag_index)
 	{
 		writer.Key("struct_id");
 		writer.Uint(structure.id_);
@@ -224,7 +287,7 @@ namespace serialization
 				{
 					tag_index++;
 					SaveTagSuperStruct<Writer>(writer, tag);
-					tag_index = SaveStruct<Writer>(writer, Structure::GetStructure(structure.super_id_), data_template, tag_index);
+					tag_index = SaveStruct<Writer>(writer, *structure.TryGetSuperStructure(), data_template, tag_index);
 				}
 				else
 				{
@@ -235,7 +298,7 @@ namespace serialization
 		return tag_index;
 	}
 
-	template <typename Writer> void JsonDataStorage::Save(Writer& writer, const DataTemplate& data_template)
+	template <typename Writer> void JsonDataStorage::Save(Writer& writer, const DataTemplateView& data_template)
 	{
 		writer.StartObject();
 		const Structure& structure = Structure::GetStructure(data_template.GetStructID());
@@ -0,0 +1,577 @@
+#pragma once
+#include <cstring>
+#include "reflection.h"
+#include "data_template.h"
+
+// Compile time save/load for classes with StaticReflectedMembers (see IMPLEMENT_STATIC_REGISTRATION).
+// Produces exactly the same DataTemplate as the type erased path. Types without a member list fall back to it.
+namespace serialization
+{
+	namespace typed
+	{
+		using reflection::details::GetMemberType;
+		using reflection::details::GetNumberOfPropertiesForType;
+
+		template<class C, class = void> struct HasReflectedMembers : public std::false_type {};
+		template<class C> struct HasReflectedMembers<C, std::void_t<decltype(C::StaticReflectedMembers())>>
+			: public std::true_type {};
+
+		// Where the value is described in the property table
+		struct Location
+		{
+			PropertyID property_id;
+			PropertyIndex main_property_index;
+			PropertyIndex property_index;
+			uint32 nest_level;
+			uint32 element_index;
+			bool is_key;
+
+			Location Sub(const PropertyIndex sub_property_index, const uint32 element_idx, const bool key = false) const
+			{
+				return Location{ property_id, main_property_index, sub_property_index, nest_level + 1, element_idx, key };
+			}
+		};
+
+		template<typename M> void Append(std::vector<uint8>& dst, const M& value)
+		{
+			const uint32 dst_offset = dst.size();
+			dst.resize(dst_offset + sizeof(M));
+			std::memcpy(dst.data() + dst_offset, &value, sizeof(M));
+		}
+
+		template<typename M> M Read(const DataTemplateView& src, const uint32 offset)
+		{
+			M value;
+			std::memcpy(&value, src.data_.data() + offset, sizeof(M));
+			return value;
+		}
+
+		template<typename M> constexpr bool IsNumber()
+		{
+			return GetMemberType<M>() <= MemberFieldType::Double;
+		}
+
+		inline bool SaveLength(std::vector<uint8>& dst, const uint32 len, const Flag32<SaveFlags> flags)
+		{
+			if ((0 == len) && flags[SaveFlags::SkipNativeDefaultValues])
+				return false;
+			AppendLength(dst, len);
+			return true;
+		}
+
+		template<typename M> bool SaveValue(const M& value, DataTemplate& dst, const Location& loc
+			, const Flag32<SaveFlags> flags);
+
+		// Saves the element, unless it's a skipped default value. See MustSaveElement.
+		template<typename M> bool SaveElement(const M& value, DataTemplate& dst, const Location& loc
+			, const Flag32<SaveFlags> flags, uint32& last_saved_index)
+		{
+			const Flag32<SaveFlags> element_flags = MustSaveElement(loc.element_index, last_saved_index)
+				? Flag32<SaveFlags>::Remove(flags, SaveFlags::SkipNativeDefaultValues) : flags;
+			if (!SaveValue(value, dst, loc, element_flags))
+				return false;
+			last_saved_index = loc.element_index;
+			return true;
+		}
+
+		template<class C> bool SaveStructure(const C& obj, DataTemplate& dst, const uint32 nest_level
+			, const Flag32<SaveFlags> flags);
+
+		template<typename M> bool SaveValue(const M& value, DataTemplate& dst, const Location& loc
+			, const Flag32<SaveFlags> flags)
+		{
+			constexpr MemberFieldType type = GetMemberType<M>();
+			bool packed_vector = false;
+			bool table_string = false;
+			if constexpr (MemberFieldType::Vector == type)
+			{
+				packed_vector = flags[SaveFlags::PackTrivialVectors] && IsNumber<typename M::value_type>();
+			}
+			else if constexpr (MemberFieldType::String == type)
+			{
+				table_string = details::UsesStringTable(value.size(), flags);
+			}
+			const uint32 tag_flags = (packed_vector ? static_cast<uint32>(ETagFlags::PackedVector) : 0)
+				| (table_string ? static_cast<uint32>(ETagFlags::TableString) : 0);
+			dst.tags_.emplace_back(Tag(loc.property_id, loc.property_index, loc.property_index - loc.main_property_index
+				, type, dst.data_.size(), loc.nest_level, loc.element_index, loc.is_key ? 1 : 0, tag_flags));
+
+			bool was_saved = true;
+			if constexpr (IsNumber<M>())
+			{
+				was_saved = !((M() == value) && flags[SaveFlags::SkipNativeDefaultValues]);
+				if (was_saved)
+				{
+					Append(dst.data_, value);
+				}
+			}
+			else if constexpr (MemberFieldType::String == type)
+			{
+				was_saved = !(value.empty() && flags[SaveFlags::SkipNativeDefaultValues]);
+				if (was_saved)
+				{
+					details::SaveString(dst, value, table_string);
+				}
+			}
+			else if constexpr (MemberFieldType::ObjectPtr == type)
+			{
+				was_saved = details::SaveObjectPtr(dst.data_, value, reflection::details::GetArraySizeOrStructID<M>(), flags);
+			}
+			else if constexpr (MemberFieldType::Array == type)
+			{
+				was_saved = false;
+				uint32 last_saved_index = 0;
+				for (uint32 i = 0; i < array_length<M>::value; i++)
+				{
+					was_saved |= SaveElement(value[i], dst, loc.Sub(loc.property_index + 1, i), flags, last_saved_index);
+				}
+			}
+			else if constexpr (MemberFieldType::Vector == type)
+			{
+				uint32 num = value.size();
+				was_saved = SaveLength(dst.data_, num, flags);
+				if constexpr (IsNumber<typename M::value_type>())
+				{
+					if (packed_vector)
+					{
+						if (was_saved)
+						{
+							using TElement = typename M::value_type;
+							Append(dst.data_, static_cast<uint8>(GetMemberType<TElement>()));
+							const uint8* const begin = reinterpret_cast<const uint8*>(value.data());
+							dst.data_.insert(dst.data_.end(), begin, begin + num * sizeof(TElement));
+						}
+						num = 0; // no element tags
+					}
+				}
+				uint32 last_saved_index = 0;
+				for (uint32 i = 0; i < num; i++)
+				{
+					was_saved |= SaveElement(value[i], dst, loc.Sub(loc.property_index + 2, i), flags, last_saved_index);
+				}
+			}
+			else if constexpr (MemberFieldType::Map == type)
+			{
+				was_saved = SaveLength(dst.data_, value.size(), flags);
+				const Flag32<SaveFlags> key_flags = Flag32<SaveFlags>::Remove(flags, SaveFlags::SkipNativeDefaultValues);
+				const PropertyIndex key_property_index = loc.property_index + 2;
+				const PropertyIndex value_property_index = key_property_index
+					+ GetNumberOfPropertiesForType<typename M::key_type>();
+				uint32 i = 0;
+				for (const auto& pair : value)
+				{
+					was_saved |= SaveValue(pair.first, dst, loc.Sub(key_property_index, i, true), key_flags);
+					was_saved |= SaveValue(pair.second, dst, loc.Sub(value_property_index, i), flags);
+					i++;
+				}
+			}
+			else if constexpr (MemberFieldType::Set == type)
+			{
+				was_saved = SaveLength(dst.data_, value.size(), flags);
+				const Flag32<SaveFlags> element_flags = Flag32<SaveFlags>::Remove(flags, SaveFlags::SkipNativeDefaultValues);
+				uint32 i = 0;
+				for (const auto& element : value)
+				{
+					was_saved |= SaveValue(element, dst, loc.Sub(loc.property_index + 2, i), element_flags);
+					i++;
+				}
+			}
+			else
+			{
+				static_assert(MemberFieldType::Struct == type);
+				was_saved = SaveStructure(value, dst, loc.nest_level + 1, flags);
+			}
+
+			if (!was_saved)
+			{
+				dst.tags_.pop_back();
+			}
+			return was_saved;
+		}
+
+		template<class C> bool SaveStructure(const C& obj, DataTemplate& dst, const uint32 nest_level
+			, const Flag32<SaveFlags> flags)
+		{
+			if constexpr (!HasReflectedMembers<C>::value)
+			{
+				const auto& structure = Structure::GetStructure(C::StaticGetReflectionStructureID());
+				return details::SaveStructure(reinterpret_cast<const uint8*>(&obj), dst, structure, nest_level, flags);
+			}
+			else
+			{
+				const auto old_dst_size = dst.data_.size();
+				bool was_saved = false;
+				Append(dst.data_, C::StaticGetReflectionStructureID());
+
+				using Super = typename C::ReflectionSuper;
+				if constexpr (!std::is_void<Super>::value)
+				{
+					dst.tags_.emplace_back(Tag(kSuperStructPropertyID, kSuperStructPropertyIndex, 0, MemberFieldType::Struct
+						, dst.data_.size(), nest_level, 0, 0));
+					was_saved = SaveStructure<Super>(static_cast<const Super&>(obj), dst, nest_level + 1, flags);
+					if (!was_saved)
+					{
+						dst.tags_.pop_back();
+					}
+				}
+
+				PropertyIndex property_index = 0;
+				const uint8* const base = reinterpret_cast<const uint8*>(&obj);
+				std::apply([&](const auto&... descriptors)
+				{
+					auto save_member = [&](const auto& descriptor)
+					{
+						using Descriptor = std::decay_t<decltype(descriptor)>;
+						using M = typename Descriptor::Type;
+						const M& value = *reinterpret_cast<const M*>(base + Descriptor::offset);
+						const Location loc{ Descriptor::property_id, property_index, property_index, nest_level, 0, false };
+						property_index += GetNumberOfPropertiesForType<M>();
+						was_saved |= SaveValue(value, dst, loc, flags);
+					};
+					(save_member(descriptors), ...);
+				}, C::StaticReflectedMembers());
+
+				if (!was_saved)
+				{
+					dst.data_.resize(old_dst_size);
+				}
+				return was_saved;
+			}
+		}
+
+		template<class C> uint32 LoadStructure(const DataTemplateView& src, C& obj, uint32 tag_index, ObjectFixups* fixups);
+		template<typename M> uint32 LoadValue(const DataTemplateView& src, M& dst, const PropertyIndex property_index
+			, uint32 tag_index, ObjectFixups* fixups);
+
+		// Loads a map key or a set element, like LoadDetachedValue of the type erased path. With pointers to resolve it's
+		// loaded aside and returned, fixups->inserts[insert_index] is reserved for its insert. Otherwise it's moved to dst.
+		template<typename M> std::shared_ptr<M> LoadDetachedValue(const DataTemplateView& src, M& dst, const PropertyIndex property_index
+			, uint32& tag_index, ObjectFixups* const fixups, uint32& insert_index)
+		{
+			if (!fixups)
+			{
+				tag_index = LoadValue(src, dst, property_index, tag_index, nullptr);
+				return nullptr;
+			}
+			const size_t slots_num = fixups->slots.size();
+			insert_index = static_cast<uint32>(fixups->inserts.size());
+			fixups->inserts.emplace_back(); // before the inserts of nested containers
+			auto detached = std::make_shared<M>();
+			tag_index = LoadValue(src, *detached, property_index, tag_index, fixups);
+			if (fixups->slots.size() != slots_num)
+				return detached;
+			Assert(fixups->inserts.size() == (insert_index + 1));
+			fixups->inserts.pop_back();
+			dst = std::move(*detached);
+			return nullptr;
+		}
+
+		template<typename M> uint32 LoadValue(const DataTemplateView& src, M& dst, const PropertyIndex property_index
+			, uint32 tag_index, ObjectFixups* fixups)
+		{
+			constexpr MemberFieldType type = GetMemberType<M>();
+			const Tag tag = src.tags_[tag_index];
+			Assert(tag.GetPropertyIndex() == property_index);
+			tag_index++;
+
+			auto is_inner_tag = [&](const PropertyIndex inner_property_index) -> bool
+			{
+				if (tag_index >= src.TagNum())
+					return false;
+				const Tag inner_tag = src.tags_[tag_index];
+				const bool expected_property_idx = inner_tag.GetPropertyIndex() == inner_property_index;
+				const bool expected_nest_idx = inner_tag.GetNestLevel() == (tag.GetNestLevel() + 1);
+				Assert(expected_property_idx == expected_nest_idx);
+				return expected_property_idx && expected_nest_idx;
+			};
+
+			if constexpr (IsNumber<M>())
+			{
+				dst = Read<M>(src, tag.GetDataOffset());
+			}
+			else if constexpr (MemberFieldType::String == type)
+			{
+				dst = src.GetString(tag);
+			}
+			else if constexpr (MemberFieldType::ObjectPtr == type)
+			{
+				details::LoadObjectPtr(reinterpret_cast<uint8*>(&dst), src.data_.data(), tag.GetDataOffset(), fixups);
+			}
+			else if constexpr (MemberFieldType::Array == type)
+			{
+				uint32 element_index = 0;
+				while (is_inner_tag(property_index + 1))
+				{
+					element_index = DecodeElementIndex(src.tags_[tag_index].GetElementIndex(), element_index);
+					Assert(element_index < array_length<M>::value);
+					if (element_index >= array_length<M>::value)
+						break;
+					tag_index = LoadValue(src, dst[element_index], property_index + 1, tag_index, fixups);
+				}
+			}
+			else if constexpr (MemberFieldType::Vector == type)
+			{
+				const uint32 size = ReadLength(src.data_.data(), tag.GetDataOffset());
+				if (tag.IsVectorEdits())
+				{
+					reflection::details::VectorHandler<M>::instance.Rearrange(reinterpret_cast<uint8*>(&dst)
+						, ReadVectorEdits(src.data_.data(), tag.GetDataOffset()));
+				}
+				else
+				{
+					dst.resize(size);
+				}
+				if constexpr (IsNumber<typename M::value_type>())
+				{
+					if (tag.IsPackedVector())
+					{
+						using TElement = typename M::value_type;
+						Assert(Read<uint8>(src, tag.GetDataOffset() + GetLengthSize(size)) == static_cast<uint8>(GetMemberType<TElement>()));
+						if (size)
+						{
+							std::memcpy(dst.data(), src.data_.data() + tag.GetDataOffset() + GetPackedVectorHeaderSize(size)
+								, size * sizeof(TElement));
+						}
+						return tag_index;
+					}
+				}
+				uint32 element_index = 0;
+				while (is_inner_tag(property_index + 2))
+				{
+					element_index = DecodeElementIndex(src.tags_[tag_index].GetElementIndex(), element_index);
+					Assert(element_index < size);
+					if (dst.size() <= element_index)
+					{
+						dst.resize(element_index + 1);
+					}
+					tag_index = LoadValue(src, dst[element_index], property_index + 2, tag_index, fixups);
+				}
+			}
+			else if constexpr (MemberFieldType::Map == type)
+			{
+				using TKey = typename M::key_type;
+				using TValue = typename M::mapped_type;
+				const PropertyIndex key_property_index = property_index + 2;
+				const PropertyIndex value_property_index = key_property_index + GetNumberOfPropertiesForType<TKey>();
+				const uint32 map_size = ReadLength(src.data_.data(), tag.GetDataOffset());
+				const uint32 first_tag_index = tag_index;
+
+				// Entry with pointers in the key, added after the pointers are resolved
+				using DetachedEntry = std::pair<std::shared_ptr<TKey>, TValue>;
+				std::vector<std::shared_ptr<DetachedEntry>> detached_entries(fixups ? map_size : 0); // by entry index
+				// keys_pass erases the removed keys and adds the others, values_pass loads the values
+				auto load_entries = [&](ObjectFixups* const value_fixups, const bool keys_pass, const bool values_pass) -> uint32
+				{
+					uint32 entry_tag_index = first_tag_index;
+					for (uint32 idx = 0; idx < map_size; idx++)
+					{
+						//assume proper order and full key data
+						Assert(entry_tag_index < src.TagNum());
+						const Tag key_tag = src.tags_[entry_tag_index];
+						Assert(key_tag.IsKey());
+						Assert(key_tag.GetElementIndex() == (idx % kElementIndexRange));
+						const bool removed_key = key_tag.IsRemovedKey();
+						const bool detached = fixups && detached_entries[idx];
+						TValue* value_ptr = nullptr;
+						if (!keys_pass && (removed_key || detached))
+						{
+							entry_tag_index = details::SkipValue(src, entry_tag_index);
+							if (removed_key)
+								continue;
+							value_ptr = &detached_entries[idx]->second;
+						}
+						else
+						{
+							TKey key{};
+							uint32 insert_index = kWrongID;
+							std::shared_ptr<TKey> detached_key = LoadDetachedValue(src, key, key_property_index, entry_tag_index
+								, keys_pass ? fixups : nullptr, insert_index);
+							if (detached_key && removed_key)
+							{
+								fixups->inserts[insert_index] = [&dst, detached_key]() { dst.erase(*detached_key); };
+								continue;
+							}
+							if (detached_key)
+							{
+								// the key keeps its address, so the slots in it stay valid
+								auto entry = std::make_shared<DetachedEntry>(std::move(detached_key), TValue{});
+								value_ptr = &entry->second;
+								detached_entries[idx] = entry;
+								fixups->inserts[insert_index] = [&dst, entry]() { dst[std::move(*entry->first)] = std::move(entry->second); };
+							}
+							else if (removed_key)
+							{
+								dst.erase(key);
+								continue;
+							}
+							else
+							{
+								value_ptr = &dst[key];
+							}
+						}
+						if (entry_tag_index < src.TagNum())
+						{
+							const Tag value_tag = src.tags_[entry_tag_index];
+							const bool expected_nest_lvl = value_tag.GetNestLevel() == (tag.GetNestLevel() + 1);
+							const bool expected_property_idx = value_tag.GetPropertyIndex() == value_property_index;
+							const bool proper_value = expected_nest_lvl && expected_property_idx && !value_tag.IsKey();
+							if (proper_value && values_pass)
+							{
+								Assert(value_tag.GetElementIndex() == (idx % kElementIndexRange));
+								entry_tag_index = LoadValue(src, *value_ptr, value_property_index, entry_tag_index, value_fixups);
+							}
+							else if (proper_value)
+							{
+								entry_tag_index = details::SkipValue(src, entry_tag_index);
+							}
+						}
+					}
+					return entry_tag_index;
+				};
+
+				if (!fixups || !is_flat_map<M>::value)
+				{
+					tag_index = load_entries(fixups, true, true);
+				}
+				else
+				{
+					// Values may still move while keys are added. They are loaded, when all the keys are in the map.
+					load_entries(nullptr, true, false);
+					tag_index = load_entries(fixups, false, true);
+				}
+			}
+			else if constexpr (MemberFieldType::Set == type)
+			{
+				while (is_inner_tag(property_index + 2))
+				{
+					const bool removed = src.tags_[tag_index].IsRemovedKey();
+					typename M::key_type element{};
+					uint32 insert_index = kWrongID;
+					auto detached = LoadDetachedValue(src, element, property_index + 2, tag_index, fixups, insert_index);
+					if (detached && removed)
+					{
+						fixups->inserts[insert_index] = [&dst, detached]() { dst.erase(*detached); };
+					}
+					else if (detached)
+					{
+						fixups->inserts[insert_index] = [&dst, detached]() { dst.insert(std::move(*detached)); };
+					}
+					else if (removed)
+					{
+						dst.erase(element);
+					}
+					else
+					{
+						dst.insert(std::move(element));
+					}
+				}
+			}
+			else
+			{
+				static_assert(MemberFieldType::Struct == type);
+				tag_index = LoadStructure(src, dst, tag_index, fixups);
+			}
+			return tag_index;
+		}
+
+		template<class C> uint32 LoadMember(const DataTemplateView& src, C& obj, const Tag tag, uint32 tag_index, ObjectFixups* fixups)
+		{
+			bool found = false;
+			PropertyIndex property_index = 0;
+			uint8* const base = reinterpret_cast<uint8*>(&obj);
+			std::apply([&](const auto&... descriptors)
+			{
+				auto try_load_member = [&](const auto& descriptor)
+				{
+					using Descriptor = std::decay_t<decltype(descriptor)>;
+					using M = typename Descriptor::Type;
+					const PropertyIndex member_property_index = property_index;
+					property_index += GetNumberOfPropertiesForType<M>();
+					if (found || (tag.GetPropertyIndex() != member_property_index))
+						return;
+					found = true;
+					tag_index = LoadValue(src, *reinterpret_cast<M*>(base + Descriptor::offset), member_property_index, tag_index, fixups);
+				};
+				(try_load_member(descriptors), ...);
+			}, C::StaticReflectedMembers());
+			Assert(found);
+			return found ? tag_index : (tag_index + 1);
+		}
+
+		template<class C> uint32 LoadStructure(const DataTemplateView& src, C& obj, uint32 tag_index, ObjectFixups* fixups)
+		{
+			if constexpr (!HasReflectedMembers<C>::value)
+			{
+				const auto& structure = Structure::GetStructure(C::StaticGetReflectionStructureID());
+				return details::LoadStructure(src, reinterpret_cast<uint8*>(&obj), structure, tag_index, fixups);
+			}
+			else
+			{
+				if (tag_index >= src.TagNum())
+					return tag_index;
+
+				const Tag first_tag = src.tags_[tag_index];
+				do
+				{
+					const Tag tag = src.tags_[tag_index];
+					Assert(tag.GetNestLevel() <= first_tag.GetNestLevel());
+					if (tag.GetNestLevel() != first_tag.GetNestLevel() || tag.GetElementIndex() != first_tag.GetElementIndex()
+						|| tag.IsKey() != first_tag.IsKey())
+						break;
+					if (kSuperStructPropertyIndex == tag.GetPropertyIndex())
+					{
+						tag_index++;
+						using Super = typename C::ReflectionSuper;
+						if constexpr (!std::is_void<Super>::value)
+						{
+							tag_index = LoadStructure<Super>(src, static_cast<Super&>(obj), tag_index, fixups);
+						}
+						else
+						{
+							Assert(false);
+						}
+					}
+					else
+					{
+						tag_index = LoadMember(src, obj, tag, tag_index, fixups);
+					}
+				} while (tag_index < src.TagNum());
+				return tag_index;
+			}
+		}
+	}
+
+	// The object must be exactly T, otherwise the type erased path is used
+	template<class T> void SaveFromObject(DataTemplate& dst, const T& obj, const Flag32<SaveFlags> flags)
+	{
+		static_assert(std::is_base_of<Object, T>::value, "Only objects are saved into templates");
+		Assert(kWrongID == dst.GetStructID()); //uninitialized
+		if (obj.GetReflectionStructureID() != T::StaticGetReflectionStructureID())
+		{
+			dst.SaveFromObject(&obj, flags);
+			return;
+		}
+		Assert(dst.tags_.empty() && dst.data_.empty());
+		typed::SaveStructure<T>(obj, dst, 0, flags);
+		dst.layout_hash_ = Structure::GetStructure(T::StaticGetReflectionStructureID()).GetLayoutHash();
+		Assert(dst.tags_.empty() == dst.data_.empty());
+		if (flags[SaveFlags::InternTags])
+		{
+			TagSchemaPool::Get().Intern(dst.tags_);
+		}
+	}
+
+	// The template must be saved from exactly T, otherwise the type erased path is used.
+	// Object pointers are left to the fixups (see DataTemplate::LoadIntoObjects), they are null without them.
+	template<class T> void LoadIntoObject(const DataTemplateView& src, T& obj, ObjectFixups* fixups = nullptr)
+	{
+		static_assert(std::is_base_of<Object, T>::value, "Only objects are loaded from templates");
+		if (src.GetStructID() != T::StaticGetReflectionStructureID())
+		{
+			details::LoadObject(src, &obj, fixups);
+			return;
+		}
+		Assert(!src.layout_hash_ || (src.layout_hash_ == Structure::GetStructure(T::StaticGetReflectionStructureID()).GetLayoutHash())); // see RefreshAfterLayoutChanged
+		typed::LoadStructure<T>(src, obj, 0, fixups);
+	}
+}
\ No newline at end of file
@@ -3,8 +3,15 @@
 #include <type_traits>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <algorithm>
 #include <memory>
 #include <iostream>
+#include <atomic>
+#include <thread>
 #include <windows.h>
 #include "basic_types.h"
 
@@ -128,6 +135,26 @@ constexpr uint32 HashString32(const char* const str, const uint32 value = 0x811c
 	return (str[0] == '\0') ? value : HashString32(&str[1], (value ^ uint32(str[0])) * 0x1000193);
 }
 
+constexpr uint32 HashUint32(const uint32 key, const uint32 value = 0x811c9dc5) noexcept
+{
+	uint32 hash = value;
+	for (uint32 i = 0; i < 4; i++)
+	{
+		hash = (hash ^ ((key >> (8 * i)) & 0xFF)) * 0x1000193;
+	}
+	return hash;
+}
+
+inline uint64 HashBytes64(const void* const data, const size_t size, uint64 hash = 0xcbf29ce484222325)
+{
+	const uint8* const bytes = static_cast<const uint8*>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ bytes[i]) * 0x100000001b3;
+	}
+	return hash;
+}
+
 constexpr uint64 HashString64(const char* const str)
 {
 	uint64 hash = 0xcbf29ce484222325;
@@ -139,6 +166,257 @@ constexpr uint64 HashString64(const char* const str)
 	return hash;
 }
 
+// Immutable lookup table for 32-bit keys (hash and displace). Build is slow, Find is two loads and one compare.
+// Keys are expected to be already well distributed (HashString32 results).
+template<typename V, V kMissingValue>
+class PerfectHashTable32
+{
+	struct Slot
+	{
+		uint32 key = 0;
+		V value = kMissingValue;
+	};
+
+	std::vector<uint32> seeds_;	// per bucket
+	std::vector<Slot> slots_;
+	uint32 bucket_mask_ = 0;
+	uint32 slot_mask_ = 0;
+	uint32 size_ = 0;
+
+	static uint32 BucketHash(const uint32 key)
+	{
+		uint32 h = key * 0x85EBCA6B;
+		return h ^ (h >> 15);
+	}
+
+	static uint32 SlotHash(const uint32 key, const uint32 seed)
+	{
+		uint32 h = (key ^ (seed * 0x9E3779B9)) * 0xC2B2AE35;
+		return h ^ (h >> 13);
+	}
+
+	static uint32 NextPowerOfTwo(const uint32 value)
+	{
+		uint32 result = 1;
+		while (result < value)
+		{
+			result <<= 1;
+		}
+		return result;
+	}
+
+	// Bucket seeds are searched up to kMaxSeeds, then the build starts over with twice the slots
+	static constexpr uint32 kMaxSeeds = 1 << 12;
+
+	bool TryBuild(const std::vector<std::pair<uint32, V>>& entries, const uint32 num_slots)
+	{
+		const uint32 num_buckets = NextPowerOfTwo(std::max<uint32>(1, size_ / 2));
+		bucket_mask_ = num_buckets - 1;
+		slot_mask_ = num_slots - 1;
+		seeds_.assign(num_buckets, 0);
+		slots_.assign(num_slots, Slot());
+
+		std::vector<std::vector<uint32>> buckets(num_buckets); // entry indexes
+		for (uint32 i = 0; i < size_; i++)
+		{
+			buckets[BucketHash(entries[i].first) & bucket_mask_].push_back(i);
+		}
+		std::vector<uint32> bucket_order(num_buckets);
+		for (uint32 i = 0; i < num_buckets; i++)
+		{
+			bucket_order[i] = i;
+		}
+		std::stable_sort(bucket_order.begin(), bucket_order.end(), [&buckets](uint32 a, uint32 b)
+		{
+			return buckets[a].size() > buckets[b].size();
+		});
+
+		std::vector<bool> taken(num_slots, false);
+		std::vector<uint32> bucket_slots;
+		for (const uint32 bucket_idx : bucket_order)
+		{
+			const auto& bucket = buckets[bucket_idx];
+			if (bucket.empty())
+				break;
+			bool fits = false;
+			for (uint32 seed = 0; !fits && (seed < kMaxSeeds); seed++)
+			{
+				bucket_slots.clear();
+				fits = true;
+				for (const uint32 entry_idx : bucket)
+				{
+					const uint32 slot_idx = SlotHash(entries[entry_idx].first, seed) & slot_mask_;
+					const bool used = taken[slot_idx]
+						|| (std::find(bucket_slots.begin(), bucket_slots.end(), slot_idx) != bucket_slots.end());
+					if (used)
+					{
+						fits = false;
+						break;
+					}
+					bucket_slots.push_back(slot_idx);
+				}
+				if (fits)
+				{
+					seeds_[bucket_idx] = seed;
+					for (uint32 i = 0; i < bucket.size(); i++)
+					{
+						taken[bucket_slots[i]] = true;
+						slots_[bucket_slots[i]] = Slot{ entries[bucket[i]].first, entries[bucket[i]].second };
+					}
+				}
+			}
+			if (!fits)
+				return false;
+		}
+		return true;
+	}
+
+public:
+	V Find(const uint32 key) const
+	{
+		if (0 == size_)
+			return kMissingValue;
+		const uint32 seed = seeds_[BucketHash(key) & bucket_mask_];
+		const Slot& slot = slots_[SlotHash(key, seed) & slot_mask_];
+		return (slot.key == key) ? slot.value : kMissingValue;
+	}
+
+	uint32 Size() const { return size_; }
+
+	// Keys must be unique, equal keys never fit into a bucket.
+	void Build(const std::vector<std::pair<uint32, V>>& entries)
+	{
+		size_ = static_cast<uint32>(entries.size());
+		uint32 num_slots = NextPowerOfTwo(std::max<uint32>(2, size_ + size_ / 4));
+		while (!TryBuild(entries, num_slots))
+		{
+			Assert(num_slots < (1u << 31));
+			num_slots *= 2;
+		}
+	}
+};
+
+// Sorted vector of key-value pairs with the subset of the std::map interface used by the reflection.
+// Contiguous storage, no node allocations. Iterators are invalidated by insertion.
+template<typename K, typename V, typename Compare = std::less<K>>
+class FlatMap
+{
+public:
+	using key_type = K;
+	using mapped_type = V;
+	using value_type = std::pair<K, V>;
+	using container_type = std::vector<value_type>;
+	using iterator = typename container_type::iterator;
+	using const_iterator = typename container_type::const_iterator;
+
+private:
+	container_type data_;
+
+	iterator LowerBound(const K& key)
+	{
+		return std::lower_bound(data_.begin(), data_.end(), key
+			, [](const value_type& a, const K& b) { return Compare()(a.first, b); });
+	}
+	const_iterator LowerBound(const K& key) const
+	{
+		return std::lower_bound(data_.begin(), data_.end(), key
+			, [](const value_type& a, const K& b) { return Compare()(a.first, b); });
+	}
+	bool IsMatch(const const_iterator it, const K& key) const
+	{
+		return (it != data_.end()) && !Compare()(key, it->first);
+	}
+
+public:
+	iterator begin() { return data_.begin(); }
+	iterator end() { return data_.end(); }
+	const_iterator begin() const { return data_.begin(); }
+	const_iterator end() const { return data_.end(); }
+	size_t size() const { return data_.size(); }
+	bool empty() const { return data_.empty(); }
+	void clear() { data_.clear(); }
+	void reserve(const size_t num) { data_.reserve(num); }
+
+	iterator find(const K& key)
+	{
+		const auto it = LowerBound(key);
+		return IsMatch(it, key) ? it : data_.end();
+	}
+	const_iterator find(const K& key) const
+	{
+		const auto it = LowerBound(key);
+		return IsMatch(it, key) ? it : data_.end();
+	}
+	size_t count(const K& key) const { return (find(key) != data_.end()) ? 1 : 0; }
+
+	V& operator[](const K& key)
+	{
+		auto it = LowerBound(key);
+		if (!IsMatch(it, key))
+		{
+			it = data_.emplace(it, key, V());
+		}
+		return it->second;
+	}
+
+	std::pair<iterator, bool> insert(const value_type& value)
+	{
+		auto it = LowerBound(value.first);
+		if (IsMatch(it, value.first))
+			return { it, false };
+		return { data_.insert(it, value), true };
+	}
+
+	size_t erase(const K& key)
+	{
+		const auto it = find(key);
+		if (it == data_.end())
+			return 0;
+		data_.erase(it);
+		return 1;
+	}
+
+	bool operator==(const FlatMap& other) const { return data_ == other.data_; }
+	bool operator!=(const FlatMap& other) const { return data_ != other.data_; }
+};
+
+// Number of threads used by ParallelFor for num items
+inline uint32 GetParallelForWorkersNum(const uint32 num, const uint32 batch_size)
+{
+	Assert(batch_size > 0);
+	const uint32 num_batches = (num + batch_size - 1) / batch_size;
+	const uint32 hw_threads = std::max<uint32>(1, std::thread::hardware_concurrency());
+	return std::max<uint32>(1, std::min<uint32>(hw_threads, num_batches));
+}
+
+// Calls func(begin, end, worker_index) for batches of [0, num). Workers take batches in order from a shared
+// counter, so uneven items are balanced. The calling thread is worker 0. Blocks until all batches are done.
+template<typename F> void ParallelFor(const uint32 num, const uint32 batch_size, F&& func)
+{
+	const uint32 num_workers = GetParallelForWorkersNum(num, batch_size);
+	std::atomic<uint32> next_batch_begin = 0;
+	auto worker = [&](const uint32 worker_index)
+	{
+		for (uint32 begin = next_batch_begin.fetch_add(batch_size); begin < num
+			; begin = next_batch_begin.fetch_add(batch_size))
+		{
+			func(begin, std::min<uint32>(num, begin + batch_size), worker_index);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(num_workers - 1);
+	for (uint32 worker_index = 1; worker_index < num_workers; worker_index++)
+	{
+		threads.emplace_back(worker, worker_index);
+	}
+	worker(0);
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+}
+
 //Type Detection templates
 template<typename T> struct is_vector : public std::false_type {};
 template<typename T, typename A> struct is_vector<std::vector<T, A>> : public std::true_type {};
@@ -146,6 +424,17 @@ template<typename T, typename A> struct is_vector<std::vector<T, A>> : public st
 template<typename T> struct is_map : public std::false_type {};
 template<typename K, typename T, typename P, typename A> struct is_map<std::map<K, T, P, A>> 
 	: public std::true_type {};
+template<typename K, typename T, typename H, typename E, typename A> struct is_map<std::unordered_map<K, T, H, E, A>>
+	: public std::true_type {};
+template<typename K, typename T, typename P> struct is_map<FlatMap<K, T, P>> : public std::true_type {};
+
+template<typename T> struct is_flat_map : public std::false_type {};
+template<typename K, typename T, typename P> struct is_flat_map<FlatMap<K, T, P>> : public std::true_type {};
+
+template<typename T> struct is_set : public std::false_type {};
+template<typename K, typename P, typename A> struct is_set<std::set<K, P, A>> : public std::true_type {};
+template<typename K, typename H, typename E, typename A> struct is_set<std::unordered_set<K, H, E, A>>
+	: public std::true_type {};
 
 template<typename T> struct is_std_array : public std::false_type {};
 template < class T, size_t N > struct is_std_array<std::array<T, N>> : public std::true_type {};
@@ -164,6 +453,52 @@ constexpr bool FitsInBits(const uint32 value, const uint32 num_bits)
 	return value == (mask & value);
 }
 
+// Binary stream helpers, native byte order
+template<typename T> void WriteRaw(std::ostream& os, const T* data, const uint32 num)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types are written raw");
+	if (num)
+	{
+		os.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(num) * sizeof(T));
+	}
+}
+template<typename T> void WriteRaw(std::ostream& os, const T& value)
+{
+	WriteRaw(os, &value, 1);
+}
+template<typename T> bool ReadRaw(std::istream& is, T* data, const uint32 num)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types are read raw");
+	if (num)
+	{
+		is.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(num) * sizeof(T));
+	}
+	return !is.fail();
+}
+template<typename T> bool ReadRaw(std::istream& is, T& value)
+{
+	return ReadRaw(is, &value, 1);
+}
+// Sizes read from a stream are checked against the bytes left, before anything is allocated for them.
+// The end is -1 for a stream that can't seek, nothing is checked then.
+inline std::streampos GetStreamEnd(std::istream& is)
+{
+	const std::streampos pos = is.tellg();
+	if (std::streampos(-1) == pos)
+		return pos;
+	is.seekg(0, std::ios::end);
+	const std::streampos end = is.tellg();
+	is.seekg(pos);
+	return end;
+}
+template<typename T> bool FitsInStream(std::istream& is, const std::streampos end, const uint64 num)
+{
+	if (std::streampos(-1) == end)
+		return true;
+	const std::streampos pos = is.tellg();
+	return (std::streampos(-1) != pos) && (pos <= end) && ((num * sizeof(T)) <= static_cast<uint64>(end - pos));
+}
+
 inline std::ostream& ErrorStream()
 {
 	return std::cout;